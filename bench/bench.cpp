@@ -0,0 +1,678 @@
+/*******************************************************************************
+ * Microbenchmarks for the LMIC hot paths.
+ *
+ * Runs on a workstation against the emulated SX1276 of emuradio.cpp, so no
+ * radio or wiringPi is needed. lmic.c and rng.c are included directly to
+ * reach their static functions (buildDataFrame, decodeFrame, decodeBeacon,
+ * processJoinAccept, chachaBlock).
+ *
+ * Usage: bench [-j] [-t <min seconds per benchmark>] [-f <name filter>]
+ *   -j  print results as JSON (Google Benchmark layout) instead of a table
+ *
+ *******************************************************************************/
+
+#include "lmic.c"
+#include "rng.c"
+#include "hal.h"
+#include "emuradio.h"
+#include "tick.h"
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+//////////////////////////////////////////////////
+// EMULATED HAL
+//////////////////////////////////////////////////
+
+// present a received frame (flags stay set, so every IRQ sees RXDONE)
+static void radioEmuRx (const u1_t* frame, u1_t len) {
+    emu_frame(frame, len);
+    emu.regs[0x12] = EMU_RXDONE;
+}
+
+//////////////////////////////////////////////////
+// APPLICATION CALLBACKS
+//////////////////////////////////////////////////
+
+static u1_t DEVKEY[16] = { 0x2B, 0x7E, 0x15, 0x16, 0x28, 0xAE, 0xD2, 0xA6,
+                           0xAB, 0xF7, 0x15, 0x88, 0x09, 0xCF, 0x4F, 0x3C };
+static u1_t NWKSKEY[16] = { 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+                            0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x10 };
+static u1_t APPSKEY[16] = { 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18,
+                            0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x20 };
+static const devaddr_t DEVADDR = 0x26011BDA;
+
+void os_getArtEui (u1_t* buf) { memset(buf, 0x70, 8); }
+void os_getDevEui (u1_t* buf) { memset(buf, 0x00, 8); }
+void os_getDevKey (u1_t* buf) { memcpy(buf, DEVKEY, 16); }
+void onEvent (ev_t ev) { }
+
+//////////////////////////////////////////////////
+// HARNESS
+//////////////////////////////////////////////////
+
+static double minTime = 0.5;
+static const char* filter = NULL;
+static int json = 0;
+static int nresults = 0;
+static volatile u4_t sink;
+
+static double now (clockid_t clk) {
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// run fn(arg) in batches until minTime has passed, report time per call
+static void run (const char* name, void (*fn)(int), int arg) {
+    if( filter != NULL && strstr(name, filter) == NULL )
+        return;
+    long iters = 1;
+    double real, cpu;
+    for(;;) {
+        double r0 = now(CLOCK_MONOTONIC);
+        double c0 = now(CLOCK_PROCESS_CPUTIME_ID);
+        for( long i = 0; i < iters; i++ )
+            fn(arg);
+        real = now(CLOCK_MONOTONIC) - r0;
+        cpu  = now(CLOCK_PROCESS_CPUTIME_ID) - c0;
+        if( real >= minTime )
+            break;
+        // aim for minTime with the next batch (at most 10x growth)
+        double scale = real > 0 ? minTime * 1.4 / real : 10;
+        iters = (long)(iters * (scale > 10 ? 10 : scale < 2 ? 2 : scale));
+    }
+    if( json ) {
+        printf("%s    {\n"
+               "      \"name\": \"%s\",\n"
+               "      \"run_name\": \"%s\",\n"
+               "      \"run_type\": \"iteration\",\n"
+               "      \"iterations\": %ld,\n"
+               "      \"real_time\": %.3f,\n"
+               "      \"cpu_time\": %.3f,\n"
+               "      \"time_unit\": \"ns\"\n"
+               "    }", nresults ? ",\n" : "", name, name, iters,
+               real * 1e9 / iters, cpu * 1e9 / iters);
+    } else {
+        printf("%-36s %12.1f ns %12.1f ns %12ld\n", name,
+               real * 1e9 / iters, cpu * 1e9 / iters, iters);
+    }
+    nresults++;
+}
+
+//////////////////////////////////////////////////
+// BENCHMARKS
+//////////////////////////////////////////////////
+
+static void bmAirTime (int sf) {
+    static u1_t len;
+    sink += calcAirTime(makeRps((sf_t)sf, BW125, CR_4_5, 0, 0), len++ & 63);
+}
+
+static void bmAirtimeFor (int dr) {
+    static u1_t len;
+    sink += LMIC_airtimeFor(dr, len++ % 52);
+}
+
+static void bmMaxPayload (int) {
+    static ostime_t budget;
+    sink += LMIC_maxPayloadWithin(budget++ & 0x3FFF);
+}
+
+static u1_t aesbuf[64];
+
+static void bmAes (int mode) {
+    os_copyMem(AESkey, NWKSKEY, 16);
+    if( mode & AES_MIC ) {
+        os_clearMem(AESaux, 16);
+        AESaux[0] = 0x49;
+    } else if( mode & AES_CTR ) {
+        os_clearMem(AESaux, 16);
+        AESaux[0] = 0x01;
+    }
+    sink += os_aes(mode, aesbuf, sizeof(aesbuf));
+}
+
+static void bmAesFrame (int mode) {
+    sink += os_aesFrame(mode, APPSKEY, aesbuf, 9, sizeof(aesbuf)-4);
+}
+
+// separate passes as before os_aesFrame(): cipher then MIC up, MIC then cipher down
+static u4_t twoPassCipher (u1_t* pdu, int poff, int len) {
+    if( len - poff <= 0 )
+        return 0;
+    os_clearMem(AESaux, 16);
+    AESaux[0] = AESaux[15] = 1;
+    AESaux[5] = 1;
+    os_wlsbf4(AESaux+ 6,DEVADDR);
+    os_wlsbf4(AESaux+10,1);
+    os_copyMem(AESkey,APPSKEY,16);
+    return os_aes(AES_CTR, pdu+poff, len-poff);
+}
+
+static u4_t twoPassMic (u1_t* pdu, int len) {
+    micB0(DEVADDR, 1, 1, len);
+    os_copyMem(AESkey,NWKSKEY,16);
+    return os_aes(AES_MIC, pdu, len);
+}
+
+static u4_t twoPass (u1_t mode, u1_t* pdu, int poff, int len) {
+    if( mode == AES_ENC )
+        twoPassCipher(pdu, poff, len);
+    u4_t mic = twoPassMic(pdu, len);
+    if( mode == AES_DEC )
+        twoPassCipher(pdu, poff, len);
+    return mic;
+}
+
+static u4_t fused (u1_t mode, u1_t* pdu, int poff, int len) {
+    micB0(DEVADDR, 1, 1, len);
+    os_copyMem(AESkey,NWKSKEY,16);
+    return os_aesFrame(mode, APPSKEY, pdu, poff, len);
+}
+
+static u1_t framebuf[128];
+
+// whole frame with 9 bytes of header (FHDR+port), payload after that
+static void bmFrameFused (int len) {
+    sink += fused(AES_ENC, framebuf, 9, len);
+}
+
+static void bmFrameTwoPass (int len) {
+    sink += twoPass(AES_ENC, framebuf, 9, len);
+}
+
+// os_aesFrame() against the separate passes on random frames, both directions
+static void aesFrameCheck (void) {
+    u1_t plain[127], a[127], b[127];
+    int n = 20000;
+    for( int i = 0; i < n; i++ ) {
+        int len = 1 + rand() % sizeof(plain);
+        int poff = rand() % (len + 1);
+        for( int j = 0; j < len; j++ )
+            plain[j] = rand();
+        os_copyMem(a, plain, len);
+        os_copyMem(b, plain, len);
+        u4_t ma = twoPass(AES_ENC, a, poff, len);
+        u4_t mb = fused(AES_ENC, b, poff, len);
+        if( ma != mb || memcmp(a, b, len) != 0 ) {
+            fprintf(stderr, "os_aesFrame/ENC differs: len %d poff %d\n", len, poff);
+            exit(1);
+        }
+        ma = twoPass(AES_DEC, a, poff, len);
+        mb = fused(AES_DEC, b, poff, len);
+        if( ma != mb || memcmp(a, b, len) != 0 || memcmp(b, plain, len) != 0 ) {
+            fprintf(stderr, "os_aesFrame/DEC differs: len %d poff %d\n", len, poff);
+            exit(1);
+        }
+    }
+    fprintf(stderr, "os_aesFrame: %d random frames match the two-pass cipher+MIC both ways\n", n);
+}
+
+// chachaBlock() against the RFC 7539 A.1 test vectors (zero nonce, as used by the pool)
+static void chachaCheck (void) {
+    static const struct { u1_t key31; u4_t ctr; u1_t out[64]; } tv[] = {
+        { 0, 0, { 0x76,0xb8,0xe0,0xad,0xa0,0xf1,0x3d,0x90,0x40,0x5d,0x6a,0xe5,0x53,0x86,0xbd,0x28,
+                  0xbd,0xd2,0x19,0xb8,0xa0,0x8d,0xed,0x1a,0xa8,0x36,0xef,0xcc,0x8b,0x77,0x0d,0xc7,
+                  0xda,0x41,0x59,0x7c,0x51,0x57,0x48,0x8d,0x77,0x24,0xe0,0x3f,0xb8,0xd8,0x4a,0x37,
+                  0x6a,0x43,0xb8,0xf4,0x15,0x18,0xa1,0x1c,0xc3,0x87,0xb6,0x69,0xb2,0xee,0x65,0x86 } },
+        { 0, 1, { 0x9f,0x07,0xe7,0xbe,0x55,0x51,0x38,0x7a,0x98,0xba,0x97,0x7c,0x73,0x2d,0x08,0x0d,
+                  0xcb,0x0f,0x29,0xa0,0x48,0xe3,0x65,0x69,0x12,0xc6,0x53,0x3e,0x32,0xee,0x7a,0xed,
+                  0x29,0xb7,0x21,0x76,0x9c,0xe6,0x4e,0x43,0xd5,0x71,0x33,0xb0,0x74,0xd8,0x39,0xd5,
+                  0x31,0xed,0x1f,0x28,0x51,0x0a,0xfb,0x45,0xac,0xe1,0x0a,0x1f,0x4b,0x79,0x4d,0x6f } },
+        { 1, 1, { 0x3a,0xeb,0x52,0x24,0xec,0xf8,0x49,0x92,0x9b,0x9d,0x82,0x8d,0xb1,0xce,0xd4,0xdd,
+                  0x83,0x20,0x25,0xe8,0x01,0x8b,0x81,0x60,0xb8,0x22,0x84,0xf3,0xc9,0x49,0xaa,0x5a,
+                  0x8e,0xca,0x00,0xbb,0xb4,0xa7,0x3b,0xda,0xd1,0x92,0xb5,0xc4,0x2f,0x73,0xf2,0xfd,
+                  0x4e,0x27,0x36,0x44,0xc8,0xb3,0x61,0x25,0xa6,0x4a,0xdd,0xeb,0x00,0x6c,0x13,0xa0 } },
+    };
+    for( u1_t i = 0; i < sizeof(tv)/sizeof(tv[0]); i++ ) {
+        u4_t key[8] = { 0 }, blk[16];
+        ((u1_t*)key)[31] = tv[i].key31;
+        chachaBlock(blk, key, tv[i].ctr);
+        if( memcmp(blk, tv[i].out, 64) != 0 ) {
+            fprintf(stderr, "chachaBlock differs from RFC 7539 A.1 test vector #%d\n", i+1);
+            exit(1);
+        }
+    }
+    fprintf(stderr, "chachaBlock: RFC 7539 A.1 test vectors #1-#3 match\n");
+}
+
+// LMIC_airtimeFor()/LMIC_nextTxTime() must refuse payloads that do not fit a frame,
+// up to 255 bytes (lmicd passes whatever an MQTT message carried)
+static void airtimeCheck (void) {
+    for( u1_t dr = 0; dr < DR_NONE; dr++ ) {
+        if( !validDR(dr) )
+            continue;
+        for( int plen = 0; plen <= 255; plen++ ) {
+            int fits = OFF_DAT_OPTS + (plen ? 1+plen : 0) + 4 <= upFrameMax(dr);
+            ostime_t air = LMIC_airtimeFor(dr, plen);
+            int never = os_timeDiff(LMIC_nextTxTime(plen, dr), os_getTime()) > 35000*OSTICKS_PER_SEC;
+            if( (air != 0) != fits || (!fits && !never) ) {
+                fprintf(stderr, "LMIC_airtimeFor: DR%d %d bytes %s\n", dr, plen,
+                        fits ? "refused" : "accepted");
+                exit(1);
+            }
+        }
+    }
+    fprintf(stderr, "LMIC_airtimeFor: payloads of 0..255 bytes refused exactly when beyond the frame\n");
+}
+
+// air time ledger slots must count on across the 32-bit tick wrap (~59h)
+static void dutyCheck (void) {
+    u4_t slot = LMIC.dutySlot;
+    ostime_t beg = LMIC.dutySlotBeg;
+    ostime_t t0 = (ostime_t)(osticks_t)(0 - 2*DUTY_SLOT_osticks - 7);
+    LMIC.dutySlot = 0;
+    LMIC.dutySlotBeg = t0;
+    for( s4_t m = 0; m < 60*8; m++ ) {  // a minute apart, 8h across the wrap
+        ostime_t dt = m * sec2osticks(60);
+        ostime_t early = dt - sec2osticks(1);  // TX began before the last look
+        u4_t sn = dutySlotOf(t0 + early);
+        if( sn != (u4_t)((early + DUTY_SLOT_osticks) / DUTY_SLOT_osticks - 1)
+            || (sn = dutySlotOf(t0 + dt)) != (u4_t)(dt / DUTY_SLOT_osticks) ) {
+            fprintf(stderr, "dutySlotOf: minute %d in slot %d\n", m, (s4_t)sn);
+            exit(1);
+        }
+    }
+    LMIC.dutySlot = slot;
+    LMIC.dutySlotBeg = beg;
+    fprintf(stderr, "dutySlotOf: ledger slots count on across the tick wrap\n");
+}
+
+static void bmBuildDataFrame (int plen) {
+    LMIC.pendTxLen = plen;
+    buildDataFrame();
+    sink += LMIC.dataLen;
+}
+
+// application payload: 4 byte header and two sensor records
+static u1_t appbuf[MAX_LEN_PAYLOAD];
+static txfrag_t appfrags[3];
+
+static void setFrags (int plen) {
+    int rec = (plen - 4) / 2;
+    appfrags[0].data = appbuf;       appfrags[0].len = 4;
+    appfrags[1].data = appbuf+4;     appfrags[1].len = rec;
+    appfrags[2].data = appbuf+4+rec; appfrags[2].len = plen - 4 - rec;
+}
+
+// LMIC_setTxData2: staged in pendTxData, copied into the frame, ciphered in place
+static void bmUplinkStaged (int plen) {
+    os_copyMem(LMIC.pendTxData, appbuf, plen);
+    LMIC.pendTxLen = plen;
+    LMIC.pendTxNfrags = 0;
+    buildDataFrame();
+    sink += LMIC.dataLen;
+}
+
+// LMIC_setTxDataV: gathered into the frame by the cipher pass
+static void bmUplinkGather (int plen) {
+    setFrags(plen);
+    LMIC.pendTxFrags = appfrags;
+    LMIC.pendTxNfrags = 3;
+    LMIC.pendTxLen = plen;
+    buildDataFrame();
+    sink += LMIC.dataLen;
+}
+
+// gathered frames against staged ones (ciphered ports, port 0, port 223)
+static void gatherCheck (void) {
+    static const u1_t ports[] = { 1, 0, 223 };
+    u1_t staged[MAX_LEN_FRAME];
+    LMIC.opmode |= OP_TXDATA;
+    for( u1_t p = 0; p < sizeof(ports); p++ ) {
+        LMIC.pendTxPort = ports[p];
+        for( int plen = 4; plen <= 51; plen++ ) {
+            for( int i = 0; i < plen; i++ )
+                appbuf[i] = rand();
+            u4_t seqno = LMIC.seqnoUp;
+            bmUplinkStaged(plen);
+            os_copyMem(staged, LMIC.frame, LMIC.dataLen);
+            LMIC.seqnoUp = seqno;
+            bmUplinkGather(plen);
+            if( memcmp(staged, LMIC.frame, LMIC.dataLen) != 0 ) {
+                fprintf(stderr, "gathered uplink differs: port %d len %d\n", ports[p], plen);
+                exit(1);
+            }
+        }
+    }
+    LMIC.pendTxNfrags = 0;
+    LMIC.opmode &= ~OP_TXDATA;
+    fprintf(stderr, "buildDataFrame: gathered uplinks match staged ones; payload bytes written per "
+            "n byte uplink: staged 3n (two copies, cipher in place), gathered n\n");
+}
+
+static u1_t dnframe[MAX_LEN_FRAME];
+static u1_t dnlen;
+
+// LinkCheckAns, LinkADRReq, DevStatusReq and DutyCycleReq
+static const u1_t OPTS_MACCMDS[] = {
+    MCMD_LCHK_ANS, 20, 1,
+    MCMD_LADR_REQ, (1<<4)|2, 0xFF, 0x00, 0x00,
+    MCMD_DEVS_REQ,
+    MCMD_DCAP_REQ, 0x00,
+};
+
+// worst case: 15 bytes of FOpts, every command answered in the next uplink
+static const u1_t OPTS_FULL[] = {
+    MCMD_DEVS_REQ,
+    MCMD_LADR_REQ, (1<<4)|2, 0xFF, 0x00, 0x00,
+    MCMD_SNCH_REQ, 70, 0x18, 0x4F, 0x84, 0x30,
+    MCMD_DCAP_REQ, 0x00,
+    MCMD_DEVS_REQ,
+};
+
+// DN frame with opts in FOpts followed by an encrypted application payload on port 1
+static void makeDnFrame (const u1_t* opts, u1_t olen) {
+    u1_t* d = dnframe;
+    d[OFF_DAT_HDR] = HDR_FTYPE_DADN | HDR_MAJOR_V1;
+    os_wlsbf4(d+OFF_DAT_ADDR, DEVADDR);
+    d[OFF_DAT_FCT] = olen;
+    os_wlsbf2(d+OFF_DAT_SEQNO, 1);
+    os_copyMem(d+OFF_DAT_OPTS, opts, olen);
+    int poff = OFF_DAT_OPTS + olen;
+    d[poff++] = 1; // port
+    for( int i = 0; i < 12; i++ )
+        d[poff+i] = i;
+    dnlen = poff + 12 + 4;
+    aes_cipherAppendMic(APPSKEY, NWKSKEY, DEVADDR, 1, /*dn*/1, d, poff, dnlen-4);
+}
+
+static void bmDecodeFrame (int) {
+    os_copyMem(LMIC.frame, dnframe, dnlen);
+    LMIC.dataLen = dnlen;
+    LMIC.seqnoDn = 0;
+    if( !decodeFrame() )
+        hal_failed(__FILE__, __LINE__);
+    sink += LMIC.dataLen;
+}
+
+// decode and answer: the next uplink carries the MAC answers
+static void bmMacRoundTrip (int) {
+    bmDecodeFrame(0);
+    LMIC.pendTxLen = 0;
+    buildDataFrame();
+    sink += LMIC.frame[OFF_DAT_FCT];
+}
+
+// class C frame to the last of MAX_MCAST multicast groups, 12 byte payload
+static void makeMcastFrame (void) {
+    for( u1_t i = 0; i < MAX_MCAST; i++ )
+        LMIC_addMcast(0xFF000000+i, NWKSKEY, APPSKEY, 0);
+    devaddr_t addr = 0xFF000000+MAX_MCAST-1;
+    u1_t* d = dnframe;
+    d[OFF_DAT_HDR] = HDR_FTYPE_DADN | HDR_MAJOR_V1;
+    os_wlsbf4(d+OFF_DAT_ADDR, addr);
+    d[OFF_DAT_FCT] = 0;
+    os_wlsbf2(d+OFF_DAT_SEQNO, 1);
+    int poff = OFF_DAT_OPTS;
+    d[poff++] = 1; // port
+    for( int i = 0; i < 12; i++ )
+        d[poff+i] = i;
+    dnlen = poff + 12 + 4;
+    aes_cipherAppendMic(APPSKEY, NWKSKEY, addr, 1, /*dn*/1, d, poff, dnlen-4);
+}
+
+static void bmDecodeMcast (int) {
+    os_copyMem(LMIC.frame, dnframe, dnlen);
+    LMIC.dataLen = dnlen;
+    LMIC.txrxFlags = TXRX_CLASSC;
+    for( u1_t i = 0; i < MAX_MCAST; i++ )
+        LMIC.mcast[i].seqnoDn = 0;
+    if( !decodeFrame() || LMIC.dataMcast != MAX_MCAST )
+        hal_failed(__FILE__, __LINE__);
+    sink += LMIC.dataLen;
+}
+
+// JOIN ACCEPT with a bad MIC: decrypt and MIC check, then rejected in RX1
+static void bmJoinAccept (int) {
+    os_clearMem(LMIC.frame, LEN_JA);
+    LMIC.frame[0] = HDR_FTYPE_JACC | HDR_MAJOR_V1;
+    LMIC.dataLen = LEN_JA;
+    LMIC.txrxFlags = TXRX_DNW1;
+    LMIC.opmode |= OP_TXRXPEND;
+    sink += processJoinAccept();
+}
+
+// beacon of our network with both CRCs valid
+static u1_t bcnframe[LEN_BCN];
+
+static void makeBeacon (void) {
+    u1_t* d = bcnframe;
+    os_clearMem(d, LEN_BCN);
+    os_wlsbf4(d+OFF_BCN_NETID, 0x13);
+    os_wlsbf4(d+OFF_BCN_TIME, 1234567);
+#if CFG_eu868
+    d[OFF_BCN_CRC1] = (u1_t)os_crc16(d, OFF_BCN_CRC1);
+#elif CFG_us915
+    os_wlsbf2(d+OFF_BCN_CRC1, os_crc16(d, OFF_BCN_CRC1));
+#endif
+    d[OFF_BCN_INFO] = 1;
+    os_wlsbf4(d+OFF_BCN_LAT, 0x123456);
+    os_wlsbf4(d+OFF_BCN_LON, 0x654321);
+    os_wlsbf2(d+OFF_BCN_CRC2, os_crc16(d, OFF_BCN_CRC2));
+}
+
+static void bmCrc16 (int len) {
+    sink += os_crc16(bcnframe, len);
+}
+
+// bad selects: 0 valid beacon, 1 common part corrupted (rejected on CRC1)
+static void bmDecodeBeacon (int bad) {
+    os_copyMem(LMIC.frame, bcnframe, LEN_BCN);
+    LMIC.frame[OFF_BCN_TIME] ^= bad;
+    LMIC.dataLen = LEN_BCN;
+    if( decodeBeacon() != (bad ? 0 : 2) )
+        hal_failed(__FILE__, __LINE__);
+    sink += LMIC.bcninfo.time;
+}
+
+// beacon burst: RXDONE from the radio, FIFO read and decode
+static void bmBeaconRx (int) {
+    radio_irq_handler(0);
+    if( decodeBeacon() != 2 )
+        hal_failed(__FILE__, __LINE__);
+    sink += LMIC.bcninfo.flags;
+}
+
+enum { MAX_DEPTH = 256 };
+static osjob_t jobs[MAX_DEPTH+1];
+
+static void nopJob (osjob_t* j) {
+}
+
+// reschedule one job behind a queue of depth timed jobs
+static void bmTimedCallback (int depth) {
+    sink += depth;
+    os_setTimedCallback(&jobs[MAX_DEPTH], os_getTime() + sec2osticks(3600) + depth, FUNC_ADDR(nopJob));
+}
+
+static void fillQueue (int depth) {
+    ostime_t t = os_getTime() + sec2osticks(60);
+    for( int i = 0; i < MAX_DEPTH+1; i++ )
+        os_clearCallback(&jobs[i]);
+    for( int i = 0; i < depth; i++ )
+        os_setTimedCallback(&jobs[i], t + i, FUNC_ADDR(nopJob));
+}
+
+static void bmIrqRxDone (int) {
+    radio_irq_handler(0);
+    sink += LMIC.dataLen;
+}
+
+// tick sources: calls per second of each way to read the time
+static void bmRndU2 (int) {
+    sink += os_getRndU2();
+}
+
+static void bmRadioTx (int) {
+    emu.regs[0x01] = 0x80; // back to sleep
+    os_radio(RADIO_TX);
+}
+
+static void spiReport (void) {
+    u4_t s0 = emu.spiSubmits, g0 = emu.spiSegs;
+    bmRadioTx(0);
+    fprintf(stderr, "os_radio(RADIO_TX): %u spidev ioctls with CE chip select, "
+            "%u with GPIO NSS\n", emu.spiSubmits - s0, emu.spiSegs - g0);
+}
+
+static void bmClock (int clk) {
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    sink += ts.tv_nsec;
+}
+
+static void bmTickNow (int) {
+    sink += tick_now();
+}
+
+// tick_now() against CLOCK_MONOTONIC over the whole run
+static void tickReport (double t0, osticks_t k0) {
+    double secs = now(CLOCK_MONOTONIC) - t0;
+    double ticks = (double)(osticks_t)(tick_now() - k0);
+    struct tickstat_t st;
+    tick_stats(&st);
+    fprintf(stderr, "tick source %s %.3f MHz: %u resyncs, max error %d ticks, "
+            "drift %+.2f ppm over %.1f s\n", st.source, st.freq / 1e6, st.resyncs,
+            st.maxErr, (ticks / (secs * OSTICKS_PER_SEC) - 1) * 1e6, secs);
+}
+
+//////////////////////////////////////////////////
+// MAIN
+//////////////////////////////////////////////////
+
+int main (int argc, char* argv[]) {
+    int opt;
+    while( (opt = getopt(argc, argv, "jt:f:")) != -1 ) {
+        switch( opt ) {
+        case 'j': json = 1; break;
+        case 't': minTime = atof(optarg); break;
+        case 'f': filter = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-j] [-t <seconds>] [-f <filter>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    tick_init();
+    double t0 = now(CLOCK_MONOTONIC);
+    osticks_t k0 = tick_now();
+    emuhooks.stickyIrq = 1; // every IRQ sees the frame of radioEmuRx()
+    os_init();
+    LMIC_reset();
+    LMIC_setSession(0x13, DEVADDR, NWKSKEY, APPSKEY);
+    LMIC_setAdrMode(0);
+    LMIC_setLinkCheckMode(0);
+    for( u1_t i = 0; i < sizeof(aesbuf); i++ )
+        aesbuf[i] = i;
+
+    if( json ) {
+        char host[64] = "";
+        gethostname(host, sizeof(host)-1);
+        time_t t = time(NULL);
+        char date[32];
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&t));
+        printf("{\n  \"context\": {\n"
+               "    \"date\": \"%s\",\n"
+               "    \"host_name\": \"%s\",\n"
+               "    \"num_cpus\": %ld,\n"
+               "    \"library_build_type\": \"%s\"\n"
+               "  },\n  \"benchmarks\": [\n",
+               date, host, sysconf(_SC_NPROCESSORS_ONLN),
+#if defined(__OPTIMIZE__)
+               "release"
+#else
+               "debug"
+#endif
+               );
+    } else {
+        printf("%-36s %15s %15s %12s\n", "Benchmark", "Time", "CPU", "Iterations");
+    }
+
+    char name[64];
+    for( int sf = SF7; sf <= SF12; sf++ ) {
+        snprintf(name, sizeof(name), "calcAirTime/SF%dBW125", sf + 6);
+        run(name, bmAirTime, sf);
+    }
+    run("LMIC_airtimeFor",       bmAirtimeFor, 0);
+    run("LMIC_maxPayloadWithin", bmMaxPayload, 0);
+
+    run("os_aes/ENC",        bmAes, AES_ENC);
+    run("os_aes/MIC",        bmAes, AES_MIC);
+    run("os_aes/CTR",        bmAes, AES_CTR);
+    run("os_aesFrame/ENC",   bmAesFrame, AES_ENC);
+    run("os_aesFrame/DEC",   bmAesFrame, AES_DEC);
+    static const int frameLens[] = { 13, 24, 64, 120 };
+    for( int i = 0; i < 4; i++ ) {
+        snprintf(name, sizeof(name), "frame/fused/%d", frameLens[i]);
+        run(name, bmFrameFused, frameLens[i]);
+        snprintf(name, sizeof(name), "frame/twopass/%d", frameLens[i]);
+        run(name, bmFrameTwoPass, frameLens[i]);
+    }
+    run("os_getRndU2",       bmRndU2, 0);
+
+    LMIC.opmode |= OP_TXDATA;
+    LMIC.pendTxPort = 1;
+    os_clearMem(LMIC.pendTxData, sizeof(LMIC.pendTxData));
+    run("buildDataFrame/0",  bmBuildDataFrame, 0);
+    run("buildDataFrame/11", bmBuildDataFrame, 11);
+    run("buildDataFrame/51", bmBuildDataFrame, 51);
+    run("uplink/staged/11",  bmUplinkStaged, 11);
+    run("uplink/gather/11",  bmUplinkGather, 11);
+    run("uplink/staged/51",  bmUplinkStaged, 51);
+    run("uplink/gather/51",  bmUplinkGather, 51);
+    LMIC.pendTxNfrags = 0;
+    LMIC.opmode &= ~OP_TXDATA;
+
+    makeDnFrame(OPTS_MACCMDS, sizeof(OPTS_MACCMDS));
+    run("decodeFrame/maccmds", bmDecodeFrame, 0);
+    makeDnFrame(OPTS_FULL, sizeof(OPTS_FULL));
+    run("decodeFrame/fopts15", bmDecodeFrame, 0);
+    LMIC.opmode |= OP_TXDATA;
+    run("decodeFrame+answer/fopts15", bmMacRoundTrip, 0);
+    LMIC.opmode &= ~OP_TXDATA;
+    makeMcastFrame();
+    run("decodeFrame/mcast",   bmDecodeMcast, 0);
+    run("processJoinAccept/badmic", bmJoinAccept, 0);
+
+    static const int depths[] = { 1, 8, 64, 256 };
+    for( int i = 0; i < 4; i++ ) {
+        fillQueue(depths[i]);
+        snprintf(name, sizeof(name), "os_setTimedCallback/%d", depths[i]);
+        run(name, bmTimedCallback, depths[i]);
+    }
+    fillQueue(0);
+
+    LMIC.osjob.func = FUNC_ADDR(nopJob);
+    radioEmuRx(dnframe, dnlen);
+    run("radio_irq_handler/rxdone", bmIrqRxDone, 0);
+
+    makeBeacon();
+    snprintf(name, sizeof(name), "os_crc16/%d", OFF_BCN_CRC2);
+    run(name, bmCrc16, OFF_BCN_CRC2);
+    run("decodeBeacon/full",   bmDecodeBeacon, 0);
+    run("decodeBeacon/badcrc", bmDecodeBeacon, 1);
+    radioEmuRx(bcnframe, LEN_BCN);
+    run("radio_irq_handler+decodeBeacon", bmBeaconRx, 0);
+
+    LMIC.freq = 903900000;
+    LMIC.rps = updr2rps(DR_SF7);
+    LMIC.dataLen = 24;
+    run("os_radio/tx", bmRadioTx, 0);
+
+    run("ticks/clock_gettime_raw", bmClock, CLOCK_MONOTONIC_RAW);
+    run("ticks/clock_gettime",     bmClock, CLOCK_MONOTONIC);
+    run("ticks/tick_now",          bmTickNow, 0);
+
+    if( json )
+        printf("\n  ]\n}\n");
+    tickReport(t0, k0);
+    aesFrameCheck();
+    chachaCheck();
+    airtimeCheck();
+    dutyCheck();
+    gatherCheck();
+    spiReport();
+    return 0;
+}
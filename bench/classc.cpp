@@ -0,0 +1,230 @@
+/*******************************************************************************
+ * Downlink latency of class A vs. class C, simulated in real time.
+ *
+ * Runs the LMIC against an emulated SX1276 and a minimal network server. The
+ * device sends an unconfirmed uplink every -u seconds; the server generates
+ * downlinks at random times (mean interval -i seconds). In class C (default)
+ * the server sends each downlink at once on the RX2 channel; it is received
+ * if the radio is listening there for the whole frame. In class A (-a) it is
+ * queued until the RX1 window of the next uplink. Latency is measured from
+ * the moment the server has the downlink to EV_RXCOMPLETE/EV_TXCOMPLETE.
+ *
+ * Usage: classc [-a] [-t <seconds>] [-u <uplink interval>] [-i <downlink interval>]
+ *
+ *******************************************************************************/
+
+#include "lmic.c"
+#include "hal.h"
+#include "emuradio.h"
+#include <math.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+
+//////////////////////////////////////////////////
+// EMULATED HAL
+//////////////////////////////////////////////////
+
+// downlink on air towards the device
+static u1_t dnframe[64];
+static u1_t dnlen;
+static u1_t dnOnAir;
+static osticks_t dnEnd;
+static u4_t dnLost;
+
+static u1_t listening (void) {
+    return emu_mode() == EMU_RXCONT || emu_mode() == EMU_RXSINGLE;
+}
+
+static void startDownlink (void) {
+    dnOnAir = 1;
+    dnEnd = hal_ticks() + calcAirTime(LMIC.rps, dnlen);
+}
+
+static u1_t queuedDownlink (void);
+
+// radio entered a new mode: schedule the IRQ it will raise
+static void modeChanged (u1_t mode) {
+    if( dnOnAir && !listening() ) { // left RX in the middle of a frame
+        dnOnAir = 0;
+        dnLost++;
+    }
+    if( (mode & 0x87) == (0x80|EMU_RXSINGLE) && !dnOnAir && queuedDownlink() ) {
+        // RX single: a queued (class A) downlink
+        startDownlink();
+        emu.pending = 0;
+        return;
+    }
+    emu_txrx(mode);
+    if( emu.pending == EMU_RXTOUT && dnOnAir )
+        emu.pending = 0; // receiving a frame, no timeout
+}
+
+// downlink ended while listening: RXDONE
+static u1_t downlinkEnd (void) {
+    if( !dnOnAir || os_timeDiff(hal_ticks(), dnEnd) < 0 )
+        return 0;
+    dnOnAir = 0;
+    emu_frame(dnframe, dnlen);
+    return EMU_RXDONE;
+}
+
+//////////////////////////////////////////////////
+// NETWORK SERVER
+//////////////////////////////////////////////////
+
+static u1_t NWKSKEY[16] = { 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+                            0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x10 };
+static u1_t APPSKEY[16] = { 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18,
+                            0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x20 };
+static const devaddr_t DEVADDR = 0x26011BDA;
+
+enum { MAX_DN = 4096 };
+static int classA;
+static double dnInterval = 5;
+static osticks_t nextDn;
+static u4_t ndn;                // downlinks generated
+static osticks_t created[MAX_DN];
+static u4_t qhead;              // class A: next downlink to send in RX1
+static u4_t nrx;
+static double latency[MAX_DN];  // ms
+
+static double expRand (double mean) {
+    return -mean * log(1 - rand() / (RAND_MAX + 1.0));
+}
+
+// downlink with sequence number seq carrying seq as payload
+static void buildDownlink (u4_t seq) {
+    u1_t* d = dnframe;
+    d[OFF_DAT_HDR] = HDR_FTYPE_DADN | HDR_MAJOR_V1;
+    os_wlsbf4(d+OFF_DAT_ADDR, DEVADDR);
+    d[OFF_DAT_FCT] = 0;
+    os_wlsbf2(d+OFF_DAT_SEQNO, seq);
+    int poff = OFF_DAT_OPTS;
+    d[poff++] = 1; // port
+    os_wlsbf4(d+poff, seq);
+    dnlen = poff + 4 + 4;
+    aes_cipherAppendMic(APPSKEY, NWKSKEY, DEVADDR, seq, /*dn*/1, d, poff, dnlen-4);
+}
+
+static u1_t queuedDownlink (void) {
+    if( !classA || qhead == ndn )
+        return 0;
+    buildDownlink(qhead++);
+    return 1;
+}
+
+static void serverStep (void) {
+    osticks_t now = hal_ticks();
+    if( os_timeDiff(now, nextDn) < 0 || ndn == MAX_DN )
+        return;
+    nextDn = now + (osticks_t)(expRand(dnInterval) * OSTICKS_PER_SEC);
+    created[ndn++] = now;
+    if( classA )
+        return; // sent in the next RX1
+    qhead = ndn;
+    if( dnOnAir || !listening() ) { // device TXing or in a window on another channel
+        dnLost++;
+        return;
+    }
+    buildDownlink(ndn-1);
+    startDownlink();
+}
+
+//////////////////////////////////////////////////
+// APPLICATION
+//////////////////////////////////////////////////
+
+static double upInterval = 10;
+static osjob_t sendjob;
+static u1_t payload[11] = "0123456789";
+
+void os_getArtEui (u1_t* buf) { memset(buf, 0, 8); }
+void os_getDevEui (u1_t* buf) { memset(buf, 0, 8); }
+void os_getDevKey (u1_t* buf) { memset(buf, 0, 16); }
+
+static void send (osjob_t* j) {
+    LMIC_setTxData2(1, payload, sizeof(payload), 0);
+}
+
+static void received (void) {
+    if( LMIC.dataLen < 4 )
+        return;
+    u4_t seq = os_rlsbf4(LMIC.frame + LMIC.dataBeg);
+    if( seq < ndn && nrx < MAX_DN )
+        latency[nrx++] = osticks2us((osticks_t)(hal_ticks() - created[seq])) / 1000.0;
+}
+
+void onEvent (ev_t ev) {
+    switch( ev ) {
+    case EV_TXCOMPLETE:
+        received();
+        os_setTimedCallback(&sendjob, os_getTime() + (ostime_t)(upInterval * OSTICKS_PER_SEC), send);
+        break;
+    case EV_RXCOMPLETE:
+        received();
+        break;
+    default:
+        break;
+    }
+}
+
+static int cmpDouble (const void* a, const void* b) {
+    double d = *(const double*)a - *(const double*)b;
+    return d < 0 ? -1 : d > 0;
+}
+
+//////////////////////////////////////////////////
+// MAIN
+//////////////////////////////////////////////////
+
+int main (int argc, char* argv[]) {
+    int opt;
+    double secs = 60;
+    while( (opt = getopt(argc, argv, "at:u:i:")) != -1 ) {
+        switch( opt ) {
+        case 'a': classA = 1; break;
+        case 't': secs = atof(optarg); break;
+        case 'u': upInterval = atof(optarg); break;
+        case 'i': dnInterval = atof(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-a] [-t <seconds>] [-u <uplink interval>] [-i <downlink interval>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    emuhooks.modeChanged = modeChanged;
+    emuhooks.poll = downlinkEnd;
+    emuhooks.yield = 1;
+    os_init();
+    LMIC_reset();
+    LMIC_setSession(0x13, DEVADDR, NWKSKEY, APPSKEY);
+    LMIC_setAdrMode(0);
+    LMIC_setLinkCheckMode(0);
+    LMIC_setDrTxpow(DR_SF7, 14);
+    if( !classA )
+        LMIC_setClassC(1);
+    send(&sendjob);
+
+    osticks_t end = hal_ticks() + (osticks_t)(secs * OSTICKS_PER_SEC);
+    nextDn = hal_ticks() + (osticks_t)(expRand(dnInterval) * OSTICKS_PER_SEC);
+    while( os_timeDiff(hal_ticks(), end) < 0 ) {
+        serverStep();
+        os_runloop_once();
+    }
+
+    printf("class %c: %u downlinks, %u received, %u lost on air", classA ? 'A' : 'C', ndn, nrx, dnLost);
+    if( classA )
+        printf(", %u still queued", ndn - qhead);
+    printf("\n");
+    if( nrx ) {
+        qsort(latency, nrx, sizeof(latency[0]), cmpDouble);
+        double sum = 0;
+        for( u4_t i = 0; i < nrx; i++ )
+            sum += latency[i];
+        printf("latency ms: min %.1f avg %.1f p50 %.1f p99 %.1f max %.1f\n", latency[0], sum / nrx,
+               latency[nrx/2], latency[nrx*99/100], latency[nrx-1]);
+    }
+    return 0;
+}
@@ -0,0 +1,252 @@
+/*******************************************************************************
+ * Device side ADR (LMIC_setDevAdr) against fixed data rates, in virtual time.
+ *
+ * Runs the LMIC (built with CFG_energy) against the emulated SX1276 and a
+ * network server behind a link with a fixed path loss and Gaussian fading
+ * (-f dB). The device sends a confirmed uplink every 60s (+jitter); the
+ * gateway hears it if its power minus the loss is above the sensitivity of
+ * its DR, and then answers with an ACK in RX1 at -p dBm, which the device
+ * receives under the same rule. The ACK carries the RSSI and SNR it arrived
+ * with (noise floor -174dBm/Hz + 6dB; below it the packet RSSI reads the
+ * noise). Each loss is run with three policies:
+ *   SF7     LMIC_setDrTxpow(DR_SF7, max) as lmicd without -m (confirmed
+ *           retries still lower the DR)
+ *   slow    the slowest 125kHz DR at max power
+ *   devadr  LMIC_setDevAdr(-m, -p) starting from SF7
+ * Reported: uplinks that reached the gateway, transmissions per uplink, air
+ * time and radio energy per delivered uplink (retries included) and the
+ * DR/power at the end. Time is virtual, in ticks.
+ *
+ * Usage: devadr [-n <uplinks>] [-m <margin dB>] [-f <fading dB>] [-p <gateway dBm>] [-s <seed>]
+ *
+ *******************************************************************************/
+
+#include "lmic.c"
+#include "hal.h"
+#include "energy.h"
+#include "emuradio.h"
+#include <math.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+//////////////////////////////////////////////////
+// HOST AND RADIO EMULATION
+//////////////////////////////////////////////////
+
+static osticks_t vnow;      // virtual time
+static osticks_t sleepUntil;
+static u1_t sleepTimed;
+
+static double gauss (double sigma) {
+    double u = (rand() + 1.0) / (RAND_MAX + 2.0), v = rand() / (RAND_MAX + 1.0);
+    return sigma * sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+//////////////////////////////////////////////////
+// NETWORK
+//////////////////////////////////////////////////
+
+static u1_t NWKSKEY[16] = { 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+                            0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x10 };
+static u1_t APPSKEY[16] = { 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18,
+                            0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x20 };
+static const devaddr_t DEVADDR = 0x26011BDA;
+
+#if defined(CFG_eu868)
+enum { SLOW_DR = DR_SF12, MAX_POW = 14, GW_POW = 14 };
+static const double LOSSES[] = { 120, 125, 130, 135, 140, 145, 150 };
+#else
+enum { SLOW_DR = DR_SF10, MAX_POW = 30, GW_POW = 27 };
+static const double LOSSES[] = { 130, 140, 145, 150, 155, 160, 165 };
+#endif
+
+static double loss, fading = 3, gwPow = GW_POW;  // dB, dBm
+static u1_t upHeard;         // gateway heard the current uplink (any attempt)
+static u1_t ackDue;          // ... and answers the last attempt in RX1
+static u1_t window;          // windows opened since the attempt
+static u4_t dnSeq;
+static u4_t nup, ndelivered, ntx;
+static double airMs;
+
+// dBm at the receiver
+static double rxPower (double txpow) {
+    return txpow - loss + gauss(fading);
+}
+
+static double noiseFloor (rps_t rps) {
+    return -174 + 10*log10(125000 << getBw(rps)) + 6;
+}
+
+// ACK for the device in the FIFO, with the RSSI/SNR registers for dbm
+static void ackFrame (double dbm) {
+    u1_t d[MAX_LEN_FRAME];
+    d[OFF_DAT_HDR] = HDR_FTYPE_DADN | HDR_MAJOR_V1;
+    os_wlsbf4(d+OFF_DAT_ADDR, DEVADDR);
+    d[OFF_DAT_FCT] = FCT_ACK;
+    os_wlsbf2(d+OFF_DAT_SEQNO, dnSeq);
+    aes_cipherAppendMic(NULL, NWKSKEY, DEVADDR, dnSeq, /*dn*/1, d, OFF_DAT_OPTS, OFF_DAT_OPTS);
+    dnSeq++;
+    emu_frame(d, OFF_DAT_OPTS+4);
+    double snr = dbm - noiseFloor(LMIC.rps);
+    int rssi = (int)lround(snr < 0 ? dbm - snr : dbm) + 125;  // radio.c: dBm = PktRssiValue - 125
+    emu.regs[0x19] = (u1_t)(s1_t)lround((snr > 31 ? 31 : snr) * 4);
+    emu.regs[0x1A] = rssi < 0 ? 0 : rssi > 255 ? 255 : rssi;
+}
+
+static void modeChanged (u1_t mode) {
+    switch( mode & 0x87 ) {
+    case 0x80 + EMU_TX: { // uplink attempt
+        osticks_t air = calcAirTime(LMIC.rps, LMIC.dataLen);
+        airMs += osticks2us(air) / 1000.0;
+        ntx++;
+        ackDue = rxPower(LMIC.txpow) >= getSensitivity(LMIC.rps);
+        upHeard |= ackDue;
+        window = 0;
+        emu.pending = EMU_TXDONE;
+        emu.dueAt = vnow + air;
+        break;
+    }
+    case 0x80 + EMU_RXSINGLE: { // ACK in RX1 if both ways get through
+        double dbm = rxPower(gwPow);
+        if( ++window == 1 && ackDue && dbm >= getSensitivity(LMIC.rps) ) {
+            ackFrame(dbm);
+            emu.pending = EMU_RXDONE;
+            emu.dueAt = vnow + calcAirTime(LMIC.rps, OFF_DAT_OPTS+4);
+        } else {
+            u4_t symUs = ((u8_t)1000000 << (getSf(LMIC.rps) - SF7 + 7)) / (125000 << getBw(LMIC.rps));
+            emu.pending = EMU_RXTOUT;
+            emu.dueAt = vnow + us2osticks(LMIC.rxsyms * symUs);
+        }
+        break;
+    }
+    default:
+        emu.pending = 0;
+        break;
+    }
+}
+
+// idle until the next IRQ or the timer
+void hal_sleep (void) {
+    osticks_t t = sleepTimed ? sleepUntil : vnow + sec2osticks(1);
+    if( emu.pending && os_timeDiff(emu.dueAt, t) < 0 )
+        t = emu.dueAt;
+    if( os_timeDiff(t, vnow) > 0 )
+        vnow = t;
+    sleepTimed = 0;
+}
+
+osticks_t hal_ticks (void) {
+    return vnow;
+}
+
+void hal_waitUntil (osticks_t time) {
+    if( os_timeDiff(time, vnow) > 0 )
+        vnow = time;
+}
+
+u1_t hal_checkTimer (osticks_t time) {
+    if( os_timeDiff(time, vnow) <= 0 )
+        return 1;
+    sleepUntil = time;
+    sleepTimed = 1;
+    return 0;
+}
+
+//////////////////////////////////////////////////
+// APPLICATION
+//////////////////////////////////////////////////
+
+static osjob_t sendjob;
+static u1_t payload[11] = "0123456789";
+
+void os_getArtEui (u1_t* buf) { memset(buf, 0, 8); }
+void os_getDevEui (u1_t* buf) { memset(buf, 0, 8); }
+void os_getDevKey (u1_t* buf) { memset(buf, 0, 16); }
+
+static void send (osjob_t* j) {
+    upHeard = 0;
+    LMIC_setTxData2(1, payload, sizeof(payload), 1);
+}
+
+void onEvent (ev_t ev) {
+    if( ev != EV_TXCOMPLETE )
+        return;
+    nup++;
+    ndelivered += upHeard;
+    os_setTimedCallback(&sendjob, os_getTime() + sec2osticks(60) + (rand() & 0xFFFF), send);
+}
+
+// radio energy outside sleep so far in uJ
+static double radioEnergy (void) {
+    struct energystat_t st;
+    energy_stats(&st);
+    return (st.nJ[RSTATE_STANDBY] + st.nJ[RSTATE_TX] + st.nJ[RSTATE_RX]) / 1000.0;
+}
+
+static char table[4096];  // printed at the end, the LMIC logs every TX to stdout
+static int tlen;
+
+static void runRow (u4_t n, const char* policy, int margin) {
+    os_init();
+    LMIC_reset();
+    LMIC_setSession(0x13, DEVADDR, NWKSKEY, APPSKEY);
+    LMIC_setAdrMode(0);
+    LMIC_setLinkCheckMode(0);
+    LMIC_setDrTxpow(margin < 0 ? (dr_t)SLOW_DR : DR_SF7, MAX_POW);
+    if( margin > 0 )
+        LMIC_setDevAdr(margin, (s1_t)gwPow);
+    dnSeq = nup = ndelivered = ntx = 0;
+    airMs = 0;
+    double uj = radioEnergy();
+    send(&sendjob);
+    while( nup < n ) {
+        os_runloop_once();
+        vnow++;  // a pass takes a tick (engineUpdate re-runs a TX due in TX_RAMPUP at once)
+    }
+    uj = radioEnergy() - uj;
+    u4_t d = ndelivered ? ndelivered : 1;
+    tlen += snprintf(table + tlen, sizeof(table) - tlen, "%6.0f %-8s %9.1f%% %8.2f %12.1f %10.1f %4d %4d\n",
+                     loss, policy, 100.0 * ndelivered / n, (double)ntx / n, airMs / d, uj / d / 1000,
+                     LMIC.datarate, LMIC.txpow);
+}
+
+//////////////////////////////////////////////////
+// MAIN
+//////////////////////////////////////////////////
+
+int main (int argc, char* argv[]) {
+    int opt;
+    int margin = 5;
+    u4_t n = 200;
+    while( (opt = getopt(argc, argv, "n:m:f:p:s:")) != -1 ) {
+        switch( opt ) {
+        case 'n': n = atoi(optarg); break;
+        case 'm': margin = atoi(optarg); break;
+        case 'f': fading = atof(optarg); break;
+        case 'p': gwPow = atof(optarg); break;
+        case 's': srand(atoi(optarg)); break;
+        default:
+            fprintf(stderr, "usage: %s [-n <uplinks>] [-m <margin dB>] [-f <fading dB>] [-p <gateway dBm>] [-s <seed>]\n", argv[0]);
+            return 1;
+        }
+    }
+    if( margin < 1 ) {
+        fprintf(stderr, "margin must be at least 1dB\n");
+        return 1;
+    }
+
+    emuhooks.modeChanged = modeChanged;
+    for( u1_t i = 0; i < sizeof(LOSSES)/sizeof(LOSSES[0]); i++ ) {
+        loss = LOSSES[i];
+        runRow(n, "SF7", 0);
+        runRow(n, "slow", -1);
+        runRow(n, "devadr", margin);
+    }
+    printf("%u confirmed uplinks per row, margin %d dB, fading %.1f dB, gateway %.0f dBm\n",
+           n, margin, fading, gwPow);
+    printf("%6s %-8s %10s %8s %12s %10s %4s %4s\n", "Loss", "Policy", "Delivered", "TX/upl",
+           "Air ms/upl", "mJ/upl", "DR", "dBm");
+    fputs(table, stdout);
+    printf("per delivered uplink, retries included; DR/dBm at the end of the row\n");
+    return 0;
+}
@@ -0,0 +1,159 @@
+/*******************************************************************************
+ * Emulated SX1276 behind the HAL, shared by the benchmarks.
+ *******************************************************************************/
+
+#include "emuradio.h"
+#include "hal.h"
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+
+OS_TLS struct emuradio_t emu;
+struct emuhooks_t emuhooks;
+
+void emu_txrx (u1_t mode) {
+    switch( (mode & 0x80) ? mode & 0x07 : 0 ) { // FSK not emulated
+    case EMU_TX: // done after the air time
+        emu.pending = EMU_TXDONE;
+        emu.dueAt = hal_ticks() + calcAirTime(LMIC.rps, LMIC.dataLen);
+        break;
+    case EMU_RXSINGLE: // nothing on air
+        emu.pending = EMU_RXTOUT;
+        emu.dueAt = hal_ticks();
+        break;
+    default:
+        emu.pending = 0;
+        break;
+    }
+}
+
+void emu_frame (const u1_t* frame, u1_t len) {
+    memcpy(emu.fifo, frame, len);
+    emu.regs[0x10] = 0;    // FifoRxCurrentAddr
+    emu.regs[0x13] = len;  // RxNbBytes
+    emu.regs[0x19] = 24;   // PktSnrValue: 6dB
+    emu.regs[0x1A] = 80;   // PktRssiValue
+}
+
+u1_t emu_mode (void) {
+    return (emu.regs[0x01] & 0x80) ? emu.regs[0x01] & 0x07 : 0;
+}
+
+void hal_init (void) {
+    memset(emu.regs, 0, sizeof(emu.regs));
+    emu.regs[0x01] = 0x80;  // RegOpMode: LoRa, sleep
+    emu.regs[0x42] = 0x12;  // RegVersion: SX1276
+    emu.pending = 0;
+}
+
+void hal_pin_nss (u1_t val) {
+    if( val == 0 )
+        emu.spiFirst = 1;
+}
+
+void hal_pin_rxtx (u1_t val) {
+}
+
+void hal_pin_rst (u1_t val) {
+}
+
+u1_t hal_spi (u1_t out) {
+    if( emuhooks.spiByte )
+        emuhooks.spiByte();
+    if( emu.spiFirst ) {
+        emu.spiFirst = 0;
+        emu.spiAddr = out;
+        if( (out & 0x7F) == 0 )
+            emu.fifoPtr = emu.regs[0x0D];
+        return 0;
+    }
+    u1_t a = emu.spiAddr & 0x7F;
+    if( emu.spiAddr & 0x80 ) {
+        if( a == 0 ) {
+            emu.fifo[emu.fifoPtr++] = out;
+        } else if( a == 0x12 ) { // IrqFlags: write 1 to clear
+            if( !emuhooks.stickyIrq ) {
+                emu.regs[a] &= ~out;
+                if( emuhooks.flagsCleared )
+                    emuhooks.flagsCleared();
+            }
+        } else {
+            emu.regs[a] = out;
+            if( a == 0x01 && emuhooks.modeChanged )
+                emuhooks.modeChanged(out);
+        }
+        if( a == 0x0D )
+            emu.fifoPtr = out;
+        return 0;
+    }
+    if( a == 0 )
+        return emu.fifo[emu.fifoPtr++];
+    if( a == 0x2C ) // RegRssiWideband: noise for radio_rand1 seeding
+        return rand();
+    return emu.regs[a];
+}
+
+void hal_spi_xfer (u1_t* buf, u2_t len) {
+    emu.spiSubmits++;
+    emu.spiSegs++;
+    hal_pin_nss(0);
+    for( u2_t i = 0; i < len; i++ )
+        buf[i] = hal_spi(buf[i]);
+    hal_pin_nss(1);
+}
+
+void hal_spi_batch (const u1_t* buf, const u1_t* seglen, u1_t nseg) {
+    emu.spiSubmits++;
+    emu.spiSegs += nseg;
+    for( u1_t i = 0; i < nseg; i++ ) {
+        hal_pin_nss(0);
+        for( u1_t b = 0; b < seglen[i]; b++ )
+            hal_spi(*buf++);
+        hal_pin_nss(1);
+    }
+}
+
+void hal_disableIRQs (void) {
+    emu.irqlevel++;
+}
+
+void hal_enableIRQs (void) {
+    if( --emu.irqlevel != 0 )
+        return;
+    u1_t flag = emuhooks.poll ? emuhooks.poll() : 0;
+    if( flag == 0 && emu.pending && os_timeDiff(hal_ticks(), emu.dueAt) >= 0 ) {
+        flag = emu.pending;
+        emu.pending = 0;
+    }
+    if( flag == 0 )
+        return;
+    emu.regs[0x12] |= flag;
+    if( flag != EMU_RXDONE || emu_mode() != EMU_RXCONT ) // continuous RX keeps listening
+        emu.regs[0x01] = (emu.regs[0x01] & ~0x07) | EMU_STANDBY;
+    emu.irqlevel++;
+    radio_irq_handler(flag == EMU_RXTOUT ? 1 : 0); // DIO1 / DIO0
+    emu.irqlevel--;
+}
+
+void hal_failed (const char* file, u2_t line) {
+    fprintf(stderr, "FAILURE %s:%d\n", file, line);
+    exit(1);
+}
+
+__attribute__((weak)) void hal_sleep (void) {
+    if( emuhooks.yield )
+        sched_yield();
+}
+
+__attribute__((weak)) osticks_t hal_ticks (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (osticks_t)((u8_t)ts.tv_sec * OSTICKS_PER_SEC + (u8_t)ts.tv_nsec * OSTICKS_PER_SEC / 1000000000);
+}
+
+__attribute__((weak)) void hal_waitUntil (osticks_t time) {
+}
+
+__attribute__((weak)) u1_t hal_checkTimer (osticks_t time) {
+    return os_timeDiff(time, hal_ticks()) <= 0;
+}
@@ -0,0 +1,65 @@
+/*******************************************************************************
+ * Emulated SX1276 behind the HAL, shared by the benchmarks.
+ *
+ * Register file, FIFO and SPI framing of the radio, so the LMIC runs on a
+ * workstation without a radio or wiringPi. What happens on air is up to the
+ * bench: emuhooks.modeChanged sees every RegOpMode write and schedules the
+ * IRQ the new mode raises (emu.pending at emu.dueAt), emuhooks.poll can raise
+ * one besides (e.g. a downlink that has ended). hal_enableIRQs() delivers a
+ * due IRQ once the level drops to 0. The state is per thread with
+ * CFG_multiradio. hal_ticks/hal_sleep/hal_waitUntil/hal_checkTimer run on the
+ * real clock and are weak: a bench in virtual time defines its own.
+ *******************************************************************************/
+
+#ifndef _emuradio_h_
+#define _emuradio_h_
+
+#include "lmic.h"
+
+// IrqFlags bits the emulation raises
+enum { EMU_TXDONE = 0x08, EMU_RXDONE = 0x40, EMU_RXTOUT = 0x80 };
+// RegOpMode mode bits
+enum { EMU_STANDBY = 0x01, EMU_TX = 0x03, EMU_RXCONT = 0x05, EMU_RXSINGLE = 0x06 };
+
+struct emuradio_t {
+    u1_t      regs[128];
+    u1_t      fifo[256];
+    u1_t      spiFirst;
+    u1_t      spiAddr;
+    u1_t      fifoPtr;
+    u1_t      irqlevel;
+    u1_t      pending;     // IrqFlags bit to raise (0=none)
+    osticks_t dueAt;       // when to raise it
+    u4_t      spiSubmits;  // spidev ioctls with chip select on CE
+    u4_t      spiSegs;     // ... with chip select on a GPIO (one per segment)
+};
+
+struct emuhooks_t {
+    void (*modeChanged) (u1_t mode);  // RegOpMode written (NULL=no IRQs scheduled)
+    u1_t (*poll) (void);              // IRQs enabled again: IrqFlags bit to raise now (0=none)
+    void (*spiByte) (void);           // every SPI byte (virtual time)
+    void (*flagsCleared) (void);      // IrqFlags written (unless stickyIrq)
+    u1_t stickyIrq;                   // IrqFlags writes ignored, flags stay set
+    u1_t yield;                       // hal_sleep() yields the CPU
+};
+
+extern OS_TLS struct emuradio_t emu;
+extern struct emuhooks_t emuhooks;
+
+/*
+ * modeChanged for a radio alone on air: TXDONE after the frame's air time,
+ * every single RX times out at once.
+ */
+void emu_txrx (u1_t mode);
+
+/*
+ * put a received frame into the FIFO (SNR 6dB, RSSI -45dBm), IrqFlags untouched.
+ */
+void emu_frame (const u1_t* frame, u1_t len);
+
+/*
+ * RegOpMode mode bits (EMU_*) of a LoRa mode, 0 in FSK mode.
+ */
+u1_t emu_mode (void);
+
+#endif // _emuradio_h_
@@ -0,0 +1,99 @@
+/*******************************************************************************
+ * Reassembly throughput and memory of the fragmentation engine (CFG_frag).
+ *
+ * Splits a random image into DataFragment payloads, appends parity fragments
+ * built with the same matrix lines as the receiver, drops fragments at random
+ * and feeds the rest to frag_rx(). frag.c is included directly to reach
+ * matrixLine().
+ *
+ * Usage: frag [-s <image bytes>] [-f <fragment size>] [-l <loss %>] [-r <parity %>]
+ *             [-m <parity rows kept>] [-o <file>]
+ *
+ *******************************************************************************/
+
+#include "frag.c"
+#include <stdlib.h>
+#include <unistd.h>
+
+void hal_failed (const char* file, u2_t line) {
+    fprintf(stderr, "FAILURE %s:%d\n", file, line);
+    exit(1);
+}
+
+int main (int argc, char* argv[]) {
+    int opt;
+    u4_t size = 100*1024;
+    int fragSize = 48;
+    double loss = 10, parity = 20;
+    int maxRows = -1;
+    const char* path = NULL;
+    while( (opt = getopt(argc, argv, "s:f:l:r:m:o:")) != -1 ) {
+        switch( opt ) {
+        case 's': size = atoi(optarg); break;
+        case 'f': fragSize = atoi(optarg); break;
+        case 'l': loss = atof(optarg); break;
+        case 'r': parity = atof(optarg); break;
+        case 'm': maxRows = atoi(optarg); break;
+        case 'o': path = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-s <image bytes>] [-f <fragment size>] [-l <loss %%>] [-r <parity %%>] [-m <rows>] [-o <file>]\n", argv[0]);
+            return 1;
+        }
+    }
+    u2_t nbFrag = (size + fragSize-1) / fragSize;
+    u2_t nbParity = nbFrag * parity / 100;
+    u1_t padding = nbFrag*fragSize - size;
+    if( fragSize < 1 || fragSize > MAX_LEN_PAYLOAD-4 || nbFrag+nbParity > FRAG_MAX_NB ) {
+        fprintf(stderr, "too many or too large fragments\n");
+        return 1;
+    }
+    u1_t* image = (u1_t*)calloc(1, nbFrag*fragSize);
+    srand(1);
+    for( u4_t i = 0; i < size; i++ )
+        image[i] = rand();
+
+    if( frag_open(path, 1, nbFrag, fragSize, padding, maxRows < 0 ? nbParity : maxRows) < 0 ) {
+        perror("frag_open");
+        return 1;
+    }
+    u1_t* line = (u1_t*)malloc(fr.mapBytes);
+    u1_t pl[MAX_LEN_PAYLOAD];
+    u4_t sent = 0, lost = 0, norows = 0;
+    u1_t res = FRAG_IGNORED;
+    for( u2_t n = 1; n <= nbFrag+nbParity && res != FRAG_DONE; n++ ) {
+        pl[0] = FRAG_DATA_FRAGMENT;
+        pl[1] = n;
+        pl[2] = (1<<6) | (n>>8);  // FragIndex 1
+        if( n <= nbFrag ) {
+            os_copyMem(pl+3, image + (n-1)*fragSize, fragSize);
+        } else {
+            matrixLine(n-nbFrag, line);
+            os_clearMem(pl+3, fragSize);
+            for( u2_t j = 0; j < nbFrag; j++ )
+                if( (line[j>>3] >> (j&7)) & 1 )
+                    xorMem(pl+3, image + j*fragSize, fragSize);
+        }
+        sent++;
+        if( rand() < loss/100 * RAND_MAX ) {
+            lost++;
+            continue;
+        }
+        res = frag_rx(pl, 3+fragSize);
+        if( res == FRAG_NOROWS )
+            norows++;
+    }
+
+    struct fragstat_t st;
+    frag_stats(&st);
+    printf("image %u bytes, %u+%u fragments of %u bytes, %.0f%% loss\n", size, nbFrag, nbParity, fragSize, loss);
+    printf("sent %u, lost %u, received %u uncoded + %u parity, recovered %u, missing %u, rows dropped %u\n",
+           sent, lost, st.received, st.coded, st.recovered, st.missing, norows);
+    if( st.missing == 0 && memcmp(frag_data(), image, size) != 0 ) {
+        printf("MISMATCH\n");
+        return 1;
+    }
+    printf("reassembly %.2f ms, %.1f MB/s, heap %u bytes (%.1f%% of the image)\n", st.ns / 1e6,
+           size / (st.ns / 1e3), st.heap, 100.0 * st.heap / size);
+    frag_close();
+    return st.missing != 0;
+}
@@ -0,0 +1,282 @@
+/*******************************************************************************
+ * Gateway mode packet rate and re-arm dead time, simulated in virtual time.
+ *
+ * Runs LMIC_startGateway() against the emulated SX1276 while a stream of
+ * uplinks goes on air on its channel, one after the other with exponential
+ * gaps (mean per table row). An SPI byte takes 2us, the IRQ is serviced
+ * mean/2 + exponential(mean/2) after RXDONE (-q) and forwarding a frame takes
+ * -f ms of host time. A frame is received if the radio was in continuous RX
+ * from its preamble on and the RXDONE of the previous frame was acknowledged
+ * by the time it ends. Dead time is from the end of a received frame until
+ * the radio can report the next one; in gateway mode it already receives
+ * the next preamble meanwhile. Time runs in ns, the LMIC sees 50us ticks.
+ *
+ * "gateway" is RADIO_RXGW: the modem stays in RX, the IRQ handler only
+ * acknowledges RXDONE. "re-arm" stands in for a forwarder that restarts the
+ * receiver per frame: RADIO_RXON (beacon scan) puts the radio to sleep after
+ * each frame and the forward job starts it again before forwarding.
+ *
+ * Usage: gateway [-d <dr>] [-l <payload bytes>] [-n <frames per row>]
+ *                [-q <IRQ latency ms>] [-f <forward ms>] [-s <seed>]
+ *
+ *******************************************************************************/
+
+#include "lmic.h"
+#include "hal.h"
+#include "emuradio.h"
+#include <math.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+//////////////////////////////////////////////////
+// HOST AND RADIO EMULATION
+//////////////////////////////////////////////////
+
+static u8_t vns;            // virtual time in ns (a tick is 50us)
+static double irqLat = 0.1, fwdMs = 0.2;  // ms
+
+static osticks_t ticks (u8_t ns) {
+    return (osticks_t)(ns * OSTICKS_PER_SEC / 1000000000);
+}
+
+static double expRand (double mean) {
+    return -mean * log(1 - rand() / (RAND_MAX + 1.0));
+}
+
+// host latency in ns
+static u8_t latency (double ms) {
+    return (u8_t)(1e6 * (ms/2 + expRand(ms/2)));
+}
+
+//////////////////////////////////////////////////
+// UPLINKS ON AIR
+//////////////////////////////////////////////////
+
+enum { MAX_FRAMES = 100000 };
+
+static u1_t plen = 20;
+static double gapMs;
+static u4_t nframes;              // frames per row
+static u8_t frStart, frEnd;       // next frame on air
+static u4_t frSeq;
+static u8_t ends[256];            // true end by sequence number (low byte)
+static u1_t listening;            // radio in continuous RX ...
+static u8_t rxSince;              // ... since
+static u1_t rxPending;            // RXDONE raised at rxDue
+static u8_t rxDue;
+static u1_t waitReady;            // dead time running since lastEnd
+static u1_t haveReady;            // radio ready at readyAt (unless it leaves RX)
+static u8_t lastEnd, readyAt;
+static u4_t noffered, nrx, nfwd;
+static double dead[MAX_FRAMES], tsErr[MAX_FRAMES];  // us
+static u4_t ndead, nts;
+
+static void nextFrame (u8_t after) {
+    if( frSeq >= nframes ) { // row done: air stays quiet
+        frStart = frEnd = after + 2000000000;
+        return;
+    }
+    frStart = after + (u8_t)(1e6 * expRand(gapMs));
+    frEnd = frStart + (u8_t)calcAirTime(LMIC.rps, plen) * 1000000000 / OSTICKS_PER_SEC;
+}
+
+// radio able to report a frame: listening with RXDONE acknowledged
+static void checkReady (void) {
+    if( waitReady && !haveReady && listening && !rxPending && (emu.regs[0x12] & EMU_RXDONE) == 0 ) {
+        readyAt = vns;
+        haveReady = 1;
+    }
+}
+
+static void deadSample (void) {
+    if( waitReady && haveReady ) {
+        dead[ndead++] = (readyAt - lastEnd) / 1e3;
+        waitReady = 0;
+    }
+}
+
+static void frameEnded (void) {
+    noffered++;
+    deadSample();
+    if( listening && rxSince <= frStart && !rxPending && (emu.regs[0x12] & EMU_RXDONE) == 0 ) {
+        u1_t frame[256];
+        memset(frame, 0x55, plen);
+        os_wlsbf4(frame, frSeq);
+        ends[frSeq & 0xFF] = frEnd;
+        emu_frame(frame, plen);
+        rxPending = 1;
+        rxDue = frEnd + latency(irqLat);
+        nrx++;
+        lastEnd = frEnd;
+        waitReady = 1;
+        haveReady = 0;
+    }
+    frSeq++;
+}
+
+// frames ending up to time t
+static void airUntil (u8_t t) {
+    while( frSeq < nframes && frEnd <= t ) {
+        frameEnded();
+        nextFrame(frEnd);
+    }
+}
+
+static void advance (u8_t t) {
+    if( t > vns ) {
+        airUntil(t);
+        vns = t;
+    }
+}
+
+static void modeChanged (u1_t mode) {
+    if( (mode & 0x87) == 0x80 + EMU_RXCONT ) {
+        listening = 1;
+        rxSince = vns;
+    } else {
+        listening = 0;
+        haveReady = 0;
+        rxPending = 0;
+    }
+    checkReady();
+}
+
+// SPI byte at ~4MHz plus driver overhead
+static void spiByte (void) {
+    advance(vns + 2000);
+}
+
+// IRQs enabled again: RXDONE once due
+static u1_t rxDone (void) {
+    if( !rxPending || rxDue > vns )
+        return 0;
+    rxPending = 0;
+    return EMU_RXDONE;
+}
+
+// idle until the next IRQ (frames keep ending meanwhile)
+void hal_sleep (void) {
+    airUntil(vns);
+    u8_t t = frEnd;
+    if( rxPending && rxDue < t )
+        t = rxDue;
+    advance(t);
+}
+
+osticks_t hal_ticks (void) {
+    return ticks(vns);
+}
+
+void hal_waitUntil (osticks_t time) {
+    advance((u8_t)(u4_t)time * 1000000000 / OSTICKS_PER_SEC);
+}
+
+u1_t hal_checkTimer (osticks_t time) {
+    return os_timeDiff(time, ticks(vns)) <= 0; // no timed jobs in gateway mode
+}
+
+//////////////////////////////////////////////////
+// APPLICATION
+//////////////////////////////////////////////////
+
+void os_getArtEui (u1_t* buf) { memset(buf, 0, 8); }
+void os_getDevEui (u1_t* buf) { memset(buf, 0, 8); }
+void os_getDevKey (u1_t* buf) { memset(buf, 0, 16); }
+void onEvent (ev_t ev) { }
+
+static void received (void) {
+    nfwd++;
+    tsErr[nts++] = ((double)(u4_t)LMIC.rxtime * 1e9 / OSTICKS_PER_SEC - ends[LMIC.frame[0]]) / 1e3;
+}
+
+static void forward (osjob_t* j) {
+    received();
+    advance(vns + (u8_t)(1e6 * fwdMs));
+}
+
+static void rearmForward (osjob_t* j) {
+    received();
+    os_radio(RADIO_RXON);
+    advance(vns + (u8_t)(1e6 * fwdMs));
+}
+
+static int cmpDouble (const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double pct (double* v, u4_t n, int p) {
+    return n ? v[(n - 1) * p / 100] : 0;
+}
+
+static void runRow (u4_t n, dr_t dr, int rearm) {
+    nframes = 0; // nothing on air while the radio is set up
+    os_init();   // radio back to sleep, whatever the last row left it in
+    LMIC_reset();
+    LMIC_startGateway(903900000, updr2rps(dr), rearm ? FUNC_ADDR(rearmForward) : FUNC_ADDR(forward));
+    if( rearm )
+        os_radio(RADIO_RXON);
+    noffered = nrx = nfwd = ndead = nts = frSeq = 0;
+    waitReady = haveReady = rxPending = 0;
+    nframes = n;
+    u8_t t0 = vns;
+    nextFrame(vns);
+    while( noffered < n )
+        os_runloop_once();
+    u8_t t1 = vns;
+    while( vns < t1 + 1000000000 ) // forward the last frame
+        os_runloop_once();
+    deadSample();
+    double secs = (t1 - t0) / 1e9;
+    qsort(dead, ndead, sizeof(dead[0]), cmpDouble);
+    qsort(tsErr, nts, sizeof(tsErr[0]), cmpDouble);
+    printf("%-8s %8.1f %10.2f %10.2f %8.2f%% %9.0f %9.0f %9.0f %9.0f\n",
+           rearm ? "re-arm" : "gateway", gapMs, noffered / secs, nfwd / secs,
+           100.0 * (noffered - nfwd) / noffered, pct(dead, ndead, 50), pct(dead, ndead, 99),
+           pct(tsErr, nts, 50), pct(tsErr, nts, 99));
+}
+
+//////////////////////////////////////////////////
+// MAIN
+//////////////////////////////////////////////////
+
+int main (int argc, char* argv[]) {
+    int opt;
+    int dr = DR_SF7;
+    u4_t n = 5000;
+    while( (opt = getopt(argc, argv, "d:l:n:q:f:s:")) != -1 ) {
+        switch( opt ) {
+        case 'd': dr = atoi(optarg); break;
+        case 'l': plen = atoi(optarg); break;
+        case 'n': n = atoi(optarg); break;
+        case 'q': irqLat = atof(optarg); break;
+        case 'f': fwdMs = atof(optarg); break;
+        case 's': srand(atoi(optarg)); break;
+        default:
+            fprintf(stderr, "usage: %s [-d <dr>] [-l <payload bytes>] [-n <frames per row>] [-q <IRQ latency ms>] [-f <forward ms>] [-s <seed>]\n", argv[0]);
+            return 1;
+        }
+    }
+    if( n > MAX_FRAMES || plen < 4 || plen > 64 ) {
+        fprintf(stderr, "at most %d frames of 4..64 bytes\n", MAX_FRAMES);
+        return 1;
+    }
+
+    emuhooks.modeChanged = modeChanged;
+    emuhooks.spiByte = spiByte;
+    emuhooks.flagsCleared = checkReady;
+    emuhooks.poll = rxDone;
+
+    printf("DR%d, %u byte frames (%u ms on air), IRQ %.2f ms, forward %.2f ms\n", dr, plen,
+           osticks2ms(calcAirTime(updr2rps(dr), plen)), irqLat, fwdMs);
+    printf("%-8s %8s %10s %10s %9s %9s %9s %9s %9s\n", "Mode", "Gap ms", "Offered/s",
+           "Fwd/s", "Lost", "Dead p50", "Dead p99", "TS p50", "TS p99");
+    static const double gaps[] = { 0.2, 0.5, 1, 2, 5, 20 };
+    for( u1_t i = 0; i < sizeof(gaps)/sizeof(gaps[0]); i++ ) {
+        gapMs = gaps[i];
+        runRow(n, dr, 0);
+        runRow(n, dr, 1);
+    }
+    printf("dead time and TS (rxtime - true end of frame) in us\n");
+    return 0;
+}
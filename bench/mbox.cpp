@@ -0,0 +1,276 @@
+/*******************************************************************************
+ * LMIC calls from other threads: command mailbox vs. a mutex.
+ *
+ * One thread runs the LMIC against the emulated SX1276 (TXDONE after the air
+ * time, every receive window times out) sending back-to-back uplinks; -p
+ * producer threads keep changing the data rate, queueing data and reading the
+ * frame counter. With the mailbox (CFG_mbox) each producer posts -b commands
+ * and waits for them, the done callback checks they are applied in the order
+ * posted. With -m the producers instead call the LMIC directly under a mutex
+ * that the LMIC thread holds around os_runloop_once(). Reported: commands per
+ * second, post-to-applied latency, and the gaps between runloop passes of the
+ * LMIC thread (how late a due job or radio IRQ can be picked up).
+ *
+ * Usage: mbox [-m] [-p <producers>] [-b <batch>] [-t <seconds>]
+ *
+ *******************************************************************************/
+
+#include "lmic.h"
+#include "hal.h"
+#include "mbox.h"
+#include "emuradio.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+enum { MAX_SAMPLES = 200000 };
+
+static double nowUs (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+//////////////////////////////////////////////////
+// APPLICATION (LMIC thread)
+//////////////////////////////////////////////////
+
+static u1_t NWKSKEY[16] = { 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+                            0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x10 };
+static u1_t APPSKEY[16] = { 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18,
+                            0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x20 };
+static const devaddr_t DEVADDR = 0x26011BDA;
+static u1_t payload[11] = "0123456789";
+
+static int running;      // producers
+static int lmicRunning;  // LMIC thread, stopped after the producers
+static int useMutex;
+static pthread_mutex_t lmicLock = PTHREAD_MUTEX_INITIALIZER;
+static double* gap;      // us between runloop passes while the producers run
+static u4_t ngaps;
+static mbox_t mb;
+
+void os_getArtEui (u1_t* buf) { memset(buf, 0, 8); }
+void os_getDevEui (u1_t* buf) { memset(buf, 0, 8); }
+void os_getDevKey (u1_t* buf) { memset(buf, 0, 16); }
+
+void onEvent (ev_t ev) {
+    if( ev == EV_TXCOMPLETE ) {
+        LMIC_setTxData2(1, payload, sizeof(payload), 0);
+    }
+}
+
+static void* lmicThread (void* arg) {
+    emuhooks.modeChanged = emu_txrx;
+    os_init();
+    LMIC_reset();
+    LMIC_setSession(0x13, DEVADDR, NWKSKEY, APPSKEY);
+    LMIC_setAdrMode(0);
+    LMIC_setLinkCheckMode(0);
+    LMIC_setDrTxpow(DR_SF7, 14);
+    LMIC_setTxData2(1, payload, sizeof(payload), 0);
+    mbox_attach(&mb);
+    __atomic_store_n(&lmicRunning, 1, __ATOMIC_RELEASE);
+    double last = 0;
+    while( __atomic_load_n(&lmicRunning, __ATOMIC_ACQUIRE) ) {
+        double t = nowUs();
+        if( !__atomic_load_n(&running, __ATOMIC_ACQUIRE) )
+            last = 0;
+        else if( last != 0 && ngaps < MAX_SAMPLES )
+            gap[ngaps++] = t - last;
+        last = t;
+        if( useMutex ) {
+            pthread_mutex_lock(&lmicLock);
+            os_runloop_once();
+            pthread_mutex_unlock(&lmicLock);
+        } else {
+            os_runloop_once();
+        }
+    }
+    return NULL;
+}
+
+//////////////////////////////////////////////////
+// PRODUCERS
+//////////////////////////////////////////////////
+
+enum { MAX_PRODUCERS = 16, MAX_BATCH = 64 };
+
+struct producer_t {
+    pthread_t  thread;
+    mboxcmd_t  cmd[MAX_BATCH];
+    u4_t       posted;
+    u4_t       applied;   // counted by the done callback (LMIC thread)
+    u4_t       disorder;  // applied out of posting order
+    u4_t       failed;    // LMIC_setTxData2() refused
+    u4_t       nsamples;
+    double*    latency;   // us
+};
+
+static producer_t producers[MAX_PRODUCERS];
+static int batch = 1;
+
+static void readSeqno (mboxcmd_t* cmd) {
+    cmd->result = LMIC.seqnoUp;
+}
+
+// on the LMIC thread: commands of a producer must come in the order posted
+static void applied (mboxcmd_t* cmd) {
+    producer_t* p = (producer_t*)cmd->ctx;
+    if( cmd->op == MBOX_SETTXDATA && cmd->a.tx.data[0] != (u1_t)p->applied )
+        p->disorder++;
+    p->applied++;
+}
+
+// command n of a producer: cycle data rate, data, frame counter
+static void fill (producer_t* p, mboxcmd_t* cmd, u4_t n) {
+    cmd->done = applied;
+    cmd->ctx = p;
+    switch( n % 3 ) {
+    case 0:
+        cmd->op = MBOX_SETDRTXPOW;
+        cmd->a.drtxpow.dr = DR_SF7 - (n / 3) % 3;
+        cmd->a.drtxpow.txpow = KEEP_TXPOW;
+        break;
+    case 1:
+        cmd->op = MBOX_SETTXDATA;
+        cmd->a.tx.port = 2;
+        cmd->a.tx.dlen = 4;
+        cmd->a.tx.confirmed = 0;
+        cmd->a.tx.data[0] = n & 0xFF;  // checked by applied()
+        memcpy(cmd->a.tx.data + 1, "mbx", 3);
+        break;
+    default:
+        cmd->op = MBOX_CALL;
+        cmd->a.fn = readSeqno;
+        break;
+    }
+}
+
+// the same command as a direct call (under lmicLock)
+static int call (mboxcmd_t* cmd) {
+    switch( cmd->op ) {
+    case MBOX_SETDRTXPOW:
+        LMIC_setDrTxpow(cmd->a.drtxpow.dr, cmd->a.drtxpow.txpow);
+        return 0;
+    case MBOX_SETTXDATA:
+        return LMIC_setTxData2(cmd->a.tx.port, cmd->a.tx.data, cmd->a.tx.dlen, cmd->a.tx.confirmed);
+    default:
+        return LMIC.seqnoUp;
+    }
+}
+
+static void sample (producer_t* p, double us) {
+    if( p->nsamples < MAX_SAMPLES )
+        p->latency[p->nsamples++] = us;
+}
+
+static void* producerThread (void* arg) {
+    producer_t* p = (producer_t*)arg;
+    double t0[MAX_BATCH];
+    while( __atomic_load_n(&running, __ATOMIC_ACQUIRE) ) {
+        if( useMutex ) {
+            mboxcmd_t* cmd = &p->cmd[0];
+            fill(p, cmd, p->posted++);
+            double t = nowUs();
+            pthread_mutex_lock(&lmicLock);
+            if( call(cmd) != 0 && cmd->op == MBOX_SETTXDATA )
+                p->failed++;
+            p->applied++;
+            pthread_mutex_unlock(&lmicLock);
+            sample(p, nowUs() - t);
+            continue;
+        }
+        for( int i = 0; i < batch; i++ ) {
+            fill(p, &p->cmd[i], p->posted++);
+            t0[i] = nowUs();
+            mbox_post(&mb, &p->cmd[i]);
+        }
+        for( int i = 0; i < batch; i++ ) {
+            int res = mbox_wait(&p->cmd[i]);
+            sample(p, nowUs() - t0[i]);
+            if( p->cmd[i].op == MBOX_SETTXDATA && res != 0 )
+                p->failed++;
+        }
+    }
+    return NULL;
+}
+
+static int cmpDouble (const void* a, const void* b) {
+    double d = *(const double*)a - *(const double*)b;
+    return d < 0 ? -1 : d > 0;
+}
+
+//////////////////////////////////////////////////
+// MAIN
+//////////////////////////////////////////////////
+
+int main (int argc, char* argv[]) {
+    int opt, nproducers = 2;
+    double secs = 5;
+    while( (opt = getopt(argc, argv, "mp:b:t:")) != -1 ) {
+        switch( opt ) {
+        case 'm': useMutex = 1; break;
+        case 'p': nproducers = atoi(optarg); break;
+        case 'b': batch = atoi(optarg); break;
+        case 't': secs = atof(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-m] [-p <producers>] [-b <batch>] [-t <seconds>]\n", argv[0]);
+            return 1;
+        }
+    }
+    if( nproducers < 1 || nproducers > MAX_PRODUCERS || batch < 1 || batch > MAX_BATCH ) {
+        fprintf(stderr, "producers must be 1..%d, batch 1..%d\n", MAX_PRODUCERS, MAX_BATCH);
+        return 1;
+    }
+
+    pthread_t lmic;
+    gap = (double*)malloc(MAX_SAMPLES * sizeof(double));
+    mbox_init(&mb);
+    pthread_create(&lmic, NULL, lmicThread, NULL);
+    while( !__atomic_load_n(&lmicRunning, __ATOMIC_ACQUIRE) )
+        sched_yield();
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+    for( int i = 0; i < nproducers; i++ ) {
+        producers[i].latency = (double*)malloc(MAX_SAMPLES * sizeof(double));
+        pthread_create(&producers[i].thread, NULL, producerThread, &producers[i]);
+    }
+    struct timespec ts = { (time_t)secs, (long)((secs - (time_t)secs) * 1e9) };
+    nanosleep(&ts, NULL);
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    for( int i = 0; i < nproducers; i++ )
+        pthread_join(producers[i].thread, NULL);
+    __atomic_store_n(&lmicRunning, 0, __ATOMIC_RELEASE);
+    pthread_join(lmic, NULL);
+
+    u4_t posted = 0, done = 0, disorder = 0, failed = 0, n = 0;
+    for( int i = 0; i < nproducers; i++ ) {
+        posted += producers[i].posted;
+        done += producers[i].applied;
+        disorder += producers[i].disorder;
+        failed += producers[i].failed;
+        n += producers[i].nsamples;
+    }
+    double* all = (double*)malloc((n ? n : 1) * sizeof(double));
+    double sum = 0;
+    for( int i = 0, k = 0; i < nproducers; i++ ) {
+        memcpy(all + k, producers[i].latency, producers[i].nsamples * sizeof(double));
+        k += producers[i].nsamples;
+        free(producers[i].latency);
+    }
+    qsort(all, n, sizeof(double), cmpDouble);
+    for( u4_t i = 0; i < n; i++ )
+        sum += all[i];
+    qsort(gap, ngaps, sizeof(double), cmpDouble);
+
+    printf("%s, %d producers, batch %d: %.0f cmds/s, latency mean %.1f us p50 %.1f us p99 %.1f us max %.1f us\n",
+           useMutex ? "mutex" : "mbox", nproducers, useMutex ? 1 : batch, done / secs,
+           n ? sum / n : 0, n ? all[n / 2] : 0, n ? all[n * 99 / 100] : 0, n ? all[n - 1] : 0);
+    printf("runloop gap p50 %.1f us p99 %.1f us max %.1f us\n",
+           ngaps ? gap[ngaps / 2] : 0, ngaps ? gap[ngaps * 99 / 100] : 0, ngaps ? gap[ngaps - 1] : 0);
+    printf("posted %u, applied %u, out of order %u, setTxData refused %u\n", posted, done, disorder, failed);
+    free(gap);
+    free(all);
+    return posted == done && disorder == 0 ? 0 : 1;
+}
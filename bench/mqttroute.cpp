@@ -0,0 +1,135 @@
+/*******************************************************************************
+ * CPU spent in lmicd's MQTT message callback under a busy broker.
+ *
+ * Replays a stream of topics as a broker with -n $SYS topics updated every
+ * interval plus -d device messages per interval would deliver them, through
+ * the old callback (subscribed to $SYS/#, every message matched
+ * against /ttn-send/send_message) and the routed one (route.h, only the
+ * /ttn-send/send_message and /ttn-send/<devaddr>/up/+ subscriptions). The old
+ * matcher follows mosquitto_topic_matches_sub(); libmosquitto's own socket,
+ * packet costs come on top of the callback and are counted as packets only
+ * (one PUBLISH per message: the broker publishes $SYS at QoS 0, so the QoS 2
+ * subscription gets no handshake for them).
+ *
+ * Usage: mqttroute [-n <$SYS topics>] [-d <device messages>] [-r <rounds>]
+ *
+ *******************************************************************************/
+
+#include "route.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static unsigned long handled;
+
+// mosquitto_topic_matches_sub() without the argument checks
+static bool topic_matches_sub (const char* sub, const char* topic) {
+    if( (sub[0] == '$') != (topic[0] == '$') )
+        return false;
+    while( *sub && *topic ) {
+        if( *sub == *topic ) {
+            sub++;
+            topic++;
+            if( *topic == 0 && sub[0] == '/' && sub[1] == '#' && sub[2] == 0 )
+                return true;
+        } else if( *sub == '+' ) {
+            sub++;
+            while( *topic && *topic != '/' )
+                topic++;
+        } else if( *sub == '#' ) {
+            return true;
+        } else {
+            return false;
+        }
+    }
+    return *sub == 0 && *topic == 0;
+}
+
+static void oldCallback (const char* topic, const char* payload, int len) {
+    if( topic_matches_sub("/ttn-send/send_message", topic) )
+        handled++;
+}
+
+static void routed (int id, char** args, const char* payload, int len) {
+    handled++;
+}
+
+static struct route_t routes[2];
+
+static void newCallback (const char* topic, const char* payload, int len) {
+    route_dispatch(routes, 2, topic, payload, len);
+}
+
+static const char* SYS[] = {
+    "$SYS/broker/load/messages/received/1min", "$SYS/broker/load/messages/sent/1min",
+    "$SYS/broker/load/bytes/received/5min", "$SYS/broker/load/publish/sent/15min",
+    "$SYS/broker/clients/connected", "$SYS/broker/clients/total",
+    "$SYS/broker/messages/stored", "$SYS/broker/subscriptions/count",
+    "$SYS/broker/heap/current", "$SYS/broker/uptime",
+};
+
+static double nowNs (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main (int argc, char* argv[]) {
+    int opt;
+    int nsys = 60, ndev = 6, rounds = 100000;
+    while( (opt = getopt(argc, argv, "n:d:r:")) != -1 ) {
+        switch( opt ) {
+        case 'n': nsys = atoi(optarg); break;
+        case 'd': ndev = atoi(optarg); break;
+        case 'r': rounds = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n <$SYS topics>] [-d <device messages>] [-r <rounds>]\n", argv[0]);
+            return 1;
+        }
+    }
+    route_set(&routes[0], "/ttn-send/send_message", routed, 0);
+    route_set(&routes[1], "/ttn-send/2602119A/up/+", routed, 0);
+
+    // one interval of broker traffic: device messages spread among the $SYS updates
+    int n = nsys + ndev;
+    char (*topics)[ROUTE_TOPIC] = (char (*)[ROUTE_TOPIC])calloc(n, ROUTE_TOPIC);
+    bool* dev = (bool*)calloc(n, sizeof(bool));
+    for( int i = 0, d = 0; i < n; i++ ) {
+        if( d < ndev && (long)i * ndev >= (long)d * n ) {
+            dev[i] = true;
+            snprintf(topics[i], ROUTE_TOPIC, d & 1 ? "/ttn-send/2602119A/up/%d" : "/ttn-send/send_message", 1 + d);
+            d++;
+        } else {
+            snprintf(topics[i], ROUTE_TOPIC, "%s/%d", SYS[i % 10], i / 10);
+        }
+    }
+    const char payload[] = "x:0102030405:";
+
+    for( int pass = 0; pass < 2; pass++ ) {
+        handled = 0;
+        unsigned long calls = 0, packets = 0;
+        double t0 = nowNs();
+        for( int r = 0; r < rounds; r++ ) {
+            for( int i = 0; i < n; i++ ) {
+                if( pass == 0 ) {
+                    // only send_message existed before
+                    oldCallback(dev[i] ? "/ttn-send/send_message" : topics[i], payload, sizeof(payload)-1);
+                    packets++;
+                    calls++;
+                } else if( dev[i] ) {
+                    newCallback(topics[i], payload, sizeof(payload)-1);
+                    packets++;
+                    calls++;
+                }
+            }
+        }
+        double ns = nowNs() - t0;
+        printf("%-7s %8.1f ns per interval, %5.1f ns per callback, %lu callbacks, %lu packets, %lu handled per interval\n",
+               pass == 0 ? "$SYS/#" : "routed", ns / rounds, ns / calls, calls / rounds, packets / rounds,
+               handled / rounds);
+    }
+    free(topics);
+    free(dev);
+    return 0;
+}
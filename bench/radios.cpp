@@ -0,0 +1,156 @@
+/*******************************************************************************
+ * Aggregate uplink rate of several radios driven from one process.
+ *
+ * Builds the LMIC with CFG_multiradio against the emulated SX1276 per radio
+ * thread: TXDONE fires after the frame's air time, every receive window times
+ * out. Each radio is a device of its own (DevAddr, keys and frame counter)
+ * and sends back-to-back unconfirmed uplinks on its share of the channels.
+ * The uplinks per second are reported for 1..n radios, with the uplinks that
+ * started while another radio was on air on an overlapping channel and the
+ * radio energy per uplink and per day (CFG_energy, averaged over the radios).
+ *
+ * Usage: radios [-n <max radios>] [-t <seconds per run>]
+ *
+ *******************************************************************************/
+
+#include "lmic.h"
+#include "hal.h"
+#include "radios.h"
+#include "emuradio.h"
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+//////////////////////////////////////////////////
+// RADIO EMULATION (state per radio thread)
+//////////////////////////////////////////////////
+
+lmic_pinmap pins = { .nss = 0, .rxtx = UNUSED_PIN, .rst = 0, .dio = { 0, 0, 0 } };
+
+// uplinks on air, to count those overlapping in time and frequency
+static struct { u4_t freq; u4_t bw; osticks_t end; } onAir[MAX_RADIOS];
+static pthread_mutex_t onAirLock = PTHREAD_MUTEX_INITIALIZER;
+static u4_t collisions;
+
+static void txStart (osticks_t end) {
+    u1_t id = radios_self();
+    u4_t bw = 125000 << getBw(LMIC.rps);
+    pthread_mutex_lock(&onAirLock);
+    for( u1_t i = 0; i < MAX_RADIOS; i++ ) {
+        s4_t df = (s4_t)(onAir[i].freq - LMIC.freq);
+        if( i != id && onAir[i].freq != 0 && os_timeDiff(onAir[i].end, hal_ticks()) > 0 &&
+            (u4_t)(df < 0 ? -df : df) < (onAir[i].bw + bw) / 2 )
+            collisions++;
+    }
+    onAir[id].freq = LMIC.freq;
+    onAir[id].bw = bw;
+    onAir[id].end = end;
+    pthread_mutex_unlock(&onAirLock);
+}
+
+// radio alone on air, counting the uplinks that overlap another radio's
+static void modeChanged (u1_t mode) {
+    emu_txrx(mode);
+    if( emu.pending == EMU_TXDONE )
+        txStart(emu.dueAt);
+}
+
+//////////////////////////////////////////////////
+// APPLICATION
+//////////////////////////////////////////////////
+
+static u1_t NWKSKEY[16] = { 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+                            0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x10 };
+static u1_t APPSKEY[16] = { 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18,
+                            0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x20 };
+static const devaddr_t DEVADDR = 0x26011BDA;  // radio id sends as DEVADDR+id
+static u1_t payload[11] = "0123456789";
+
+static int nradios;
+static u4_t uplinks[MAX_RADIOS];
+static u4_t uplinkEnergy[MAX_RADIOS];  // uJ
+static u4_t dailyEnergy[MAX_RADIOS];   // mJ
+
+void os_getArtEui (u1_t* buf) { memset(buf, 0, 8); }
+void os_getDevEui (u1_t* buf) { memset(buf, 0, 8); }
+void os_getDevKey (u1_t* buf) { memset(buf, 0, 16); }
+
+static void send (void) {
+    LMIC_setTxData2(1, payload, sizeof(payload), 0);
+}
+
+void onEvent (ev_t ev) {
+    if( ev == EV_TXCOMPLETE ) {
+        __atomic_fetch_add(&uplinks[radios_self()], 1, __ATOMIC_RELAXED);
+        uplinkEnergy[radios_self()] = LMIC_uplinkEnergy();
+        dailyEnergy[radios_self()] = LMIC_dailyEnergy();
+        send();
+    }
+}
+
+static void setup (u1_t id) {
+    u1_t nwkKey[16], artKey[16];
+    memcpy(nwkKey, NWKSKEY, 16);
+    memcpy(artKey, APPSKEY, 16);
+    nwkKey[15] ^= id;
+    artKey[15] ^= id;
+    LMIC_setSession(0x13, DEVADDR + id, nwkKey, artKey);
+    LMIC_setAdrMode(0);
+    LMIC_setLinkCheckMode(0);
+    LMIC_setDrTxpow(DR_SF7, 14);
+    radios_shareChannels(id, nradios);
+    send();
+}
+
+//////////////////////////////////////////////////
+// MAIN
+//////////////////////////////////////////////////
+
+int main (int argc, char* argv[]) {
+    int opt, maxRadios = 2;
+    double secs = 10;
+    while( (opt = getopt(argc, argv, "n:t:")) != -1 ) {
+        switch( opt ) {
+        case 'n': maxRadios = atoi(optarg); break;
+        case 't': secs = atof(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n <max radios>] [-t <seconds>]\n", argv[0]);
+            return 1;
+        }
+    }
+    if( maxRadios < 1 || maxRadios > MAX_RADIOS ) {
+        fprintf(stderr, "radios must be 1..%d\n", MAX_RADIOS);
+        return 1;
+    }
+
+    emuhooks.modeChanged = modeChanged;
+    emuhooks.yield = 1;
+    printf("%-8s %10s %12s %12s %12s %12s\n", "Radios", "Uplinks", "Uplinks/s", "Collisions", "mJ/uplink", "J/day");
+    for( nradios = 1; nradios <= maxRadios; nradios++ ) {
+        memset(uplinks, 0, sizeof(uplinks));
+        memset(onAir, 0, sizeof(onAir));
+        collisions = 0;
+        static lmic_pinmap pm[MAX_RADIOS];
+        for( int id = 0; id < nradios; id++ ) {
+            pm[id] = pins;
+            pm[id].spi = id & 1;
+            if( radios_start(id, &pm[id], setup) != 0 ) {
+                fprintf(stderr, "unable to start radio %d\n", id);
+                return 1;
+            }
+        }
+        struct timespec ts = { (time_t)secs, (long)((secs - (time_t)secs) * 1e9) };
+        nanosleep(&ts, NULL);
+        radios_stop();
+        u4_t total = 0;
+        double uj = 0, mj = 0;
+        for( int id = 0; id < nradios; id++ ) {
+            total += uplinks[id];
+            uj += uplinkEnergy[id];
+            mj += dailyEnergy[id];
+        }
+        printf("%-8d %10u %12.2f %12u %12.2f %12.1f\n", nradios, total, total / secs, collisions,
+               uj / nradios / 1000, mj / nradios / 1000);
+    }
+    return 0;
+}
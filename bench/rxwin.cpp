@@ -0,0 +1,225 @@
+/*******************************************************************************
+ * Class A RX window hit rate and radio-on time, simulated in virtual time.
+ *
+ * Runs the LMIC (built with CFG_rxcal) against the emulated SX1276 on a host
+ * with random interrupt and timer wake-up latency. The network server answers
+ * every uplink, alternately in RX1 and RX2, with the preamble starting exactly
+ * RX1/RX2 delay after the true end of the uplink (plus the gateway offset -g).
+ * A window catches the downlink if the radio sees 5 preamble symbols before
+ * the preamble ends and before its symbol timeout. Host latency is drawn as
+ * mean/2 + exponential(mean/2) for the IRQ (-q) and the timer wake-up (-w).
+ *
+ * Usage: rxwin [-k <guard>] [-n <uplinks>] [-q <IRQ latency ms>] [-w <wake-up latency ms>]
+ *              [-g <gateway offset us>] [-s <seed>]
+ *
+ *******************************************************************************/
+
+#include "lmic.c"
+#include "hal.h"
+#include "emuradio.h"
+#include <math.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+//////////////////////////////////////////////////
+// HOST AND RADIO EMULATION
+//////////////////////////////////////////////////
+
+static osticks_t vnow;      // virtual time
+static osticks_t sleepUntil;
+static u1_t sleepTimed;
+static double irqLat = 0.1, wakeLat = 0.2;  // ms
+
+static double expRand (double mean) {
+    return -mean * log(1 - rand() / (RAND_MAX + 1.0));
+}
+
+// host latency in ticks
+static osticks_t latency (double ms) {
+    return ms2osticks(1) * (ms/2 + expRand(ms/2));
+}
+
+//////////////////////////////////////////////////
+// NETWORK SERVER
+//////////////////////////////////////////////////
+
+static u1_t NWKSKEY[16] = { 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+                            0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x10 };
+static u1_t APPSKEY[16] = { 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18,
+                            0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x20 };
+static const devaddr_t DEVADDR = 0x26011BDA;
+
+static s4_t gwOffset;        // us
+static u4_t nup;             // uplinks sent
+static osticks_t preamble;   // start of the answer's preamble
+static u1_t target;          // window (1/2) the answer is sent in
+static u1_t window;          // windows opened since the uplink
+static u1_t dnframe[64];
+static u1_t dnlen;
+static u4_t sent[3], caught[3], lateOpen;
+static double searchMs;      // radio on before lock or timeout
+
+static void buildDownlink (u4_t seq) {
+    u1_t* d = dnframe;
+    d[OFF_DAT_HDR] = HDR_FTYPE_DADN | HDR_MAJOR_V1;
+    os_wlsbf4(d+OFF_DAT_ADDR, DEVADDR);
+    d[OFF_DAT_FCT] = 0;
+    os_wlsbf2(d+OFF_DAT_SEQNO, seq);
+    int poff = OFF_DAT_OPTS;
+    d[poff++] = 1; // port
+    os_wlsbf4(d+poff, seq);
+    dnlen = poff + 4 + 4;
+    aes_cipherAppendMic(APPSKEY, NWKSKEY, DEVADDR, seq, /*dn*/1, d, poff, dnlen-4);
+}
+
+// uplink ended at true time end: schedule the answer
+static void uplinkDone (osticks_t end) {
+    target = 1 + (nup & 1);
+    ostime_t delay = target == 1 ? DELAY_DNW1_osticks : DELAY_DNW1_osticks+DELAY_EXTDNW2_osticks;
+    preamble = end + delay + us2osticks(gwOffset);
+    sent[target]++;
+    window = 0;
+}
+
+// single RX started at vnow: lock on the answer or time out
+static void rxOpened (void) {
+    window++;
+    ostime_t sym = 2*dr2hsym(window == 1 ? LMIC.dndr : LMIC.dn2Dr);
+    osticks_t open = vnow;
+    osticks_t lock = (os_timeDiff(open, preamble) > 0 ? open : preamble) + 5*sym;
+    osticks_t tout = open + LMIC.rxsyms*sym;
+    if( os_timeDiff(open, LMIC.rxtime) > 0 )
+        lateOpen++;
+    if( window == target && os_timeDiff(lock, preamble + 8*sym) <= 0 && os_timeDiff(lock, tout) <= 0 ) {
+        buildDownlink(nup);
+        caught[target]++;
+        searchMs += osticks2us(lock - open) / 1000.0;
+        // RXDONE at the end of the frame (no fix-up in radio.c for BW500 downlinks)
+        emu_frame(dnframe, dnlen);
+        emu.pending = EMU_RXDONE;
+        emu.dueAt = preamble + calcAirTime(LMIC.rps, dnlen) + latency(irqLat);
+    } else {
+        searchMs += osticks2us(tout - open) / 1000.0;
+        emu.pending = EMU_RXTOUT;
+        emu.dueAt = tout + latency(irqLat);
+    }
+}
+
+static void modeChanged (u1_t mode) {
+    switch( mode & 0x87 ) {
+    case 0x83: { // TX: TXDONE after the air time (LMIC takes 43us off)
+        osticks_t end = vnow + calcAirTime(LMIC.rps, LMIC.dataLen);
+        uplinkDone(end);
+        emu.pending = EMU_TXDONE;
+        emu.dueAt = end + us2osticks(43) + latency(irqLat);
+        break;
+    }
+    case 0x86: // RX single
+        rxOpened();
+        break;
+    default:
+        emu.pending = 0;
+        break;
+    }
+}
+
+// SPI byte at ~4MHz plus driver overhead
+static void spiByte (void) {
+    vnow += us2osticks(2);
+}
+
+// idle until the next IRQ or the timer (plus wake-up latency)
+void hal_sleep (void) {
+    osticks_t t = sleepTimed ? sleepUntil + latency(wakeLat) : vnow + sec2osticks(1);
+    if( emu.pending && os_timeDiff(emu.dueAt, t) < 0 )
+        t = emu.dueAt;
+    if( os_timeDiff(t, vnow) > 0 )
+        vnow = t;
+    sleepTimed = 0;
+}
+
+osticks_t hal_ticks (void) {
+    return vnow;
+}
+
+void hal_waitUntil (osticks_t time) {
+    if( os_timeDiff(time, vnow) > 0 )
+        vnow = time;
+}
+
+u1_t hal_checkTimer (osticks_t time) {
+    if( os_timeDiff(time, vnow) <= 0 )
+        return 1;
+    sleepUntil = time;
+    sleepTimed = 1;
+    return 0;
+}
+
+//////////////////////////////////////////////////
+// APPLICATION
+//////////////////////////////////////////////////
+
+static osjob_t sendjob;
+static u1_t payload[11] = "0123456789";
+static u4_t nrx;
+
+void os_getArtEui (u1_t* buf) { memset(buf, 0, 8); }
+void os_getDevEui (u1_t* buf) { memset(buf, 0, 8); }
+void os_getDevKey (u1_t* buf) { memset(buf, 0, 16); }
+
+static void send (osjob_t* j) {
+    LMIC_setTxData2(1, payload, sizeof(payload), 0);
+}
+
+void onEvent (ev_t ev) {
+    if( ev != EV_TXCOMPLETE )
+        return;
+    if( LMIC.dataLen >= 4 && os_rlsbf4(LMIC.frame + LMIC.dataBeg) == nup )
+        nrx++;
+    nup++;
+    os_setTimedCallback(&sendjob, os_getTime() + sec2osticks(10) + (rand() & 0xFFFF), send);
+}
+
+//////////////////////////////////////////////////
+// MAIN
+//////////////////////////////////////////////////
+
+int main (int argc, char* argv[]) {
+    int opt;
+    int k = -1;
+    u4_t n = 2000;
+    while( (opt = getopt(argc, argv, "k:n:q:w:g:s:")) != -1 ) {
+        switch( opt ) {
+        case 'k': k = atoi(optarg); break;
+        case 'n': n = atoi(optarg); break;
+        case 'q': irqLat = atof(optarg); break;
+        case 'w': wakeLat = atof(optarg); break;
+        case 'g': gwOffset = atoi(optarg); break;
+        case 's': srand(atoi(optarg)); break;
+        default:
+            fprintf(stderr, "usage: %s [-k <guard>] [-n <uplinks>] [-q <IRQ latency ms>] [-w <wake-up latency ms>] [-g <gateway offset us>] [-s <seed>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    emuhooks.modeChanged = modeChanged;
+    emuhooks.spiByte = spiByte;
+    os_init();
+    LMIC_reset();
+    if( k >= 0 )
+        LMIC_setRxCal(k);
+    LMIC_setSession(0x13, DEVADDR, NWKSKEY, APPSKEY);
+    LMIC_setAdrMode(0);
+    LMIC_setLinkCheckMode(0);
+    LMIC_setDrTxpow(DR_SF7, 14);
+    send(&sendjob);
+    while( nup < n )
+        os_runloop_once();
+
+    printf("guard k=%u, IRQ %.2f ms, wake-up %.2f ms, gateway %+d us\n", LMIC.rxcal.k, irqLat, wakeLat, gwOffset);
+    printf("RX1 %u/%u caught, RX2 %u/%u caught, %u of %u downlinks lost (%.2f%%)\n",
+           caught[1], sent[1], caught[2], sent[2], n - nrx, n, 100.0 * (n - nrx) / n);
+    printf("%u windows, %u opened late, radio searching %.2f ms per window\n",
+           LMIC.rxcal.windows, lateOpen, searchMs / LMIC.rxcal.windows);
+    return 0;
+}
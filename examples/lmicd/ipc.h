@@ -0,0 +1,100 @@
+/*******************************************************************************
+ * Local transports of lmicd besides MQTT.
+ *
+ * Records are the same text messages as on /ttn-send/send_message
+ * ("a:<appeui>:...:x:<hex payload>:", see parse_msg() in lmicd.cpp); lmicd
+ * answers downlinks as "p:<port>:x:<hex payload>:".
+ *
+ * lmicd -u <path>: Unix SOCK_SEQPACKET socket, one record per packet in
+ *   either direction (send() an uplink, recv() downlinks). Records are only
+ *   read while lmicd has no uplink waiting, so a busy device pushes back on
+ *   the senders through the socket buffer.
+ * lmicd -q <name>: POSIX shared memory (shm_open) with two single producer
+ *   single consumer rings, up (one local producer -> lmicd) and dn (lmicd ->
+ *   one local consumer). A full ring refuses the record. A consumer with
+ *   nothing to do sleeps in ipcring_wait() on a futex in the shared segment;
+ *   ipcring_put() makes the wake-up syscall only while it sleeps, otherwise
+ *   neither side makes a syscall per record.
+ *******************************************************************************/
+
+#ifndef _ipc_h_
+#define _ipc_h_
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+enum { IPC_REC_MAX = 1024 };    // record bytes (text, no terminating NUL)
+enum { IPC_RING_SLOTS = 32 };   // power of two
+enum { IPC_MAGIC = 0x4C4D4932 };
+
+struct ipcring_t {
+    uint32_t head __attribute__((aligned(64)));  // next slot to write (producer), futex word
+    uint32_t waiting;                            // consumer sleeps in ipcring_wait()
+    uint32_t tail __attribute__((aligned(64)));  // next slot to read (consumer)
+    struct {
+        uint32_t len;
+        char     data[IPC_REC_MAX];
+    } slot[IPC_RING_SLOTS];
+};
+
+struct ipcshm_t {
+    uint32_t magic;  // set by lmicd once both rings are empty
+    struct ipcring_t up;
+    struct ipcring_t dn;
+};
+
+// append a record (0=ok, -1=ring full or record too long)
+static inline int ipcring_put(struct ipcring_t* r, const char* rec, uint32_t len)
+{
+    uint32_t head = r->head;
+    if(len > IPC_REC_MAX || head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == IPC_RING_SLOTS)
+    {
+        return -1;
+    }
+    r->slot[head % IPC_RING_SLOTS].len = len;
+    memcpy(r->slot[head % IPC_RING_SLOTS].data, rec, len);
+    // ordered against the load of waiting (pairs with ipcring_wait)
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&r->waiting, __ATOMIC_SEQ_CST))
+    {
+        syscall(SYS_futex, &r->head, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+    return 0;
+}
+
+// take the oldest record into buf (IPC_REC_MAX bytes), length or -1 if empty
+static inline int ipcring_get(struct ipcring_t* r, char* buf)
+{
+    uint32_t tail = r->tail;
+    if(__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail)
+    {
+        return -1;
+    }
+    uint32_t len = r->slot[tail % IPC_RING_SLOTS].len;
+    if(len > IPC_REC_MAX)
+    {
+        len = IPC_REC_MAX;
+    }
+    memcpy(buf, r->slot[tail % IPC_RING_SLOTS].data, len);
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return len;
+}
+
+// sleep until a record is put or ms have passed (consumer, returns at once if not empty)
+static inline void ipcring_wait(struct ipcring_t* r, int ms)
+{
+    uint32_t tail = r->tail;
+    __atomic_store_n(&r->waiting, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) == tail)
+    {
+        struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+        syscall(SYS_futex, &r->head, FUTEX_WAIT, tail, &ts, NULL, 0);
+    }
+    __atomic_store_n(&r->waiting, 0, __ATOMIC_RELAXED);
+}
+
+#endif // _ipc_h_
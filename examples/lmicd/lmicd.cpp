@@ -39,7 +39,20 @@
 #include <sys/wait.h>
 #include <arpa/inet.h>
 #include <fcntl.h> /* Added for the nonblocking socket */
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/un.h>
 #include <mosquitto.h>
+#include "ipc.h"
+#include "route.h"
+#if defined(CFG_capture)
+#include <capture.h>
+#endif
+#if defined(CFG_multiradio)
+#include <radios.h>
+#endif
 
 // LoRaWAN Application identifier (AppEUI)
 // Not used in this example
@@ -68,8 +81,21 @@ static u4_t DEVADDR = 0x0;
 static struct mosquitto *mosq = NULL;
 static bool session_started = false;
 static bool joined = false;
+static int adr_margin = 0; // device side ADR margin in dB (0=fixed DR_SF7)
+static int adr_eirp = EIRP_DN; // gateway EIRP in dBm for device side ADR
 int parse_msg(char * buffer);
 
+// local transports (see ipc.h)
+enum { IPC_MAX_CLIENTS = 8 };
+static int ipc_listen = -1;
+static int ipc_clients[IPC_MAX_CLIENTS];
+static int ipc_nclients = 0;
+static struct ipcshm_t* ipc_shm = NULL;
+static pthread_mutex_t ipc_dnLock = PTHREAD_MUTEX_INITIALIZER; // radios report downlinks on their own threads
+
+static void ipc_downlink();
+static void ipc_poll(int timeout);
+
 //////////////////////////////////////////////////
 // APPLICATION CALLBACKS
 //////////////////////////////////////////////////
@@ -98,6 +124,7 @@ void os_getDevKey(u1_t* buf)
 u4_t cntr = 0;
 u1_t mydata[255];
 static int mydatalen = 0;
+static u1_t mydataport = 1;
 
 static osjob_t sendjob;
 
@@ -108,6 +135,38 @@ lmic_pinmap pins =
             .dio =
                 { 7, 4, 5 } };
 
+#if defined(CFG_multiradio)
+// Pin mapping of further radios (-r), adapt to your wiring
+static lmic_pinmap radiopins[MAX_RADIOS] =
+    { { .nss = 6, .rxtx = UNUSED_PIN, .rst = 0, .dio = { 7, 4, 5 }, .spi = 0 },
+      { .nss = 11, .rxtx = UNUSED_PIN, .rst = 3, .dio = { 21, 22, 23 }, .spi = 1 },
+      { .nss = 26, .rxtx = UNUSED_PIN, .rst = 27, .dio = { 24, 25, 28 }, .spi = 0 },
+      { .nss = 29, .rxtx = UNUSED_PIN, .rst = 2, .dio = { 12, 13, 14 }, .spi = 1 } };
+
+// Every radio has its own TX queue; new messages go to the shortest one
+enum { TXQ_LEN = 16 };
+struct txqueue_t {
+    u1_t data[TXQ_LEN][255];
+    int  len[TXQ_LEN];
+    u1_t port[TXQ_LEN];
+    u4_t head, tail;
+};
+static struct txqueue_t txq[MAX_RADIOS];
+static pthread_mutex_t txqLock = PTHREAD_MUTEX_INITIALIZER;
+static osjob_t polljob[MAX_RADIOS];
+
+// Every radio is a device of its own: radio 0 uses DEVADDR/DEVKEY/ARTKEY, the
+// others the session given with r:<id> ahead of e:/n:/s: in a message
+struct session_t {
+    u4_t devaddr;
+    u1_t nwkKey[16];
+    u1_t artKey[16];
+};
+static struct session_t sessions[MAX_RADIOS];
+static int session_radio = 0; // radio the e:/n:/s: fields of a message apply to
+#endif
+static int nradios = 1;
+
 void print_msg(unsigned char* buffer, int len)
 {
     fprintf(stdout, "BUFFER=");
@@ -129,10 +188,14 @@ void onEvent(ev_t ev)
     case EV_TXCOMPLETE:
         // use this event to keep track of actual transmissions
         fprintf(stdout, "Event EV_TXCOMPLETE, time: %d\n", millis() / 1000);
+#if defined(CFG_energy)
+        fprintf(stdout, "Radio energy %u uJ/uplink, %u mJ/day\n", LMIC_uplinkEnergy(), LMIC_dailyEnergy());
+#endif
         if(LMIC.dataLen)
         { // data received in rx slot after tx
             //debug_buf(LMIC.frame+LMIC.dataBeg, LMIC.dataLen);
             fprintf(stdout, "Data Received!\n");
+            ipc_downlink();
         }
         break;
 
@@ -199,22 +262,25 @@ static void do_send(osjob_t* j)
 
     time_t t = time(NULL);
     //fprintf(stdout, "do_send [%x] (%ld) %s\n", hal_ticks(), t, ctime(&t));
-    // Show TX channel (channel numbers are local to LMIC)
     // Check if there is not a current TX/RX job running
-    //if(LMIC.opmode & (1 << 7))
-    //{
-    //    fprintf(stdout, "OP_TXRXPEND, not sending\n");
-    //}
-    //else
+    if(LMIC.opmode & OP_TXRXPEND)
+    {
+        // keep the data queued until the transaction is done
+        return;
+    }
+    else
     {
         // Prepare upstream data transmission at the next possible time.
-        fprintf(stdout, "SENDING DATA=");
+        ostime_t wait = LMIC_nextTxTime(mydatalen, LMIC.datarate) - os_getTime();
+        fprintf(stdout, "SENDING DATA (air in %d ms, duty %d.%02d%%)=",
+                wait > 0 ? (int)osticks2ms(wait) : 0,
+                LMIC_dutyUtilization(0) / 100, LMIC_dutyUtilization(0) % 100);
         for(int i = 0; i < mydatalen; i++)
         {
             fprintf(stdout, "%x", mydata[i]);
         }
         fprintf(stdout, "\n");
-        LMIC_setTxData2(1, mydata, mydatalen, 0);
+        LMIC_setTxData2(mydataport, mydata, mydatalen, 0);
         mydatalen = 0;
     }
     // Schedule a timed job to run at the given timestamp (absolute system time)
@@ -229,17 +295,19 @@ void startsession()
     // start joining
     printf("SETTING UP SESSION\n");
     // LMIC_startJoining();
+#if defined(CFG_multiradio)
+    if(nradios > 1 && radios_self() > 0)
+    {
+        struct session_t* s = &sessions[radios_self()];
+        LMIC_setSession(0x1, s->devaddr, s->nwkKey, s->artKey);
+        return;
+    }
+#endif
     LMIC_setSession(0x1, DEVADDR, (u1_t*)DEVKEY, (u1_t*)ARTKEY);
 }
 
-void setup()
+static void configure()
 {
-    // LMIC init
-    wiringPiSetup();
-
-    os_init();
-    // Reset the MAC state. Session and pending data transfers will be discarded.
-    LMIC_reset();
     startsession();
     // Disable data rate adaptation
     LMIC_setAdrMode(0);
@@ -251,9 +319,117 @@ void setup()
     LMIC_stopPingable();
     // Set data rate and transmit power (note: txpow seems to be ignored by the library)
     LMIC_setDrTxpow(DR_SF7, 14);
+    // Let the device adapt DR/txpow from downlink quality
+    if(adr_margin > 0)
+    {
+        LMIC_setDevAdr(adr_margin, adr_eirp);
+    }
+}
+
+void setup()
+{
+    // LMIC init
+    wiringPiSetup();
+
+    os_init();
+    // Reset the MAC state. Session and pending data transfers will be discarded.
+    LMIC_reset();
+    configure();
+    session_started = true;
+    joined = true;
+}
+
+#if defined(CFG_multiradio)
+// radio 0 always has a session, the others once given one
+static bool has_session(int id)
+{
+    return id == 0 || sessions[id].devaddr != 0;
+}
+
+// queue a message on radio, or on the one with the fewest pending messages (-1)
+static int enqueue(int radio, const u1_t* data, int len, u1_t port)
+{
+    pthread_mutex_lock(&txqLock);
+    int best = radio < 0 ? 0 : radio;
+    for(int id = 1; radio < 0 && id < nradios; id++)
+    {
+        if(has_session(id) && txq[id].head - txq[id].tail < txq[best].head - txq[best].tail)
+        {
+            best = id;
+        }
+    }
+    struct txqueue_t* q = &txq[best];
+    int res = -1;
+    if(q->head - q->tail < TXQ_LEN)
+    {
+        memcpy(q->data[q->head % TXQ_LEN], data, len);
+        q->len[q->head % TXQ_LEN] = len;
+        q->port[q->head % TXQ_LEN] = port;
+        q->head++;
+        res = best;
+    }
+    pthread_mutex_unlock(&txqLock);
+    return res;
+}
+
+// runs on each radio's thread: send the next queued message when idle
+static void radio_poll(osjob_t* j)
+{
+    u1_t id = radios_self();
+    if((LMIC.opmode & OP_TXRXPEND) == 0)
+    {
+        u1_t data[255];
+        int len = 0;
+        u1_t port = 1;
+        pthread_mutex_lock(&txqLock);
+        struct txqueue_t* q = &txq[id];
+        if(q->head != q->tail)
+        {
+            len = q->len[q->tail % TXQ_LEN];
+            port = q->port[q->tail % TXQ_LEN];
+            memcpy(data, q->data[q->tail % TXQ_LEN], len);
+            q->tail++;
+        }
+        pthread_mutex_unlock(&txqLock);
+        if(len > 0)
+        {
+            fprintf(stdout, "RADIO %d SENDING DATA (fcnt %u)=", id, LMIC.seqnoUp);
+            for(int i = 0; i < len; i++)
+            {
+                fprintf(stdout, "%x", data[i]);
+            }
+            fprintf(stdout, "\n");
+            LMIC_setTxData2(port, data, len, 0);
+        }
+    }
+    os_setTimedCallback(j, os_getTime() + ms2osticks(10), radio_poll);
+}
+
+static void radio_setup(u1_t id)
+{
+    configure();
+    radios_shareChannels(id, nradios);
+    os_setCallback(&polljob[id], radio_poll);
+}
+
+static void start_radios()
+{
+    wiringPiSetup();
+    for(int id = 0; id < nradios; id++)
+    {
+        if(!has_session(id))
+        {
+            fprintf(stderr, "Radio %d has no session (r:%d:e:...:n:...:s:...), not started\n", id, id);
+        }
+        else if(radios_start(id, &radiopins[id], radio_setup) != 0)
+        {
+            fprintf(stderr, "Unable to start radio %d\n", id);
+        }
+    }
     session_started = true;
     joined = true;
 }
+#endif
 
 void reverse_array(unsigned char *array, int n)
 {
@@ -305,7 +481,21 @@ int main_loop()
 {
     while(1)
     {
-        mosquitto_loop(mosq, -1, 1);
+        if(ipc_listen >= 0 || ipc_shm != NULL)
+        {
+            // MQTT is only a bridge now: don't block in it
+            mosquitto_loop(mosq, 0, 1);
+            ipc_poll(1);
+            fflush(stdout);
+        }
+        else
+        {
+            mosquitto_loop(mosq, -1, 1);
+        }
+        if(nradios > 1)
+        {
+            continue; // radios run on their own threads
+        }
 
         if(session_started == true)
         {
@@ -340,25 +530,60 @@ int parse_socket_args(char arg, const char* optarg)
         break;
     case 'n':
     {
+#if defined(CFG_multiradio)
+        if(session_radio > 0)
+        {
+            convert(optarg, sessions[session_radio].nwkKey, 16);
+            break;
+        }
+#endif
         convert(optarg, (unsigned char*)&DEVKEY, 16);
         //reverse_array((unsigned char*)&DEVKEY, 16);
     }
         break;
     case 's':
     {
+#if defined(CFG_multiradio)
+        if(session_radio > 0)
+        {
+            convert(optarg, sessions[session_radio].artKey, 16);
+            break;
+        }
+#endif
         convert(optarg, (unsigned char*)&ARTKEY, 16);
         //reverse_array((unsigned char*)&ARTKEY, 16);
     }
         break;
     case 'e':
     {
+#if defined(CFG_multiradio)
+        if(session_radio > 0)
+        {
+            convert(optarg, (unsigned char*)&sessions[session_radio].devaddr, 4);
+            reverse_array((unsigned char*)&sessions[session_radio].devaddr, 4);
+            break;
+        }
+#endif
         convert(optarg, (unsigned char*)&DEVADDR, 4);
         reverse_array((unsigned char*)&DEVADDR, 4);
     }
         break;
+#if defined(CFG_multiradio)
+    case 'r':
+    {
+        session_radio = atoi(optarg);
+        if(session_radio < 0 || session_radio >= MAX_RADIOS)
+        {
+            fprintf(stderr, "Radio must be 0..%d\n", MAX_RADIOS-1);
+            session_radio = 0;
+        }
+    }
+        break;
+#endif
     case 'x':
     {
         mydatalen = convert(optarg, (unsigned char*)&mydata, 254);
+        mydataport = 1;
         printf("DATALEN=%d\n", mydatalen);
     }
         break;
@@ -372,6 +597,9 @@ int parse_socket_args(char arg, const char* optarg)
 int parse_msg(char * buffer)
 {
     const char* arg = strtok(buffer, ":");
+#if defined(CFG_multiradio)
+    session_radio = 0;
+#endif
     do
     {
         const char* arg2 = strtok(NULL, ":");
@@ -380,39 +608,349 @@ int parse_msg(char * buffer)
     }
     while(arg != NULL);
 }
-void my_message_callback(struct mosquitto *mosq, void *userdata, const struct mosquitto_message *message)
+static void route_devaddr();
+
+// mydata is set: start the session or hand it to the radios
+static void queue_msg()
 {
-    bool match = 0;
-    /*
-     if(message->payloadlen){
-     printf("%s %s\n", message->topic, message->payload);
-     }else{
-     printf("%s (null)\n", message->topic);
-     }
-     */
-    mosquitto_topic_matches_sub("/ttn-send/send_message", message->topic, &match);
-    if(match)
-    {
-        printf("********MESSAGE RECEIVED******\n");
-        printf("got send message\n");
-        parse_msg((char*)message->payload);
-        printf("********MESSAGE PARSED******\n");
+#if defined(CFG_multiradio)
+    if(nradios > 1)
+    {
         if(session_started == false)
         {
-            setup();
+            start_radios();
+        }
+        if(mydatalen > 0 && enqueue(-1, mydata, mydatalen, mydataport) < 0)
+        {
+            fprintf(stderr, "TX queues full, message dropped\n");
+        }
+        mydatalen = 0;
+    }
+#endif
+    if(session_started == false)
+    {
+        setup();
+    }
+}
+
+// send message from MQTT or a local transport (NUL terminated, modified)
+static void handle_msg(char* buffer)
+{
+    printf("********MESSAGE RECEIVED******\n");
+    printf("got send message\n");
+    parse_msg(buffer);
+    printf("********MESSAGE PARSED******\n");
+    route_devaddr();
+    queue_msg();
+}
+
+//////////////////////////////////////////////////
+// LOCAL TRANSPORTS (see ipc.h)
+//////////////////////////////////////////////////
+
+static int ipc_open_socket(const char* path)
+{
+    struct sockaddr_un addr;
+    if(strlen(path) >= sizeof(addr.sun_path))
+    {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    ipc_listen = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(ipc_listen < 0 || bind(ipc_listen, (struct sockaddr*)&addr, sizeof(addr)) < 0
+       || listen(ipc_listen, IPC_MAX_CLIENTS) < 0)
+    {
+        if(ipc_listen >= 0)
+        {
+            close(ipc_listen);
         }
+        ipc_listen = -1;
+        return -1;
     }
+    return 0;
+}
 
+static int ipc_open_shm(const char* name)
+{
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0660);
+    if(fd < 0)
+    {
+        return -1;
+    }
+    if(ftruncate(fd, sizeof(struct ipcshm_t)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    void* p = mmap(NULL, sizeof(struct ipcshm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED)
+    {
+        return -1;
+    }
+    ipc_shm = (struct ipcshm_t*)p;
+    // lmicd owns the rings: start empty, then tell producers
+    ipc_shm->up.head = ipc_shm->up.tail = 0;
+    ipc_shm->dn.head = ipc_shm->dn.tail = 0;
+    __atomic_store_n(&ipc_shm->magic, (uint32_t)IPC_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void ipc_drop_client(int i)
+{
+    close(ipc_clients[i]);
+    ipc_clients[i] = ipc_clients[--ipc_nclients];
+}
+
+// index of the client on fd, -1 if dropped meanwhile (call with ipc_dnLock held)
+static int ipc_find_client(int fd)
+{
+    for(int i = 0; i < ipc_nclients; i++)
+    {
+        if(ipc_clients[i] == fd)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// received frame to every socket client and the dn ring
+static void ipc_downlink()
+{
+    if(ipc_listen < 0 && ipc_shm == NULL)
+    {
+        return;
+    }
+    char rec[IPC_REC_MAX];
+    int port = (LMIC.txrxFlags & TXRX_PORT) ? LMIC.frame[LMIC.dataBeg - 1] : 0;
+    int len = snprintf(rec, sizeof(rec), "p:%d:x:", port);
+    for(int i = 0; i < LMIC.dataLen; i++)
+    {
+        len += snprintf(rec + len, sizeof(rec) - len, "%02x", LMIC.frame[LMIC.dataBeg + i]);
+    }
+    len += snprintf(rec + len, sizeof(rec) - len, ":");
+    pthread_mutex_lock(&ipc_dnLock);
+    for(int i = 0; i < ipc_nclients; i++)
+    {
+        if(send(ipc_clients[i], rec, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 && errno != EAGAIN)
+        {
+            ipc_drop_client(i--);
+        }
+    }
+    if(ipc_shm != NULL && ipcring_put(&ipc_shm->dn, rec, len) < 0)
+    {
+        fprintf(stderr, "IPC dn ring full, downlink dropped\n");
+    }
+    pthread_mutex_unlock(&ipc_dnLock);
+}
+
+// accept clients and take records while no uplink is waiting, wait up to timeout ms
+static void ipc_poll(int timeout)
+{
+    struct pollfd fds[1 + IPC_MAX_CLIENTS];
+    char rec[IPC_REC_MAX + 1];
+    int ready = mydatalen == 0;
+    int n = 0;
+    if(ready && ipc_shm != NULL)
+    {
+        if(ipc_listen < 0)
+        {
+            // ring only: sleep on its doorbell rather than a fixed tick
+            ipcring_wait(&ipc_shm->up, timeout);
+            timeout = 0;
+        }
+        int len = ipcring_get(&ipc_shm->up, rec);
+        if(len >= 0)
+        {
+            rec[len] = 0;
+            handle_msg(rec);
+            return;
+        }
+    }
+    if(ipc_listen >= 0)
+    {
+        fds[n].fd = ipc_listen;
+        fds[n++].events = POLLIN;
+        pthread_mutex_lock(&ipc_dnLock);
+        for(int i = 0; ready && i < ipc_nclients; i++)
+        {
+            fds[n].fd = ipc_clients[i];
+            fds[n++].events = POLLIN;
+        }
+        pthread_mutex_unlock(&ipc_dnLock);
+    }
+    if(poll(fds, n, timeout) <= 0)
+    {
+        return;
+    }
+    // radios may drop clients while we poll: find each one again by fd
+    for(int i = 1; i < n; i++)
+    {
+        if((fds[i].revents & (POLLIN | POLLERR | POLLHUP)) == 0 || mydatalen != 0)
+        {
+            continue; // nothing, or previous record of this pass is still waiting
+        }
+        int len = -1;
+        pthread_mutex_lock(&ipc_dnLock);
+        int c = ipc_find_client(fds[i].fd);
+        if(c >= 0)
+        {
+            len = recv(fds[i].fd, rec, IPC_REC_MAX, MSG_DONTWAIT);
+            if(len == 0 || (len < 0 && errno != EAGAIN))
+            {
+                ipc_drop_client(c);
+            }
+        }
+        pthread_mutex_unlock(&ipc_dnLock);
+        if(len > 0)
+        {
+            rec[len] = 0;
+            handle_msg(rec);
+        }
+    }
+    if(n > 0 && (fds[0].revents & POLLIN))
+    {
+        int fd = accept4(ipc_listen, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd >= 0 && ipc_nclients == IPC_MAX_CLIENTS)
+        {
+            close(fd);
+        }
+        else if(fd >= 0)
+        {
+            pthread_mutex_lock(&ipc_dnLock);
+            ipc_clients[ipc_nclients++] = fd;
+            pthread_mutex_unlock(&ipc_dnLock);
+        }
+    }
+}
+
+//////////////////////////////////////////////////
+// MQTT TOPIC ROUTING (see route.h)
+//////////////////////////////////////////////////
+
+#if defined(CFG_multiradio)
+enum { NSESSIONS = MAX_RADIOS };
+#else
+enum { NSESSIONS = 1 };
+#endif
+// ROUTE_UP + id: per-device route of session (radio) id
+enum { ROUTE_SEND, ROUTE_UP, NROUTES = ROUTE_UP + NSESSIONS };
+static struct route_t routes[NROUTES];
+static u4_t routed_devaddr[NSESSIONS];
+
+// /ttn-send/send_message: message as on the local transports
+static void route_send(int id, char** args, const char* payload, int len)
+{
+    char msg[IPC_REC_MAX + 1];
+    if(len > IPC_REC_MAX)
+    {
+        fprintf(stderr, "Message too long, dropped\n");
+        return;
+    }
+    memcpy(msg, payload, len);
+    msg[len] = 0;
+    handle_msg(msg);
+}
+
+// /ttn-send/<devaddr>/up/<port>: hex payload to send on that port by session id
+static void route_up(int id, char** args, const char* payload, int len)
+{
+    char hex[2 * 254 + 1];
+    char* end;
+    long port = strtol(args[0], &end, 10);
+    if(*end != 0 || port < 1 || port > 223 || len >= (int)sizeof(hex))
+    {
+        fprintf(stderr, "Invalid port or payload on up/%s, dropped\n", args[0]);
+        return;
+    }
+    if(mydatalen != 0)
+    {
+        fprintf(stderr, "Previous message not sent yet, replaced\n");
+    }
+    memcpy(hex, payload, len);
+    hex[len] = 0;
+#if defined(CFG_multiradio)
+    if(nradios > 1)
+    {
+        u1_t data[254];
+        int n = convert(hex, data, sizeof(data));
+        if(session_started == false)
+        {
+            start_radios();
+        }
+        if(n > 0 && enqueue(id, data, n, port) < 0)
+        {
+            fprintf(stderr, "TX queue of radio %d full, message dropped\n", id);
+        }
+        return;
+    }
+#endif
+    mydatalen = convert(hex, mydata, 254);
+    mydataport = port;
+    queue_msg();
+}
+
+// device address of session id (0: none)
+static u4_t session_devaddr(int id)
+{
+#if defined(CFG_multiradio)
+    if(id > 0)
+    {
+        return id < nradios ? sessions[id].devaddr : 0;
+    }
+#endif
+    return DEVADDR;
+}
+
+// (re)subscribe the per-device route of each session whose address changed
+static void route_devaddr()
+{
+    for(int id = 0; id < NSESSIONS; id++)
+    {
+        u4_t devaddr = session_devaddr(id);
+        struct route_t* r = &routes[ROUTE_UP + id];
+        if(devaddr == routed_devaddr[id])
+        {
+            continue;
+        }
+        if(r->filter[0] != 0)
+        {
+            mosquitto_unsubscribe(mosq, NULL, r->filter);
+            r->filter[0] = 0;
+        }
+        if(devaddr != 0)
+        {
+            char filter[ROUTE_TOPIC];
+            snprintf(filter, sizeof(filter), "/ttn-send/%08X/up/+", devaddr);
+            route_set(r, filter, route_up, id);
+            mosquitto_subscribe(mosq, NULL, filter, 0);
+        }
+        routed_devaddr[id] = devaddr;
+    }
+}
+
+void my_message_callback(struct mosquitto *mosq, void *userdata, const struct mosquitto_message *message)
+{
+    route_dispatch(routes, NROUTES, message->topic, (const char*)message->payload, message->payloadlen);
     fflush(stdout);
 }
 
 void my_connect_callback(struct mosquitto *mosq, void *userdata, int result)
 {
-    int i;
     if(!result)
     {
-        /* Subscribe to broker information topics on successful connect. */
-        mosquitto_subscribe(mosq, NULL, "$SYS/#", 2);
+        // routed topics only, again after every reconnect
+        for(int i = 0; i < NROUTES; i++)
+        {
+            if(routes[i].filter[0] != 0)
+            {
+                mosquitto_subscribe(mosq, NULL, routes[i].filter, 0);
+            }
+        }
     }
     else
     {
@@ -457,13 +995,12 @@ int init_mosquitto(unsigned int port)
     mosquitto_message_callback_set(mosq, my_message_callback);
     mosquitto_subscribe_callback_set(mosq, my_subscribe_callback);
 
+    route_set(&routes[ROUTE_SEND], "/ttn-send/send_message", route_send, 0);
     if(mosquitto_connect(mosq, host, port, keepalive))
     {
         fprintf(stderr, "Unable to connect.\n");
         return 1;
     }
-
-    mosquitto_subscribe(mosq, NULL, "/ttn-send/send_message", 0);
 }
 
 int uninit_mosquitto()
@@ -477,7 +1014,7 @@ int main(int argc, char *argv[])
 {
     int opt;
     unsigned int port = 1883;
-    while((opt = getopt(argc, argv, "p:")) != -1)
+    while((opt = getopt(argc, argv, "p:m:g:c:r:u:q:")) != -1)
     {
         switch(opt)
         {
@@ -486,6 +1023,60 @@ int main(int argc, char *argv[])
             port = atoi(optarg);
         }
             break;
+        case 'm':
+        {
+            adr_margin = atoi(optarg);
+        }
+            break;
+        case 'g':
+        {
+            adr_eirp = atoi(optarg);
+        }
+            break;
+        case 'c':
+        {
+#if defined(CFG_capture)
+            if(cap_open(optarg) != 0)
+            {
+                fprintf(stderr, "Unable to open capture file %s\n", optarg);
+            }
+#else
+            fprintf(stderr, "Capture not available, build with CFG_capture\n");
+#endif
+        }
+            break;
+        case 'r':
+        {
+#if defined(CFG_multiradio)
+            nradios = atoi(optarg);
+            if(nradios < 1 || nradios > MAX_RADIOS)
+            {
+                fprintf(stderr, "Number of radios must be 1..%d\n", MAX_RADIOS);
+                return 1;
+            }
+#else
+            fprintf(stderr, "Multiple radios not available, build with CFG_multiradio\n");
+#endif
+        }
+            break;
+        case 'u':
+        {
+            if(ipc_open_socket(optarg) != 0)
+            {
+                fprintf(stderr, "Unable to open socket %s\n", optarg);
+                return 1;
+            }
+        }
+            break;
+        case 'q':
+        {
+            if(ipc_open_shm(optarg) != 0)
+            {
+                fprintf(stderr, "Unable to open shared memory %s\n", optarg);
+                return 1;
+            }
+        }
+            break;
         default:
             break;
         }
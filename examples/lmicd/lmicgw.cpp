@@ -0,0 +1,267 @@
+/*******************************************************************************
+ * Single channel packet forwarder.
+ *
+ * Keeps the radio in continuous receive on one channel/SF and forwards every
+ * uplink it hears to a Semtech UDP packet forwarder endpoint (PUSH_DATA, "rxpk"
+ * JSON), e.g. a local gateway bridge listening on 127.0.0.1:1700.
+ *
+ * Receive only: no downlinks (PULL_DATA/PULL_RESP) are handled.
+ *
+ * Do not forget to define the radio type correctly in config.h.
+ *
+ *******************************************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <lmic.h>
+#include <hal.h>
+#include <local_hal.h>
+#include <halrec.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#if defined(CFG_capture)
+#include <capture.h>
+#endif
+
+// Gateway EUI reported in the packet forwarder header (MSBF)
+static u1_t GWEUI[8] =
+    { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 };
+
+static int udpfd = -1;
+static struct sockaddr_in fwdaddr;
+
+static u4_t freq = 0;
+static int sf = SF7;
+
+// forwarder statistics, printed every STAT_INTERVAL seconds
+enum { STAT_INTERVAL = 60 };
+static u4_t nrx = 0;
+static u4_t nfwd = 0;
+static ostime_t maxlat = 0;
+static osjob_t statjob;
+static volatile sig_atomic_t stop = 0;
+
+// Pin mapping
+lmic_pinmap pins =
+    { .nss = 6, .rxtx = UNUSED_PIN, // Not connected on RFM92/RFM95
+            .rst = 0, // Needed on RFM92/RFM95
+            .dio =
+                { 7, 4, 5 } };
+
+//////////////////////////////////////////////////
+// APPLICATION CALLBACKS (unused, the MAC stays idle)
+//////////////////////////////////////////////////
+
+void os_getArtEui(u1_t* buf)
+{
+    memset(buf, 0, 8);
+}
+
+void os_getDevEui(u1_t* buf)
+{
+    memset(buf, 0, 8);
+}
+
+void os_getDevKey(u1_t* buf)
+{
+    memset(buf, 0, 16);
+}
+
+void onEvent(ev_t ev)
+{
+}
+
+//////////////////////////////////////////////////
+// PACKET FORWARDER
+//////////////////////////////////////////////////
+
+enum { PROTOCOL_VERSION = 2, PKT_PUSH_DATA = 0 };
+
+static int base64(const u1_t* in, int len, char* out)
+{
+    static const char b64[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    int o = 0;
+    for(int i = 0; i < len; i += 3)
+    {
+        u4_t v = in[i] << 16;
+        if(i + 1 < len) v |= in[i + 1] << 8;
+        if(i + 2 < len) v |= in[i + 2];
+        out[o++] = b64[(v >> 18) & 0x3F];
+        out[o++] = b64[(v >> 12) & 0x3F];
+        out[o++] = i + 1 < len ? b64[(v >> 6) & 0x3F] : '=';
+        out[o++] = i + 2 < len ? b64[v & 0x3F] : '=';
+    }
+    out[o] = 0;
+    return o;
+}
+
+static void forward(const u1_t* frame, int len, ostime_t rxtime, int rssi, s1_t snr)
+{
+    static const char* cr[] = { "4/5", "4/6", "4/7", "4/8" };
+    static const int bw[] = { 125, 250, 500 };
+    char data[(MAX_LEN_FRAME + 2) / 3 * 4 + 1];
+    u1_t pkt[12 + 512];
+
+    pkt[0] = PROTOCOL_VERSION;
+    pkt[1] = rand();
+    pkt[2] = rand();
+    pkt[3] = PKT_PUSH_DATA;
+    memcpy(pkt + 4, GWEUI, 8);
+
+    base64(frame, len, data);
+    int n = snprintf((char*)pkt + 12, sizeof(pkt) - 12,
+        "{\"rxpk\":[{\"tmst\":%u,\"chan\":0,\"rfch\":0,\"freq\":%.6f,\"stat\":1,"
+        "\"modu\":\"LORA\",\"datr\":\"SF%dBW%d\",\"codr\":\"%s\","
+        "\"rssi\":%d,\"lsnr\":%.1f,\"size\":%d,\"data\":\"%s\"}]}",
+        (u4_t)osticks2us(rxtime), freq / 1e6,
+        getSf(LMIC.rps) + 6, bw[getBw(LMIC.rps)], cr[getCr(LMIC.rps)],
+        rssi, snr / 4.0, len, data);
+
+    if(sendto(udpfd, pkt, 12 + n, 0, (struct sockaddr*)&fwdaddr, sizeof(fwdaddr)) == 12 + n)
+    {
+        nfwd++;
+    }
+}
+
+// runs once per frame received (radio is already listening again)
+static void rxdone(osjob_t* j)
+{
+    ostime_t lat = os_getTime() - LMIC.rxtime;
+    if(lat > maxlat)
+    {
+        maxlat = lat;
+    }
+    nrx++;
+    forward(LMIC.frame, LMIC.dataLen, LMIC.rxtime, LMIC.rssi - RSSI_OFF, LMIC.snr); // LMIC.rssi is dBm+RSSI_OFF
+}
+
+static void stats(osjob_t* j)
+{
+    fprintf(stdout, "rx %u fwd %u (%.2f pkt/s) max latency %d us\n",
+        nrx, nfwd, (double)nrx / STAT_INTERVAL, (int)osticks2us(maxlat));
+    fflush(stdout);
+    nrx = nfwd = 0;
+    maxlat = 0;
+    os_setTimedCallback(j, os_getTime() + sec2osticks(STAT_INTERVAL), stats);
+}
+
+int convert(const char *hex_str, unsigned char *byte_array, int byte_array_max)
+{
+    int hex_str_len = strlen(hex_str);
+    int byte_array_size = hex_str_len / 2;
+
+    if(byte_array_size > byte_array_max)
+    {
+        return -1;
+    }
+    for(int i = 0; i < byte_array_size; i++)
+    {
+        if(sscanf(&(hex_str[2 * i]), "%2hhx", &(byte_array[i])) != 1)
+        {
+            return -1;
+        }
+    }
+    return byte_array_size;
+}
+
+static void onSignal(int sig)
+{
+    stop = 1;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    const char* host = "127.0.0.1";
+    unsigned int port = 1700;
+    while((opt = getopt(argc, argv, "f:s:g:h:p:c:r:")) != -1)
+    {
+        switch(opt)
+        {
+        case 'f':
+            freq = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            sf = atoi(optarg) - 6; // SF7..SF12
+            break;
+        case 'g':
+            convert(optarg, GWEUI, 8);
+            break;
+        case 'h':
+            host = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'c':
+#if defined(CFG_capture)
+            if(cap_open(optarg) != 0)
+            {
+                fprintf(stderr, "Unable to open capture file %s\n", optarg);
+            }
+#else
+            fprintf(stderr, "Capture not available, build with CFG_capture\n");
+#endif
+            break;
+        case 'r':
+#if defined(CFG_halrec)
+            if(hal_record(optarg) != 0)
+            {
+                fprintf(stderr, "Unable to open HAL log %s\n", optarg);
+            }
+#elif defined(CFG_halreplay)
+            if(hal_replay(optarg) != 0)
+            {
+                fprintf(stderr, "Unable to read HAL log %s\n", optarg);
+                return 1;
+            }
+#else
+            fprintf(stderr, "HAL log not available, build with CFG_halrec or CFG_halreplay\n");
+#endif
+            break;
+        default:
+            break;
+        }
+    }
+    if(freq == 0 || sf < SF7 || sf > SF12)
+    {
+        fprintf(stderr, "usage: %s -f <freq Hz> [-s <7..12>] [-g <gateway eui>] [-h <host>] [-p <port>] [-c <pcapng file>] [-r <hal log>]\n", argv[0]);
+        return 1;
+    }
+
+    udpfd = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&fwdaddr, 0, sizeof(fwdaddr));
+    fwdaddr.sin_family = AF_INET;
+    fwdaddr.sin_port = htons(port);
+    if(udpfd < 0 || inet_aton(host, &fwdaddr.sin_addr) == 0)
+    {
+        fprintf(stderr, "Invalid forwarder endpoint %s:%u\n", host, port);
+        return 1;
+    }
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    os_init();
+    LMIC_reset();
+    LMIC_startGateway(freq, MAKERPS(sf, BW125, CR_4_5, 0, 0), rxdone);
+    os_setTimedCallback(&statjob, os_getTime() + sec2osticks(STAT_INTERVAL), stats);
+    fprintf(stdout, "Forwarding SF%dBW125 on %u Hz to %s:%u\n", sf + 6, freq, host, port);
+    fflush(stdout);
+
+    while(!stop)
+    {
+        os_runloop_once();
+    }
+#if defined(CFG_capture)
+    cap_close();
+#endif
+#if defined(CFG_halrec)
+    hal_recordClose();
+#endif
+    return 0;
+}
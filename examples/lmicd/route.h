@@ -0,0 +1,123 @@
+/*******************************************************************************
+ * MQTT topic routing for lmicd.
+ *
+ * Each route is a topic filter lmicd subscribes to and the handler for the
+ * messages it brings. Filters are split into levels once, when the route is
+ * set; a received topic is split the same way and compared level by level,
+ * '+' levels are handed to the handler as arguments, along with the route's
+ * id (which of several routes sharing a handler matched). Only routed filters are
+ * subscribed, so nothing else reaches the message callback. ('#' filters are
+ * not supported.)
+ *******************************************************************************/
+
+#ifndef _route_h_
+#define _route_h_
+
+#include <string.h>
+
+enum { ROUTE_TOPIC = 64 };   // max topic length
+enum { ROUTE_LEVELS = 8 };   // max topic levels
+
+// id: route id, args: the '+' levels of the topic, payload: len bytes (not NUL terminated)
+typedef void (*route_fn)(int id, char** args, const char* payload, int len);
+
+struct route_t {
+    char     filter[ROUTE_TOPIC];  // as subscribed ("" = route unused)
+    char     split[ROUTE_TOPIC];   // filter with '/' replaced by NUL
+    char*    level[ROUTE_LEVELS];  // literal levels in split, NULL for '+'
+    int      len[ROUTE_LEVELS];    // length of the literal levels
+    int      nlevels;
+    route_fn fn;
+    int      id;
+};
+
+// set route r to filter with handler fn and id (0=ok, -1=too long or too many levels)
+static inline int route_set(struct route_t* r, const char* filter, route_fn fn, int id)
+{
+    r->filter[0] = 0;
+    if(strlen(filter) >= ROUTE_TOPIC)
+    {
+        return -1;
+    }
+    strcpy(r->split, filter);
+    r->nlevels = 0;
+    for(char* p = r->split; ; p++)
+    {
+        if(r->nlevels == ROUTE_LEVELS)
+        {
+            return -1;
+        }
+        char* end = strchrnul(p, '/');
+        int last = *end == 0;
+        *end = 0;
+        r->level[r->nlevels] = strcmp(p, "+") == 0 ? NULL : p;
+        r->len[r->nlevels++] = end - p;
+        if(last)
+        {
+            break;
+        }
+        p = end;
+    }
+    strcpy(r->filter, filter);
+    r->fn = fn;
+    r->id = id;
+    return 0;
+}
+
+// call the handler of the first route matching topic (0=no route)
+static inline int route_dispatch(struct route_t* routes, int n, const char* topic, const char* payload, int len)
+{
+    for(int r = 0; r < n; r++)
+    {
+        const char* arg[ROUTE_LEVELS];
+        int arglen[ROUTE_LEVELS];
+        int nargs = 0;
+        const char* t = topic;
+        int ended = 0;
+        int i = 0;
+        if(routes[r].filter[0] == 0)
+        {
+            continue;
+        }
+        // compare in place, level by level
+        for(; i < routes[r].nlevels && !ended; i++)
+        {
+            const char* end = strchrnul(t, '/');
+            if(routes[r].level[i] == NULL)
+            {
+                arg[nargs] = t;
+                arglen[nargs++] = end - t;
+            }
+            else if(end - t != routes[r].len[i] || memcmp(t, routes[r].level[i], end - t) != 0)
+            {
+                break;
+            }
+            ended = *end == 0;
+            t = end + 1;
+        }
+        if(i != routes[r].nlevels || !ended)
+        {
+            continue; // mismatch, or the topic has fewer/more levels
+        }
+        // matched: hand over the '+' levels NUL terminated
+        char buf[ROUTE_TOPIC];
+        char* args[ROUTE_LEVELS];
+        char* p = buf;
+        for(int a = 0; a < nargs; a++)
+        {
+            if(p + arglen[a] >= buf + sizeof(buf))
+            {
+                return 0;
+            }
+            memcpy(p, arg[a], arglen[a]);
+            p[arglen[a]] = 0;
+            args[a] = p;
+            p += arglen[a] + 1;
+        }
+        routes[r].fn(routes[r].id, args, payload, len);
+        return 1;
+    }
+    return 0;
+}
+
+#endif // _route_h_
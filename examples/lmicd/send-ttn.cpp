@@ -3,6 +3,9 @@
 #include <unistd.h>
 #include <stdio.h> 
 #include <string.h> 
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include <mosquitto.h>
 
 struct mosquitto *mosq = NULL;
@@ -11,6 +14,14 @@ static char buffer[1024];
 static bool connected = false;
 int mqtt_send(char* buffer);
 
+// streaming mode (-f): one connection, records from a file/FIFO/stdin
+static bool streaming = false;
+static int qos = 1;
+static int max_inflight = 20;
+static int inflight = 0;
+static int backoff = 1; // seconds to the next reconnect attempt
+static unsigned long published = 0, acked = 0;
+
 void mosq_log_callback(struct mosquitto *mosq, void *userdata, int level, const char *str)
 {
     /* Print all log messages regardless of level. */
@@ -31,6 +42,16 @@ void mosq_log_callback(struct mosquitto *mosq, void *userdata, int level, const
 
 void mosq_connect_callback(struct mosquitto *mosq, void *obj, int result)
 {
+    if(streaming)
+    {
+        connected = result == 0;
+        if(connected)
+        {
+            backoff = 1;
+        }
+        printf(connected ? "CONNECTED\n" : "CONNECT REFUSED=%i\n", result);
+        return;
+    }
     printf("SENDING=%s\n", buffer);
     int ret = mqtt_send(buffer);
     if(ret != 0) printf("mqtt_send error=%i\n", ret);
@@ -43,6 +64,15 @@ void mosq_disconnect_callback(struct mosquitto *mosq, void *obj, int rc)
 
 void mosq_publish_callback(struct mosquitto *mosq, void *obj, int mid)
 {
+    if(streaming)
+    {
+        if(qos > 0) // QoS 0 was counted as acked when queued
+        {
+            inflight--;
+            acked++;
+        }
+        return;
+    }
     printf("******PUBLISHED********");
     mosquitto_disconnect(mosq);
 }
@@ -91,6 +121,175 @@ int mqtt_send(char *msg)
     return mosquitto_publish(mosq, NULL, topic, strlen(msg), msg, 0, 0);
 }
 
+static double now_secs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// publish one line: a full record ("x:0102:") or just the hex payload,
+// prefixed with the key options from the command line
+static void stream_line(char* line)
+{
+    char msg[sizeof(buffer) + 512];
+    size_t len = strlen(line);
+    if(len > 0 && line[len - 1] == '\r')
+    {
+        line[--len] = 0;
+    }
+    if(len == 0)
+    {
+        return;
+    }
+    if(snprintf(msg, sizeof(msg), strchr(line, ':') ? "%s%s" : "%sx:%s:", buffer, line) >= (int)sizeof(msg))
+    {
+        fprintf(stderr, "Record too long, dropped\n");
+        return;
+    }
+    int rc = mosquitto_publish(mosq, NULL, topic, strlen(msg), msg, qos, false);
+    if(rc != MOSQ_ERR_SUCCESS)
+    {
+        fprintf(stderr, "Publish failed: %i\n", rc);
+        return;
+    }
+    published++;
+    if(qos > 0)
+    {
+        inflight++; // QoS 0 has no PUBACK: counted as acked below
+    }
+    else
+    {
+        acked++;
+    }
+}
+
+// read records until EOF, keeping up to max_inflight unacknowledged
+// QoS 1 publishes on one connection; reconnect with exponential backoff
+static int mqtt_stream(int port, const char* host, const char* path)
+{
+    int fd = strcmp(path, "-") == 0 ? 0 : open(path, O_RDWR); // O_RDWR: no EOF on a FIFO between writers
+    if(fd < 0)
+    {
+        perror(path);
+        return 1;
+    }
+    mosquitto_lib_init();
+    mosq = mosquitto_new(NULL, true, NULL);
+    if(!mosq)
+    {
+        fprintf(stderr, "Error: Out of memory.\n");
+        return 1;
+    }
+    mosquitto_log_callback_set(mosq, mosq_log_callback);
+    mosquitto_connect_callback_set(mosq, mosq_connect_callback);
+    mosquitto_disconnect_callback_set(mosq, mosq_disconnect_callback);
+    mosquitto_publish_callback_set(mosq, mosq_publish_callback);
+    mosquitto_max_inflight_messages_set(mosq, max_inflight);
+
+    char line[sizeof(buffer)];
+    size_t linelen = 0;
+    bool eof = false;
+    double t0 = now_secs(), retry = t0, report = t0 + 10;
+    bool first = true;
+    while(!eof || inflight > 0 || linelen > 0)
+    {
+        double now = now_secs();
+        if(!connected && now >= retry && mosquitto_socket(mosq) < 0)
+        {
+            int rc = first ? mosquitto_connect(mosq, host, port, 60) : mosquitto_reconnect(mosq);
+            first = false;
+            if(rc != MOSQ_ERR_SUCCESS)
+            {
+                fprintf(stderr, "Unable to connect, retry in %d s\n", backoff);
+            }
+            retry = now + backoff; // reset by the CONNACK
+            backoff = backoff * 2 > 64 ? 64 : backoff * 2;
+        }
+        struct pollfd fds[2];
+        int n = 0, sock = mosquitto_socket(mosq);
+        if(sock >= 0)
+        {
+            fds[n].fd = sock;
+            fds[n++].events = POLLIN | (mosquitto_want_write(mosq) ? POLLOUT : 0);
+        }
+        // publish buffered lines while the window is open, the rest wait in
+        // the buffer/pipe while disconnected or max_inflight are unacknowledged
+        char* beg = line;
+        char* nl = NULL;
+        while(connected && inflight < max_inflight
+              && (nl = (char*)memchr(beg, '\n', line + linelen - beg)) != NULL)
+        {
+            *nl = 0;
+            stream_line(beg);
+            beg = nl + 1;
+        }
+        linelen -= beg - line;
+        memmove(line, beg, linelen);
+        bool waiting = memchr(line, '\n', linelen) != NULL;
+        if(!waiting && linelen == sizeof(line) - 1)
+        {
+            fprintf(stderr, "Record too long, dropped\n");
+            linelen = 0;
+        }
+        int in = -1;
+        if(!eof && !waiting && connected && inflight < max_inflight)
+        {
+            in = n;
+            fds[n].fd = fd;
+            fds[n++].events = POLLIN;
+        }
+        int wait = (int)((retry - now) * 1000);
+        poll(fds, n, connected || wait < 0 ? 100 : wait > 1000 ? 1000 : wait);
+        if(sock >= 0)
+        {
+            if(fds[0].revents & POLLOUT)
+            {
+                mosquitto_loop_write(mosq, 1);
+            }
+            if(fds[0].revents & (POLLIN | POLLERR | POLLHUP))
+            {
+                mosquitto_loop_read(mosq, 1);
+            }
+            if(mosquitto_loop_misc(mosq) != MOSQ_ERR_SUCCESS || mosquitto_socket(mosq) < 0)
+            {
+                if(connected)
+                {
+                    fprintf(stderr, "Connection lost, %d messages in flight will be resent\n", inflight);
+                }
+                connected = false;
+            }
+        }
+        if(in >= 0 && (fds[in].revents & (POLLIN | POLLHUP)))
+        {
+            ssize_t r = read(fd, line + linelen, sizeof(line) - 1 - linelen);
+            if(r > 0)
+            {
+                linelen += r;
+            }
+            else
+            {
+                eof = true;
+                if(linelen > 0)
+                {
+                    line[linelen++] = '\n'; // last line without newline
+                }
+            }
+        }
+        if(now >= report || (eof && inflight == 0 && linelen == 0))
+        {
+            double secs = now - t0;
+            printf("PUBLISHED=%lu ACKED=%lu INFLIGHT=%d RATE=%.1f msg/s\n", published, acked, inflight,
+                   secs > 0 ? acked / secs : 0);
+            fflush(stdout);
+            report = now + 10;
+        }
+    }
+    mosquitto_disconnect(mosq);
+    mqtt_uninit();
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     int opt, rc;
@@ -98,7 +297,8 @@ int main(int argc, char *argv[])
     strcpy(host, "localhost");
     strcpy(buffer, "");
     unsigned int port = 1883;
-    while((opt = getopt(argc, argv, "p:h:a:d:n:s:e:x:")) != -1)
+    const char* stream = NULL;
+    while((opt = getopt(argc, argv, "p:h:a:d:n:s:e:x:f:i:q:")) != -1)
     {
         switch(opt)
         {
@@ -114,6 +314,25 @@ int main(int argc, char *argv[])
         }
             break;
 
+        case 'f':
+        {
+            stream = optarg;
+            streaming = true;
+        }
+            break;
+
+        case 'i':
+        {
+            max_inflight = atoi(optarg) > 0 ? atoi(optarg) : 1;
+        }
+            break;
+
+        case 'q':
+        {
+            qos = atoi(optarg) == 0 ? 0 : 1;
+        }
+            break;
+
         default:
         {
             char optbuf[2];
@@ -128,6 +347,10 @@ int main(int argc, char *argv[])
         }
     }
 
+    if(streaming)
+    {
+        return mqtt_stream(port, host, stream);
+    }
     mqtt_setup(port, host);
     do
     {
@@ -9,9 +9,7 @@
  *    IBM Zurich Research Lab - initial API, implementation and documentation
  *******************************************************************************/
 
-#include "oslmic.h"
-
-#define AES_MICSUB 0x30 // internal use only
+#include "lmic.h"
 
 static const u4_t AES_RCON[10] = { 
     0x01000000, 0x02000000, 0x04000000, 0x08000000, 0x10000000, 
@@ -200,20 +198,20 @@ static const u4_t AES_E4[256] = {
                                    a ^=  AES_S[u1(r3)    ]
 
 // global area for passing parameters (aux, key) and for storing round keys
-u4_t AESAUX[16/sizeof(u4_t)];
-u4_t AESKEY[11*16/sizeof(u4_t)];
+OS_TLS u4_t AESAUX[16/sizeof(u4_t)];
+OS_TLS u4_t AESKEY[11*16/sizeof(u4_t)];
 
 // generate 1+10 roundkeys for encryption with 128-bit key
-// read 128-bit key from AESKEY in MSBF, generate roundkey words in place
-static void aesroundkeys () {
+// read 128-bit key from key[0..3] in MSBF, generate roundkey words in place
+static void aesroundkeys (u4_t* key) {
     int i;
     u4_t b;
 
     for( i=0; i<4; i++) {
-        AESKEY[i] = swapmsbf(AESKEY[i]);
+        key[i] = swapmsbf(key[i]);
     }
     
-    b = AESKEY[3];
+    b = key[3];
     for( ; i<44; i++ ) {
         if( i%4==0 ) {
             // b = SubWord(RotWord(b)) xor Rcon[i/4]
@@ -223,13 +221,67 @@ static void aesroundkeys () {
                 (AES_S[   b >> 24 ]      ) ^
                  AES_RCON[(i-4)/4];
         }
-        AESKEY[i] = b ^= AESKEY[i-4];
+        key[i] = b ^= key[i-4];
     }
 }
 
+// encrypt block a[0..3] in place with roundkeys ki
+static void aesblock (const u4_t* ki, u4_t* a) {
+    u4_t a0, a1, a2, a3;
+    u4_t t0, t1, t2, t3;
+    const u4_t* ke = ki + 8*4;
+
+    a0 = a[0] ^ ki[0];
+    a1 = a[1] ^ ki[1];
+    a2 = a[2] ^ ki[2];
+    a3 = a[3] ^ ki[3];
+    do {
+        AES_key4 (t1,t2,t3,t0,4);
+        AES_expr4(t1,t2,t3,t0,a0);
+        AES_expr4(t2,t3,t0,t1,a1);
+        AES_expr4(t3,t0,t1,t2,a2);
+        AES_expr4(t0,t1,t2,t3,a3);
+
+        AES_key4 (a1,a2,a3,a0,8);
+        AES_expr4(a1,a2,a3,a0,t0);
+        AES_expr4(a2,a3,a0,a1,t1);
+        AES_expr4(a3,a0,a1,a2,t2);
+        AES_expr4(a0,a1,a2,a3,t3);
+    } while( (ki+=8) < ke );
+
+    AES_key4 (t1,t2,t3,t0,4);
+    AES_expr4(t1,t2,t3,t0,a0);
+    AES_expr4(t2,t3,t0,t1,a1);
+    AES_expr4(t3,t0,t1,t2,a2);
+    AES_expr4(t0,t1,t2,t3,a3);
+
+    AES_expr(a[0],t0,t1,t2,t3,8);
+    AES_expr(a[1],t1,t2,t3,t0,9);
+    AES_expr(a[2],t2,t3,t0,t1,10);
+    AES_expr(a[3],t3,t0,t1,t2,11);
+}
+
+// compute CMAC subkey K1 (n=1) or K2 (n=2) and xor it into mac
+static void aessubkey (const u4_t* ki, u4_t* mac, u1_t n) {
+    u4_t k[4] = { 0, 0, 0, 0 };
+    aesblock(ki, k);
+    do {
+        u4_t msb = k[0] >> 31;
+        k[0] = (k[0] << 1) | (k[1] >> 31);
+        k[1] = (k[1] << 1) | (k[2] >> 31);
+        k[2] = (k[2] << 1) | (k[3] >> 31);
+        k[3] = (k[3] << 1);
+        if( msb ) k[3] ^= 0x87;
+    } while( --n );
+    mac[0] ^= k[0];
+    mac[1] ^= k[1];
+    mac[2] ^= k[2];
+    mac[3] ^= k[3];
+}
+
 u4_t os_aes (u1_t mode, xref2u1_t buf, u2_t len) {
         
-        aesroundkeys();
+        aesroundkeys(AESKEY);
 
         if( mode & AES_MICNOAUX ) {
             AESAUX[0] = AESAUX[1] = AESAUX[2] = AESAUX[3] = 0;
@@ -241,117 +293,58 @@ u4_t os_aes (u1_t mode, xref2u1_t buf, u2_t len) {
         }
 
         while( (signed char)len > 0 ) {
-            u4_t a0, a1, a2, a3;
-            u4_t t0, t1, t2, t3;
-            u4_t *ki, *ke;
+            u4_t a[4];
+            u4_t t0, t1;
 
             // load input block
             if( (mode & AES_CTR) || ((mode & AES_MIC) && (mode & AES_MICNOAUX)==0) ) { // load CTR block or first MIC block
-                a0 = AESAUX[0];
-                a1 = AESAUX[1];
-                a2 = AESAUX[2];
-                a3 = AESAUX[3];
+                a[0] = AESAUX[0];
+                a[1] = AESAUX[1];
+                a[2] = AESAUX[2];
+                a[3] = AESAUX[3];
             }
             else if( (mode & AES_MIC) && len <= 16 ) { // last MIC block
-                a0 = a1 = a2 = a3 = 0; // load null block
-                mode |= ((len == 16) ? 1 : 2) << 4; // set MICSUB: CMAC subkey K1 or K2
+                aessubkey(AESKEY, AESAUX, (len == 16) ? 1 : 2); // CMAC subkey K1 or K2
+                goto LOADDATA;
             } else
         LOADDATA: { // load data block (partially)
                 for(t0=0; t0<16; t0++) {
                     t1 = (t1<<8) | ((t0<len) ? buf[t0] : (t0==len) ? 0x80 : 0x00);
                     if((t0&3)==3) {
-                        a0 = a1;
-                        a1 = a2;
-                        a2 = a3;
-                        a3 = t1;
+                        a[t0>>2] = t1;
                     }
                 } 
                 if( mode & AES_MIC ) {
-                    a0 ^= AESAUX[0];
-                    a1 ^= AESAUX[1];
-                    a2 ^= AESAUX[2];
-                    a3 ^= AESAUX[3];
+                    a[0] ^= AESAUX[0];
+                    a[1] ^= AESAUX[1];
+                    a[2] ^= AESAUX[2];
+                    a[3] ^= AESAUX[3];
                 }
             }
 
-            // perform AES encryption on block in a0-a3
-            ki = AESKEY;
-            ke = ki + 8*4;
-            a0 ^= ki[0];
-            a1 ^= ki[1];
-            a2 ^= ki[2];
-            a3 ^= ki[3];
-            do {
-                AES_key4 (t1,t2,t3,t0,4);
-                AES_expr4(t1,t2,t3,t0,a0);
-                AES_expr4(t2,t3,t0,t1,a1);
-                AES_expr4(t3,t0,t1,t2,a2);
-                AES_expr4(t0,t1,t2,t3,a3);
-
-                AES_key4 (a1,a2,a3,a0,8);
-                AES_expr4(a1,a2,a3,a0,t0);
-                AES_expr4(a2,a3,a0,a1,t1);
-                AES_expr4(a3,a0,a1,a2,t2);
-                AES_expr4(a0,a1,a2,a3,t3);
-            } while( (ki+=8) < ke );
-
-            AES_key4 (t1,t2,t3,t0,4);
-            AES_expr4(t1,t2,t3,t0,a0);
-            AES_expr4(t2,t3,t0,t1,a1);
-            AES_expr4(t3,t0,t1,t2,a2);
-            AES_expr4(t0,t1,t2,t3,a3);
-
-            AES_expr(a0,t0,t1,t2,t3,8);
-            AES_expr(a1,t1,t2,t3,t0,9);
-            AES_expr(a2,t2,t3,t0,t1,10);
-            AES_expr(a3,t3,t0,t1,t2,11);
-            // result of AES encryption in a0-a3
+            // perform AES encryption on block in a[0..3]
+            aesblock(AESKEY, a);
 
             if( mode & AES_MIC ) {
-                if( (t1 = (mode & AES_MICSUB) >> 4) != 0 ) { // last block
-                    do {
-                        // compute CMAC subkey K1 and K2
-                        t0 = a0 >> 31; // save MSB
-                        a0 = (a0 << 1) | (a1 >> 31);
-                        a1 = (a1 << 1) | (a2 >> 31);
-                        a2 = (a2 << 1) | (a3 >> 31);
-                        a3 = (a3 << 1);
-                        if( t0 ) a3 ^= 0x87;
-                    } while( --t1 );
-
-                    AESAUX[0] ^= a0;
-                    AESAUX[1] ^= a1;
-                    AESAUX[2] ^= a2;
-                    AESAUX[3] ^= a3;
-                    mode &= ~AES_MICSUB;
-                    goto LOADDATA;
-                } else {
-                    // save cipher block as new iv
-                    AESAUX[0] = a0;
-                    AESAUX[1] = a1;
-                    AESAUX[2] = a2;
-                    AESAUX[3] = a3;
-                }
+                // save cipher block as new iv
+                AESAUX[0] = a[0];
+                AESAUX[1] = a[1];
+                AESAUX[2] = a[2];
+                AESAUX[3] = a[3];
             } else { // CIPHER
                 if( mode & AES_CTR ) { // xor block (partially)
                     t0 = (len > 16) ? 16: len;
                     for(t1=0; t1<t0; t1++) {
-                        buf[t1] ^= (a0>>24);
-                        a0 <<= 8;
-                        if((t1&3)==3) {
-                            a0 = a1;
-                            a1 = a2;
-                            a2 = a3;
-                        }
+                        buf[t1] ^= a[t1>>2] >> (24 - 8*(t1&3));
                     }
                     // update counter
                     AESAUX[3]++;
                 } else { // ECB
                     // store block
-                    msbf4_write(buf+0,  a0);
-                    msbf4_write(buf+4,  a1);
-                    msbf4_write(buf+8,  a2);
-                    msbf4_write(buf+12, a3);
+                    msbf4_write(buf+0,  a[0]);
+                    msbf4_write(buf+4,  a[1]);
+                    msbf4_write(buf+8,  a[2]);
+                    msbf4_write(buf+12, a[3]);
                 }
             }
 
@@ -365,3 +358,110 @@ u4_t os_aes (u1_t mode, xref2u1_t buf, u2_t len) {
         return AESAUX[0];
 }
 
+// next payload fragment byte to gather into the frame
+typedef struct gather_t {
+    const txfrag_t* frag;
+    u1_t            off;
+} gather_t;
+
+// xor CTR keystream into buf[beg..end) - ks/pos carry the partially used block.
+// With g the bytes are taken from the fragments on the way, without ki only copied.
+static void aesctr (const u4_t* ki, u4_t* ctr, u1_t* ks, u1_t* pos, xref2u1_t buf, int beg, int end, gather_t* g) {
+    while( beg < end ) {
+        int n = end - beg;
+        const u1_t* src = buf+beg;
+        if( g ) { // run of the current fragment
+            while( g->off == g->frag->len ) {
+                g->frag++;
+                g->off = 0;
+            }
+            src = g->frag->data + g->off;
+            if( n > g->frag->len - g->off )
+                n = g->frag->len - g->off;
+        }
+        if( ki == NULL ) {
+            os_copyMem(buf+beg, src, n);
+        } else {
+            if( *pos == 16 ) {
+                u4_t b[4] = { ctr[0], ctr[1], ctr[2], ctr[3] };
+                aesblock(ki, b);
+                msbf4_write(ks+0,  b[0]);
+                msbf4_write(ks+4,  b[1]);
+                msbf4_write(ks+8,  b[2]);
+                msbf4_write(ks+12, b[3]);
+                ctr[3]++;
+                *pos = 0;
+            }
+            if( n > 16 - *pos )
+                n = 16 - *pos;
+            const u1_t* k = ks + *pos;
+            for( int i = 0; i < n; i++ )
+                buf[beg+i] = src[i] ^ k[i];
+            *pos += n;
+        }
+        if( g )
+            g->off += n;
+        beg += n;
+    }
+}
+
+// LoRaWAN data frame crypto in a single pass over buf.
+// AESkey/AESaux are set up as for AES_MIC (MIC key, block B0). The CTR blocks
+// A1,A2,.. share all fields with B0 and are derived from it. The payload
+// buf[poff..len) is ciphered with ckey (skipped if ckey is NULL) while each
+// 16 byte block of buf[0..len) is absorbed into the CMAC:
+//   AES_ENC - encrypt block then absorb it (UP frames)
+//   AES_DEC - absorb block then decrypt it (DN frames)
+// Returns the MIC like os_aes(AES_MIC,buf,len).
+// With g (AES_ENC only) the payload is gathered into buf as it is ciphered.
+static u4_t aesframe (u1_t mode, xref2cu1_t ckey, xref2u1_t buf, u1_t poff, u1_t len, gather_t* g) {
+    u4_t ck[44], ctr[4], mac[4];
+    u1_t ks[16];
+    const u4_t* cki = AESKEY;  // share roundkeys if cipher and MIC key are the same (port 0)
+    u1_t pos = 16;
+    int off, n;
+
+    if( ckey && memcmp(ckey, AESkey, 16) != 0 ) {
+        os_copyMem(ck, ckey, 16);
+        aesroundkeys(ck);
+        cki = ck;
+    }
+    aesroundkeys(AESKEY);
+    mac[0] = swapmsbf(AESAUX[0]);
+    mac[1] = swapmsbf(AESAUX[1]);
+    mac[2] = swapmsbf(AESAUX[2]);
+    mac[3] = swapmsbf(AESAUX[3]);
+    ctr[0] = (mac[0] & 0x00FFFFFF) | 0x01000000;
+    ctr[1] = mac[1];
+    ctr[2] = mac[2];
+    ctr[3] = (mac[3] & 0xFFFFFF00) | 1;
+    aesblock(AESKEY, mac);
+
+    for( off=0; off<len; off+=16 ) {
+        u4_t w = 0;
+        u1_t t;
+        n = (len-off > 16) ? 16 : len-off;
+        if( (ckey || g) && mode == AES_ENC && off+n > poff )
+            aesctr(ckey ? cki : NULL, ctr, ks, &pos, buf, off > poff ? off : poff, off+n, g);
+        if( off+n == len )
+            aessubkey(AESKEY, mac, (n == 16) ? 1 : 2);
+        for( t=0; t<16; t++ ) {
+            w = (w<<8) | ((t<n) ? buf[off+t] : (t==n) ? 0x80 : 0x00);
+            if( (t&3)==3 )
+                mac[t>>2] ^= w;
+        }
+        aesblock(AESKEY, mac);
+        if( ckey && mode == AES_DEC && off+n > poff )
+            aesctr(cki, ctr, ks, &pos, buf, off > poff ? off : poff, off+n, NULL);
+    }
+    return mac[0];
+}
+
+u4_t os_aesFrame (u1_t mode, xref2cu1_t ckey, xref2u1_t buf, u1_t poff, u1_t len) {
+    return aesframe(mode, ckey, buf, poff, len, NULL);
+}
+
+u4_t os_aesFrameV (xref2cu1_t ckey, xref2u1_t buf, u1_t poff, u1_t len, const txfrag_t* frags) {
+    gather_t g = { frags, 0 };
+    return aesframe(AES_ENC, ckey, buf, poff, len, &g);
+}
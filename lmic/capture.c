@@ -0,0 +1,182 @@
+/*******************************************************************************
+ * pcapng capture of radio frames with LoRaTap headers.
+ *
+ * The radio path only copies a frame into a free ring slot (lock-free, no
+ * syscalls); a writer thread drains the ring into the capture file.
+ *******************************************************************************/
+
+#include "lmic.h"
+
+#if defined(CFG_capture)
+
+#include "capture.h"
+#include <pthread.h>
+#include <time.h>
+
+enum { CAP_SLOTS = 64 };               // ring size (power of two)
+enum { CAP_POLL_MS = 10 };             // writer thread poll interval
+enum { LINKTYPE_LORATAP = 270 };
+enum { LORATAP_LEN = 15 };             // LoRaTap v0 header length
+
+struct capslot_t {
+    u1_t     ready;   // set by producer (release), cleared by writer
+    u1_t     dir;
+    u1_t     len;
+    s2_t     rssi;    // dBm (RX only)
+    s1_t     snr;     // dB*4 (RX only)
+    rps_t    rps;
+    u4_t     freq;
+    ostime_t time;
+    u1_t     data[MAX_LEN_FRAME];
+};
+
+static struct capslot_t ring[CAP_SLOTS];
+static u4_t head;      // next slot to reserve (producers)
+static u4_t tail;      // next slot to write (writer thread)
+static u4_t dropped;
+static FILE* capfile;
+static pthread_t writer;
+static volatile int running;
+
+static void put4 (u4_t v) {
+    fwrite(&v, 4, 1, capfile);
+}
+
+static void writeHeader (void) {
+    // section header block
+    put4(0x0A0D0D0A); put4(28); put4(0x1A2B3C4D);
+    put4(0x00000001); // version 1.0
+    put4(0xFFFFFFFF); put4(0xFFFFFFFF); // section length unknown
+    put4(28);
+    // interface description block (default microsecond resolution)
+    put4(0x00000001); put4(20);
+    put4(LINKTYPE_LORATAP);
+    put4(LORATAP_LEN+MAX_LEN_FRAME); // snaplen
+    put4(20);
+}
+
+static void writeFrame (const struct capslot_t* s, u8_t us) {
+    static const u1_t bw[] = { [BW125]=1, [BW250]=2, [BW500]=4, [BWrfu]=0 };
+    u1_t hdr[LORATAP_LEN];
+    int rssi = s->dir == CAP_RX ? s->rssi + 139 : 0;
+    u4_t caplen = LORATAP_LEN + s->len;
+    u4_t pad = (4 - (caplen & 3)) & 3;
+    u4_t zero = 0;
+
+    hdr[0]  = 0;                  // lt_version
+    hdr[1]  = 0;                  // lt_padding
+    hdr[2]  = 0;                  // lt_length (BE)
+    hdr[3]  = LORATAP_LEN;
+    hdr[4]  = s->freq >> 24;      // frequency [Hz] (BE)
+    hdr[5]  = s->freq >> 16;
+    hdr[6]  = s->freq >> 8;
+    hdr[7]  = s->freq;
+    hdr[8]  = bw[getBw(s->rps)];  // bandwidth [125kHz]
+    hdr[9]  = getSf(s->rps) == FSK ? 0 : getSf(s->rps) + 6;
+    hdr[10] = rssi < 0 ? 0 : rssi > 255 ? 255 : rssi; // packet rssi (dBm+139)
+    hdr[11] = 255;                // max rssi (unknown)
+    hdr[12] = 255;                // current rssi (unknown)
+    hdr[13] = s->snr;             // SNR [dB] * 4
+    hdr[14] = 0x34;               // sync word (public network)
+
+    // enhanced packet block with epb_flags (direction)
+    put4(0x00000006);
+    put4(32 + caplen + pad + 12);
+    put4(0);                      // interface id
+    put4((u4_t)(us >> 32));
+    put4((u4_t)us);
+    put4(caplen);
+    put4(caplen);
+    fwrite(hdr, LORATAP_LEN, 1, capfile);
+    fwrite(s->data, s->len, 1, capfile);
+    fwrite(&zero, pad, 1, capfile);
+    put4(0x00040002);             // epb_flags, length 4
+    put4(s->dir);
+    put4(0);                      // opt_endofopt
+    put4(32 + caplen + pad + 12);
+}
+
+static void* writerLoop (void* arg) {
+    u4_t epoch = 0;
+    ostime_t last = 0;
+    struct timespec poll = { 0, CAP_POLL_MS * 1000000L };
+
+    for(;;) {
+        int stop = !running;
+        int n = 0;
+        struct capslot_t* s;
+        while( __atomic_load_n(&(s = &ring[tail % CAP_SLOTS])->ready, __ATOMIC_ACQUIRE) ) {
+            // extend 32-bit ticks to a monotonic 64-bit timestamp
+            if( (u4_t)s->time < (u4_t)last )
+                epoch++;
+            last = s->time;
+            u8_t ticks = ((u8_t)epoch << 32) | (u4_t)s->time;
+            writeFrame(s, ticks * 1000000 / OSTICKS_PER_SEC);
+            __atomic_store_n(&s->ready, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&tail, tail + 1, __ATOMIC_RELEASE);
+            n++;
+        }
+        if( n )
+            fflush(capfile);
+        if( stop )
+            return NULL;
+        nanosleep(&poll, NULL);
+    }
+}
+
+int cap_open (const char* path) {
+    if( capfile != NULL )
+        return -1;
+    if( (capfile = fopen(path, "wb")) == NULL )
+        return -1;
+    writeHeader();
+    head = tail = dropped = 0;
+    running = 1;
+    if( pthread_create(&writer, NULL, writerLoop, NULL) != 0 ) {
+        fclose(capfile);
+        capfile = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void cap_close (void) {
+    if( capfile == NULL )
+        return;
+    running = 0;
+    pthread_join(writer, NULL);
+    fclose(capfile);
+    capfile = NULL;
+}
+
+void cap_frame (u1_t dir, ostime_t time) {
+    if( capfile == NULL )
+        return;
+    // reserve a slot; TX and RX may come from different threads
+    u4_t h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    do {
+        if( h - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) >= CAP_SLOTS ) {
+            __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    } while( !__atomic_compare_exchange_n(&head, &h, h + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) );
+
+    struct capslot_t* s = &ring[h % CAP_SLOTS];
+    u1_t len = LMIC.dataLen > MAX_LEN_FRAME ? MAX_LEN_FRAME : LMIC.dataLen;
+    s->dir  = dir;
+    s->len  = len;
+    // LMIC.rssi/snr are from the last RX, TX records leave them zero
+    s->rssi = dir == CAP_RX ? LMIC.rssi - RSSI_OFF : 0;
+    s->snr  = dir == CAP_RX ? LMIC.snr : 0;
+    s->rps  = LMIC.rps;
+    s->freq = LMIC.freq;
+    s->time = time;
+    os_copyMem(s->data, LMIC.frame, len);
+    __atomic_store_n(&s->ready, 1, __ATOMIC_RELEASE);
+}
+
+u4_t cap_dropped (void) {
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+#endif // CFG_capture
@@ -0,0 +1,36 @@
+/*******************************************************************************
+ * pcapng capture of radio frames (enabled with CFG_capture in config.h).
+ *
+ * Frames are copied into a pre-allocated ring from the radio path and written
+ * with a LoRaTap header (LINKTYPE_LORATAP) by a background thread, so the
+ * radio path never blocks on file I/O. Frames are dropped when the ring is
+ * full.
+ *******************************************************************************/
+
+#ifndef _capture_h_
+#define _capture_h_
+
+enum { CAP_RX=1, CAP_TX=2 }; // pcapng epb_flags direction
+
+/*
+ * open capture file and start writer thread (0=ok, -1=error).
+ */
+int cap_open (const char* path);
+
+/*
+ * flush pending frames, stop writer thread and close capture file.
+ */
+void cap_close (void);
+
+/*
+ * queue LMIC.frame[0..LMIC.dataLen) with LMIC.freq/rps/rssi/snr.
+ *   - called from the radio path, never blocks
+ */
+void cap_frame (u1_t dir, ostime_t time);
+
+/*
+ * number of frames dropped because the ring was full.
+ */
+u4_t cap_dropped (void);
+
+#endif // _capture_h_
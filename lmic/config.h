@@ -7,6 +7,40 @@
 #define CFG_us915 1
 
 #define US_PER_OSTICK 50
+
+// 64-bit ostime_t: no wrap after 2^32 ticks, division-free tick conversions
+//#define CFG_ostime64 1
+
+// read ticks from the CPU counter (ARM CNTVCT / x86 TSC) instead of
+// clock_gettime(), calibrated against CLOCK_MONOTONIC (see tick.h)
+//#define CFG_fastticks 1
+
+// drive several radios from one process, one LMIC instance per thread (see radios.h)
+//#define CFG_multiradio 1
+
+// radio energy accounting per state/TX power, LMIC_uplinkEnergy() (see energy.h)
+//#define CFG_energy 1
+
+// os_getRndU1/U2 from a ChaCha20 pool keyed by getrandom() instead of AES
+// over the radio's RSSI seed (see rng.h)
+//#define CFG_rngpool 1
+
+// reassembly of fragmented data blocks on FRAG_PORT with parity recovery (see frag.h)
+//#define CFG_frag 1
+
+// class A RX windows placed and sized from learned TXDONE/wake-up/downlink timing (LMIC_setRxCal)
+//#define CFG_rxcal 1
+
+// pcapng capture of TX/RX frames via cap_open() (needs -lpthread)
+//#define CFG_capture 1
+
+// LMIC calls from other threads applied by os_runloop_once() (see mbox.h)
+//#define CFG_mbox 1
+
+// log all HAL interactions via hal_record() (see halrec.h)
+//#define CFG_halrec 1
+// replay such a log instead of driving the radio (workstation builds)
+//#define CFG_halreplay 1
 //#define  OSTICKS_PER_SEC 20000
 
 #endif
@@ -0,0 +1,89 @@
+/*******************************************************************************
+ * Radio energy accounting: time per radio state weighted with a current table.
+ *******************************************************************************/
+
+#include "lmic.h"
+
+#if defined(CFG_energy)
+
+#include "energy.h"
+
+const struct radiocurrent_t SX1272_CURRENT = {
+    3300, 100, 1400000, 11200000,
+    // +2..+20 dBm on PA_BOOST
+    {  22000000,  23000000,  24000000,  25000000,  26000000,  28000000,  30000000,
+       32000000,  35000000,  38000000,  42000000,  46000000,  52000000,  60000000,
+       72000000,  90000000, 100000000, 110000000, 125000000 }
+};
+
+const struct radiocurrent_t SX1276_CURRENT = {
+    3300, 200, 1600000, 10800000,
+    // +2..+20 dBm on PA_BOOST
+    {  24000000,  25000000,  26000000,  27000000,  28000000,  30000000,  32000000,
+       34000000,  37000000,  40000000,  44000000,  48000000,  53000000,  60000000,
+       70000000,  87000000,  95000000, 105000000, 120000000 }
+};
+
+static OS_TLS struct {
+    u1_t      started;
+    u1_t      state;
+    s1_t      txpow;   // output power of the current/next TX
+    osticks_t since;   // start of the current state
+    const struct radiocurrent_t* cur;
+    struct energystat_t st;
+} en = { 0, RSTATE_SLEEP, TXPOW_MIN };
+
+// add the time since the last change to the current state
+static void account (struct energystat_t* st, osticks_t now) {
+    osticks_t d = now - en.since;
+    st->ticks[en.state] += d;
+    if( en.state == RSTATE_TX )
+        st->txticks[en.txpow-TXPOW_MIN] += d;
+}
+
+void energy_state (u1_t state) {
+    if( en.started && state == en.state )
+        return;
+    osticks_t now = os_getTime();
+    if( en.started )
+        account(&en.st, now);
+    en.started = 1;
+    en.state = state;
+    en.since = now;
+}
+
+void energy_txpow (s1_t dbm) {
+    en.txpow = dbm < TXPOW_MIN ? TXPOW_MIN : dbm > TXPOW_MAX ? TXPOW_MAX : dbm;
+}
+
+void energy_uplink (void) {
+    en.st.uplinks++;
+}
+
+void energy_setCurrent (const struct radiocurrent_t* cur) {
+    en.cur = cur;
+}
+
+// nJ = ticks * nA / OSTICKS_PER_SEC * mV / 1000
+static u8_t nanojoule (u8_t ticks, u4_t nA, u2_t mV) {
+    return ticks * nA / OSTICKS_PER_SEC * mV / 1000;
+}
+
+void energy_stats (struct energystat_t* st) {
+#if defined(CFG_sx1276_radio)
+    const struct radiocurrent_t* cur = en.cur ? en.cur : &SX1276_CURRENT;
+#else
+    const struct radiocurrent_t* cur = en.cur ? en.cur : &SX1272_CURRENT;
+#endif
+    *st = en.st;
+    if( en.started )
+        account(st, os_getTime());
+    st->nJ[RSTATE_SLEEP]   = nanojoule(st->ticks[RSTATE_SLEEP],   cur->sleep_nA,   cur->supply_mV);
+    st->nJ[RSTATE_STANDBY] = nanojoule(st->ticks[RSTATE_STANDBY], cur->standby_nA, cur->supply_mV);
+    st->nJ[RSTATE_RX]      = nanojoule(st->ticks[RSTATE_RX],      cur->rx_nA,      cur->supply_mV);
+    st->nJ[RSTATE_TX]      = 0;
+    for( u1_t i = 0; i <= TXPOW_MAX-TXPOW_MIN; i++ )
+        st->nJ[RSTATE_TX] += nanojoule(st->txticks[i], cur->tx_nA[i], cur->supply_mV);
+}
+
+#endif // CFG_energy
@@ -0,0 +1,52 @@
+/*******************************************************************************
+ * Radio energy accounting (enabled with CFG_energy in config.h).
+ *
+ * radio.c reports every change of the SX127x operating mode. The time spent in
+ * SLEEP, STANDBY, TX (per output power) and RX is summed from hal_ticks() and
+ * weighted with a current table to get the energy the radio drew. Only the
+ * radio is accounted, not the host. With CFG_multiradio each radio thread
+ * keeps its own account.
+ *******************************************************************************/
+
+#ifndef _energy_h_
+#define _energy_h_
+
+enum { RSTATE_SLEEP, RSTATE_STANDBY, RSTATE_TX, RSTATE_RX, RSTATE_MAX };
+enum { TXPOW_MIN = 2, TXPOW_MAX = 20 };  // dBm range of radiocurrent_t.tx_nA
+
+struct radiocurrent_t {
+    u2_t supply_mV;
+    u4_t sleep_nA;
+    u4_t standby_nA;  // also FSTX/FSRX
+    u4_t rx_nA;
+    u4_t tx_nA[TXPOW_MAX-TXPOW_MIN+1];  // by output power in dBm
+};
+
+// typical datasheet values at 3.3V (TX below +17dBm read off the PA_BOOST curves)
+extern const struct radiocurrent_t SX1272_CURRENT;
+extern const struct radiocurrent_t SX1276_CURRENT;
+
+struct energystat_t {
+    u8_t ticks[RSTATE_MAX];                 // time spent per state
+    u8_t txticks[TXPOW_MAX-TXPOW_MIN+1];    // TX time by output power
+    u8_t nJ[RSTATE_MAX];                    // energy drawn per state
+    u4_t uplinks;                           // completed uplinks (EV_TXCOMPLETE)
+};
+
+/*
+ * select the current table (NULL=default for the configured radio).
+ *   - takes effect for the whole account, including time already spent
+ */
+void energy_setCurrent (const struct radiocurrent_t* cur);
+
+/*
+ * account since the first mode change, up to now.
+ */
+void energy_stats (struct energystat_t* st);
+
+// called by radio.c and lmic.c
+void energy_state (u1_t state);
+void energy_txpow (s1_t dbm);
+void energy_uplink (void);
+
+#endif // _energy_h_
@@ -0,0 +1,242 @@
+/*******************************************************************************
+ * Fragmented data block reassembly with parity recovery.
+ *
+ * Every parity row held is pivoted on its lowest unknown fragment, no two rows
+ * on the same one. When the number of rows equals the number of unknown
+ * fragments, each of those is a pivot and back substitution (highest first)
+ * rebuilds them in the file.
+ *******************************************************************************/
+
+#include "lmic.h"
+
+#if defined(CFG_frag)
+
+#include "frag.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+static OS_TLS struct {
+    u1_t*  data;      // nbFrag*fragSize bytes, mmap'd
+    int    fd;
+    u1_t   index;
+    u1_t   padding;
+    u2_t   maxRows;
+    u2_t   mapBytes;  // bytes per fragment bitmap
+    u2_t*  pivot;     // fragment -> 1+row pivoted on it (0=none)
+    u2_t*  rowPivot;  // row -> 1+fragment it is pivoted on (0=free)
+    u1_t*  known;     // bitmap of fragments in the file
+    u1_t*  rows;      // maxRows+1 rows of bitmap+data, the last one is scratch
+    struct fragstat_t st;
+} fr = { NULL, -1 };
+
+#define KNOWN(j)    ((fr.known[(j)>>3] >> ((j)&7)) & 1)
+#define FRAG(j)     (fr.data + (u4_t)(j)*fr.st.fragSize)
+#define ROWMAP(r)   (fr.rows + (u4_t)(r)*(fr.mapBytes+fr.st.fragSize))
+#define ROWDATA(r)  (ROWMAP(r) + fr.mapBytes)
+
+static void xorMem (u1_t* dst, const u1_t* src, u2_t len) {
+    for( u2_t i = 0; i < len; i++ )
+        dst[i] ^= src[i];
+}
+
+static u4_t prbs23 (u4_t x) {
+    return (x >> 1) + (((x ^ (x >> 5)) & 1) << 22);
+}
+
+// fragments XORed into parity fragment nbFrag+n
+static void matrixLine (u2_t n, u1_t* map) {
+    u2_t m = fr.st.nbFrag;
+    u2_t pow2 = (m & (m-1)) == 0 ? 1 : 0;
+    u4_t x = 1 + 1001*(u4_t)n;
+    os_clearMem(map, fr.mapBytes);
+    for( u2_t c = 0; c < m/2; c++ ) {
+        u4_t r;
+        do {
+            x = prbs23(x);
+            r = x % (m + pow2);
+        } while( r >= m );
+        map[r>>3] |= 1 << (r&7);
+    }
+}
+
+// eliminate known fragments and held rows, 1+lowest unknown fragment left (0=none)
+static u2_t reduce (u1_t* map, u1_t* data) {
+    for( u2_t w = 0; w < fr.mapBytes; w++ ) {
+        while( map[w] ) {
+            u2_t j = w*8 + __builtin_ctz(map[w]);
+            if( KNOWN(j) ) {
+                xorMem(data, FRAG(j), fr.st.fragSize);
+                map[w] &= ~(1 << (j&7));
+                continue;
+            }
+            u2_t r = fr.pivot[j];
+            if( r == 0 )
+                return j+1;
+            // bits of a row below its pivot are clear
+            xorMem(map+w, ROWMAP(r-1)+w, fr.mapBytes-w);
+            xorMem(data, ROWDATA(r-1), fr.st.fragSize);
+        }
+    }
+    return 0;
+}
+
+static u1_t store (u2_t j, const u1_t* row) {
+    for( u2_t r = 0; r < fr.maxRows; r++ ) {
+        if( fr.rowPivot[r] != 0 )
+            continue;
+        os_copyMem(ROWMAP(r), row, fr.mapBytes+fr.st.fragSize);
+        fr.rowPivot[r] = j+1;
+        fr.pivot[j] = r+1;
+        fr.st.rows++;
+        return FRAG_STORED;
+    }
+    return FRAG_NOROWS;
+}
+
+static void release (u2_t r) {
+    fr.pivot[fr.rowPivot[r]-1] = 0;
+    fr.rowPivot[r] = 0;
+    fr.st.rows--;
+}
+
+static void setKnown (u2_t j) {
+    fr.known[j>>3] |= 1 << (j&7);
+    fr.st.missing--;
+}
+
+// back substitution once every unknown fragment is a pivot
+static void solve (void) {
+    for( s4_t j = fr.st.nbFrag-1; j >= 0; j-- ) {
+        if( KNOWN(j) )
+            continue;
+        u2_t r = fr.pivot[j]-1;
+        u1_t* map = ROWMAP(r);
+        u1_t* out = FRAG(j);
+        os_copyMem(out, ROWDATA(r), fr.st.fragSize);
+        for( u2_t k = j+1; k < fr.st.nbFrag; k++ ) {
+            if( (map[k>>3] >> (k&7)) & 1 )
+                xorMem(out, FRAG(k), fr.st.fragSize);
+        }
+        release(r);
+        setKnown(j);
+        fr.st.recovered++;
+    }
+}
+
+static u1_t uncoded (u2_t j, xref2cu1_t buf) {
+    if( KNOWN(j) )
+        return FRAG_IGNORED;
+    os_copyMem(FRAG(j), buf, fr.st.fragSize);
+    setKnown(j);
+    fr.st.received++;
+    if( fr.pivot[j] != 0 ) {
+        // row lost its pivot: reduce it again
+        u2_t r = fr.pivot[j]-1;
+        u1_t* tmp = ROWMAP(fr.maxRows);
+        os_copyMem(tmp, ROWMAP(r), fr.mapBytes+fr.st.fragSize);
+        release(r);
+        u2_t p = reduce(tmp, tmp+fr.mapBytes);
+        if( p != 0 )
+            store(p-1, tmp);
+    }
+    return FRAG_STORED;
+}
+
+static u1_t coded (u2_t n, xref2cu1_t buf) {
+    u1_t* tmp = ROWMAP(fr.maxRows);
+    fr.st.coded++;
+    matrixLine(n, tmp);
+    os_copyMem(tmp+fr.mapBytes, buf, fr.st.fragSize);
+    u2_t p = reduce(tmp, tmp+fr.mapBytes);
+    return p == 0 ? FRAG_IGNORED : store(p-1, tmp);
+}
+
+int frag_open (const char* path, u1_t index, u2_t nbFrag, u1_t fragSize, u1_t padding, u2_t maxRows) {
+    frag_close();
+    if( nbFrag == 0 || nbFrag > FRAG_MAX_NB || fragSize == 0 || padding >= fragSize || index > 3 )
+        return -1;
+    size_t len = (size_t)nbFrag*fragSize;
+    if( path ) {
+        fr.fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0644);
+        if( fr.fd < 0 )
+            return -1;
+        if( ftruncate(fr.fd, len) < 0 ) {
+            frag_close();
+            return -1;
+        }
+        fr.data = (u1_t*)mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fr.fd, 0);
+    } else {
+        fr.fd = -1;
+        fr.data = (u1_t*)mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    }
+    if( fr.data == MAP_FAILED ) {
+        fr.data = NULL;
+        frag_close();
+        return -1;
+    }
+    fr.index = index;
+    fr.padding = padding;
+    fr.maxRows = maxRows;
+    fr.mapBytes = (nbFrag+7)/8;
+    fr.st.nbFrag = nbFrag;
+    fr.st.fragSize = fragSize;
+    fr.st.missing = nbFrag;
+    fr.st.heap = (nbFrag + maxRows)*sizeof(u2_t) + fr.mapBytes
+        + (u4_t)(maxRows+1)*(fr.mapBytes+fragSize);
+    u1_t* mem = (u1_t*)calloc(1, fr.st.heap);
+    if( mem == NULL ) {
+        frag_close();
+        return -1;
+    }
+    fr.pivot    = (u2_t*)mem;
+    fr.rowPivot = fr.pivot + nbFrag;
+    fr.known    = (u1_t*)(fr.rowPivot + maxRows);
+    fr.rows     = fr.known + fr.mapBytes;
+    return 0;
+}
+
+void frag_close (void) {
+    size_t len = (size_t)fr.st.nbFrag*fr.st.fragSize;
+    if( fr.data )
+        munmap(fr.data, len);
+    if( fr.fd >= 0 ) {
+        if( fr.data && fr.st.missing == 0 && ftruncate(fr.fd, len - fr.padding) < 0 )
+            perror("frag_close");
+        close(fr.fd);
+    }
+    free(fr.pivot);
+    os_clearMem((xref2u1_t)&fr, sizeof(fr));
+    fr.fd = -1;
+}
+
+u1_t frag_rx (xref2cu1_t buf, u1_t len) {
+    if( fr.data == NULL || fr.st.missing == 0 || len != 3+fr.st.fragSize || buf[0] != FRAG_DATA_FRAGMENT )
+        return FRAG_IGNORED;
+    u2_t in = buf[1] | (buf[2] << 8);  // FragIndex:2, N:14
+    u2_t n = in & FRAG_MAX_NB;
+    if( (in >> 14) != fr.index || n == 0 )
+        return FRAG_IGNORED;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    u1_t res = n <= fr.st.nbFrag ? uncoded(n-1, buf+3) : coded(n-fr.st.nbFrag, buf+3);
+    if( fr.st.missing != 0 && fr.st.missing == fr.st.rows )
+        solve();
+    if( fr.st.missing == 0 )
+        res = FRAG_DONE;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    fr.st.ns += (u8_t)(t1.tv_sec - t0.tv_sec)*1000000000 + t1.tv_nsec - t0.tv_nsec;
+    return res;
+}
+
+xref2cu1_t frag_data (void) {
+    return fr.data && fr.st.missing == 0 ? fr.data : NULL;
+}
+
+void frag_stats (struct fragstat_t* st) {
+    *st = fr.st;
+}
+
+#endif // CFG_frag
@@ -0,0 +1,70 @@
+/*******************************************************************************
+ * Fragmented data block reassembly (enabled with CFG_frag in config.h).
+ *
+ * Large blocks (firmware images, configuration) are sent as DataFragment
+ * commands on FRAG_PORT, usually to a multicast group, with the layout of the
+ * LoRaWAN fragmented data block transport: N=1..nbFrag are the uncoded
+ * fragments, N>nbFrag are parity fragments, each the XOR of the uncoded
+ * fragments selected by the pseudo-random matrix line for N-nbFrag.
+ *
+ * Uncoded fragments go straight into an mmap'd file and are tracked in a
+ * bitmap. Parity fragments are reduced on arrival (Gaussian elimination over
+ * GF(2)) against the fragments already known and the parity rows already
+ * held, so a lost fragment is rebuilt as soon as enough independent parity
+ * has arrived, without retransmission. decodeFrame() hands every frame on
+ * FRAG_PORT to frag_rx() while a session is open.
+ *******************************************************************************/
+
+#ifndef _frag_h_
+#define _frag_h_
+
+enum { FRAG_PORT = 201 };                // application port of the fragmentation package
+enum { FRAG_DATA_FRAGMENT = 0x08 };      // DataFragment command: cmd, u2 index|N, data
+enum { FRAG_MAX_NB = 0x3FFF };           // N is 14 bits
+
+// frag_rx() results
+enum { FRAG_IGNORED,    // not a DataFragment of the open session, or duplicate
+       FRAG_STORED,     // fragment or parity row kept
+       FRAG_DONE,       // all fragments known, file complete
+       FRAG_NOROWS };   // parity dropped, all maxRows rows in use
+
+struct fragstat_t {
+    u2_t nbFrag;
+    u1_t fragSize;
+    u2_t received;   // uncoded fragments received
+    u2_t coded;      // parity fragments received
+    u2_t recovered;  // fragments rebuilt from parity
+    u2_t missing;    // fragments still unknown
+    u2_t rows;       // parity rows held for recovery
+    u4_t heap;       // bytes allocated for bitmaps and rows (file mapping not included)
+    u8_t ns;         // time spent in frag_rx()
+};
+
+/*
+ * open a reassembly session (0=ok, -1=error).
+ *   - path: file of nbFrag*fragSize bytes the block is written to (NULL=anonymous memory)
+ *   - index: FragIndex (0..3) the fragments are tagged with
+ *   - padding: bytes of the last fragment cut off on close
+ *   - maxRows: parity rows kept for recovery (enough for maxRows lost fragments),
+ *     each takes (nbFrag+7)/8+fragSize bytes of heap
+ */
+int frag_open (const char* path, u1_t index, u2_t nbFrag, u1_t fragSize, u1_t padding, u2_t maxRows);
+
+/*
+ * unmap and close the file (truncated to the block length if complete).
+ */
+void frag_close (void);
+
+/*
+ * process the payload of a frame on FRAG_PORT.
+ */
+u1_t frag_rx (xref2cu1_t buf, u1_t len);
+
+/*
+ * reassembled block (valid after FRAG_DONE until frag_close()).
+ */
+xref2cu1_t frag_data (void);
+
+void frag_stats (struct fragstat_t* st);
+
+#endif // _frag_h_
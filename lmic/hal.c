@@ -1,53 +1,82 @@
 #include "config.h"
+
+#if !defined(CFG_halreplay) // halrec.c provides the HAL when replaying
+
 #include "oslmic.h"
 #include "hal.h"
 #include "local_hal.h"
 #include <wiringPi.h>
-#include <wiringPiSPI.h>
 #include <stdio.h>
 #include <time.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+
+#if defined(CFG_fastticks)
+#include "tick.h"
+#endif
+#if defined(CFG_halrec)
+#include "halrec.h"
+#define HREC(x) x
+#else
+#define HREC(x)
+#endif
 
 
 int fd;
 
+#if defined(CFG_multiradio)
+#include <pthread.h>
+#if defined(CFG_halrec)
+#error CFG_halrec records a single radio only
+#endif
+#define PINS (*radio_pins)
+// radios share the SPI bus: hold it from NSS low to NSS high
+static pthread_mutex_t busLock = PTHREAD_MUTEX_INITIALIZER;
+static OS_TLS u1_t busHeld;
+#else
+#define PINS pins
+#endif
+
 // -----------------------------------------------------------------------------
 // I/O
 
 static void hal_io_init () {
     wiringPiSetup();
-    pinMode(pins.nss, OUTPUT);
-    pinMode(pins.rxtx, OUTPUT);
-    pinMode(pins.rst, OUTPUT);
-    pinMode(pins.dio[0], INPUT);
-    pinMode(pins.dio[1], INPUT);
-    pinMode(pins.dio[2], INPUT);
+    pinMode(PINS.nss, OUTPUT);
+    pinMode(PINS.rxtx, OUTPUT);
+    pinMode(PINS.rst, OUTPUT);
+    pinMode(PINS.dio[0], INPUT);
+    pinMode(PINS.dio[1], INPUT);
+    pinMode(PINS.dio[2], INPUT);
 }
 
 // val == 1  => tx 1
 void hal_pin_rxtx (u1_t val) {
-    digitalWrite(pins.rxtx, val);
+    digitalWrite(PINS.rxtx, val);
 }
 
 // set radio RST pin to given value (or keep floating!)
 void hal_pin_rst (u1_t val) {
     if(val == 0 || val == 1) { // drive pin
-        pinMode(pins.rst, OUTPUT);
-        digitalWrite(pins.rst, val);
+        pinMode(PINS.rst, OUTPUT);
+        digitalWrite(PINS.rst, val);
 //        digitalWrite(0, val==0?LOW:HIGH);
     } else { // keep pin floating
-        pinMode(pins.rst, INPUT);
+        pinMode(PINS.rst, INPUT);
     }
 }
 
-static bool dio_states[NUM_DIO] = {0};
+static OS_TLS bool dio_states[NUM_DIO] = {0};
 
 static void hal_io_check() {
     u1_t i;
     for (i = 0; i < NUM_DIO; ++i) {
-        if (dio_states[i] != digitalRead(pins.dio[i])) {
+        if (dio_states[i] != digitalRead(PINS.dio[i])) {
             dio_states[i] = !dio_states[i];
             if (dio_states[i]) {
+                HREC(hrec_dio(i));
                 radio_irq_handler(i);
             }
         }
@@ -55,60 +84,182 @@ static void hal_io_check() {
 }
 
 // -----------------------------------------------------------------------------
-// SPI
+// SPI (spidev)
 //
-static int spifd;
+// NSS is a GPIO driven from here (pins.nss), or with pins.nss == UNUSED_PIN the
+// controller's own chip select CE0/CE1 (pins.spi). Only in the latter case can
+// a whole command list go to the kernel as one SPI_IOC_MESSAGE, the controller
+// toggles the chip select between the transfers.
+
+enum { SPI_SPEED = 10000000, SPI_MAX_XFERS = 64 };
+static OS_TLS int spifd = -1;
 
 static void hal_spi_init () {
-    spifd = wiringPiSPISetup(0, 10000000);
+    char dev[32];
+    u1_t mode = SPI_MODE_0, bits = 8;
+    u4_t speed = SPI_SPEED;
+    snprintf(dev, sizeof(dev), "/dev/spidev0.%d", PINS.spi);
+    spifd = open(dev, O_RDWR);
+    if( spifd < 0 || ioctl(spifd, SPI_IOC_WR_MODE, &mode) < 0
+        || ioctl(spifd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0
+        || ioctl(spifd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0 ) {
+        fprintf(stderr, "Unable to open %s: %s\n", dev, strerror(errno));
+        hal_failed(__FILE__, __LINE__);
+    }
+}
+
+static void nssLow () {
+#if defined(CFG_multiradio)
+    if( !busHeld ) {
+        pthread_mutex_lock(&busLock);
+        busHeld = 1;
+    }
+#endif
+    if( PINS.nss != UNUSED_PIN )
+        digitalWrite(PINS.nss, 0);
+}
+
+static void nssHigh () {
+    if( PINS.nss != UNUSED_PIN )
+        digitalWrite(PINS.nss, 1);
+#if defined(CFG_multiradio)
+    if( busHeld ) {
+        busHeld = 0;
+        pthread_mutex_unlock(&busLock);
+    }
+#endif
+}
+
+static void spiMessage (struct spi_ioc_transfer* tr, int n) {
+    for( int i = 0; i < n; i++ ) {
+        tr[i].speed_hz = SPI_SPEED;
+        tr[i].bits_per_word = 8;
+    }
+    if( ioctl(spifd, SPI_IOC_MESSAGE(n), tr) < 0 ) {
+        fprintf(stderr, "SPI transfer failed: %s\n", strerror(errno));
+        hal_failed(__FILE__, __LINE__);
+    }
 }
 
 void hal_pin_nss (u1_t val) {
-    digitalWrite(pins.nss, val);
+    HREC(hrec_nss(val));
+    if( val == 0 ) {
+        nssLow();
+    } else {
+        if( PINS.nss == UNUSED_PIN ) { // end of a hal_spi() sequence: release CE
+            struct spi_ioc_transfer tr;
+            memset(&tr, 0, sizeof(tr));
+            spiMessage(&tr, 1);
+        }
+        nssHigh();
+    }
 }
 
 // perform SPI transaction with radio
 u1_t hal_spi (u1_t out) {
-    u1_t res = wiringPiSPIDataRW(0, &out, 1);
+    HREC(u1_t in = out);
+    struct spi_ioc_transfer tr;
+    memset(&tr, 0, sizeof(tr));
+    tr.tx_buf = tr.rx_buf = (unsigned long)&out;
+    tr.len = 1;
+    tr.cs_change = PINS.nss == UNUSED_PIN; // keep CE asserted until hal_pin_nss(1)
+    spiMessage(&tr, 1);
+    HREC(hrec_spi(in, out));
     return out;
 }
 
+void hal_spi_xfer (u1_t* buf, u2_t len) {
+    u1_t in[len];
+    struct spi_ioc_transfer tr;
+    memset(&tr, 0, sizeof(tr));
+    tr.tx_buf = (unsigned long)buf;
+    tr.rx_buf = (unsigned long)in;
+    tr.len = len;
+    HREC(hrec_nss(0));
+    nssLow();
+    spiMessage(&tr, 1);
+    nssHigh();
+    HREC(for( u2_t i = 0; i < len; i++ ) hrec_spi(buf[i], in[i]));
+    HREC(hrec_nss(1));
+    memcpy(buf, in, len);
+}
+
+void hal_spi_batch (const u1_t* buf, const u1_t* seglen, u1_t nseg) {
+    struct spi_ioc_transfer tr[SPI_MAX_XFERS];
+    const u1_t* p = buf;
+    for( u1_t i = 0; i < nseg; ) {
+        // GPIO NSS: one transfer per message, CE: up to SPI_MAX_XFERS
+        u1_t n = PINS.nss != UNUSED_PIN ? 1 : nseg-i < SPI_MAX_XFERS ? nseg-i : SPI_MAX_XFERS;
+        memset(tr, 0, n*sizeof(tr[0]));
+        for( u1_t k = 0; k < n; k++ ) {
+            tr[k].tx_buf = (unsigned long)p;
+            tr[k].len = seglen[i+k];
+            tr[k].cs_change = k < n-1; // deselect between transfers
+            HREC(hrec_nss(0));
+            HREC(for( u1_t b = 0; b < seglen[i+k]; b++ ) hrec_spi(p[b], 0));
+            HREC(hrec_nss(1));
+            p += seglen[i+k];
+        }
+        nssLow();
+        spiMessage(tr, n);
+        nssHigh();
+        i += n;
+    }
+}
+
 
 // -----------------------------------------------------------------------------
 // TIME
 
+#if defined(CFG_fastticks)
+
+static void hal_time_init () {
+    tick_init();
+}
+
+osticks_t hal_ticks (void) {
+    osticks_t ticks = tick_now();
+    HREC(hrec_ticks(ticks));
+    return ticks;
+}
+
+#else
+
 struct timespec tstart={0,0};
 static void hal_time_init () {
     int res=clock_gettime(CLOCK_MONOTONIC_RAW, &tstart);
     tstart.tv_nsec=0; //Makes difference calculations in hal_ticks() easier
 }
 
-u4_t hal_ticks (void) {
+osticks_t hal_ticks (void) {
     // LMIC requires ticks to be 15.5μs - 100 μs long
     struct timespec ts;
     clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
     ts.tv_sec-=tstart.tv_sec;
     u8_t ticks=ts.tv_sec*(1000000/US_PER_OSTICK)+ts.tv_nsec/(1000*US_PER_OSTICK);
 //    fprintf(stderr, "%d hal_ticks()=%d\n", sizeof(time_t), ticks);
-    return (u4_t)ticks;
+    HREC(hrec_ticks((osticks_t)ticks));
+    return (osticks_t)ticks;
 }
 
+#endif
+
 // Returns the number of ticks until time.
-static u4_t delta_time(u4_t time) {
-      u4_t t = hal_ticks( );
-      s4_t d = time - t;
+static osticks_t delta_time(osticks_t time) {
+      osticks_t t = hal_ticks( );
+      ostime_t d = os_timeDiff(time, t);
       //fprintf(stderr, "deltatime(%d)=%d (%d)\n", time, d, t);
       if (d<=5) { return 0; }
       else {
-        return (u4_t)d;
+        return (osticks_t)d;
       }
 }
 
-void hal_waitUntil (u4_t time) {
-    u4_t now=hal_ticks();
-    u4_t delta = delta_time(time);
+void hal_waitUntil (osticks_t time) {
+    osticks_t now=hal_ticks();
+    osticks_t delta = delta_time(time);
     //fprintf(stderr, "waitUntil(%d) delta=%d\n", time, delta);
-    s4_t t=time-now;
+    ostime_t t=os_timeDiff(time, now);
     if (delta==0) return;
     if (t>0) { 
       //fprintf(stderr, "delay(%d)\n", t*US_PER_OSTICK/1000);
@@ -118,17 +269,18 @@ void hal_waitUntil (u4_t time) {
 }
 
 // check and rewind for target time
-u1_t hal_checkTimer (u4_t time) {
+u1_t hal_checkTimer (osticks_t time) {
     // No need to schedule wakeup, since we're not sleeping
 //    fprintf(stderr, "hal_checkTimer(%d):%d (%d)\n", time,  delta_time(time), hal_ticks());
     return delta_time(time) <= 0;
 }
 
-static u8_t irqlevel = 0;
+static OS_TLS u8_t irqlevel = 0;
 
 void IRQ0(void) {
 //  fprintf(stderr, "IRQ0 %d\n", irqlevel);
   if (irqlevel==0) {
+    HREC(hrec_dio(0));
     radio_irq_handler(0);
     return;
   }
@@ -136,12 +288,14 @@ void IRQ0(void) {
 
 void IRQ1(void) {
   if (irqlevel==0){
+    HREC(hrec_dio(1));
     radio_irq_handler(1);
   }
 }
 
 void IRQ2(void) {
   if (irqlevel==0){
+    HREC(hrec_dio(2));
     radio_irq_handler(2);
   }
 }
@@ -187,10 +341,13 @@ void hal_init() {
     hal_spi_init();
     // configure timer and interrupt handler
     hal_time_init();
-    wiringPiISR(pins.dio[0], INT_EDGE_RISING, IRQ0);
-    wiringPiISR(pins.dio[1], INT_EDGE_RISING, IRQ1);
-    wiringPiISR(pins.dio[2], INT_EDGE_RISING, IRQ2);
+#if !defined(CFG_multiradio) // ISR threads cannot reach the per-radio state, rely on polling
+    wiringPiISR(PINS.dio[0], INT_EDGE_RISING, IRQ0);
+    wiringPiISR(PINS.dio[1], INT_EDGE_RISING, IRQ1);
+    wiringPiISR(PINS.dio[2], INT_EDGE_RISING, IRQ2);
+#endif
 
   
 }
 
+#endif // !CFG_halreplay
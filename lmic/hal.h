@@ -32,6 +32,18 @@ void hal_pin_rxtx (u1_t val);
  */
 void hal_pin_rst (u1_t val);
 
+/*
+ * perform one full-duplex SPI transaction of len bytes framed by NSS
+ *   - buf is sent and overwritten with the bytes received
+ */
+void hal_spi_xfer (u1_t* buf, u2_t len);
+
+/*
+ * perform nseg write transactions, each framed by NSS, in one submission
+ *   - segment i is the next seglen[i] bytes of buf
+ */
+void hal_spi_batch (const u1_t* buf, const u1_t* seglen, u1_t nseg);
+
 /*
  * perform 8-bit SPI transaction with radio.
  *   - write given byte 'outval'
@@ -57,21 +69,21 @@ void hal_enableIRQs (void);
 void hal_sleep (void);
 
 /*
- * return 32-bit system time in ticks.
+ * return system time in ticks (32-bit, or 64-bit with CFG_ostime64).
  */
-u4_t hal_ticks (void);
+osticks_t hal_ticks (void);
 
 /*
  * busy-wait until specified timestamp (in ticks) is reached.
  */
-void hal_waitUntil (u4_t time);
+void hal_waitUntil (osticks_t time);
 
 /*
  * check and rewind timer for target time.
  *   - return 1 if target time is close
  *   - otherwise rewind timer for target time or full period and return 0
  */
-u1_t hal_checkTimer (u4_t targettime);
+u1_t hal_checkTimer (osticks_t targettime);
 
 /*
  * perform fatal failure action.
@@ -0,0 +1,291 @@
+/*******************************************************************************
+ * Record/replay of HAL interactions (see halrec.h).
+ *******************************************************************************/
+
+#include "lmic.h"
+#include "hal.h"
+#include "halrec.h"
+
+#if defined(CFG_halrec) || defined(CFG_halreplay)
+
+#include <stdlib.h>
+
+static const u1_t HR_MAGIC[4] = { 'L', 'H', 'R', 0x01 };
+
+#endif
+
+#if defined(CFG_halrec)
+
+// -----------------------------------------------------------------------------
+// RECORD
+
+static FILE* recfile;
+static osticks_t reclast;
+static u4_t  recidle;   // pending HR_TICKS records with delta 0
+static u1_t  recticks;  // last record was HR_TICKS
+
+static int putLeb (u1_t* r, u4_t v) {
+    int n = 0;
+    do {
+        r[n++] = (v & 0x7F) | (v > 0x7F ? 0x80 : 0);
+        v >>= 7;
+    } while( v );
+    return n;
+}
+
+// write record, flushing pending idle ticks first (caller holds the lock)
+static void putRecord (const u1_t* r, int n) {
+    if( recidle ) {
+        u1_t i[6] = { HR_IDLE };
+        fwrite(i, 1 + putLeb(i+1, recidle), 1, recfile);
+        recidle = 0;
+    }
+    if( n )
+        fwrite(r, n, 1, recfile);
+    recticks = 0;
+}
+
+int hal_record (const char* path) {
+    if( recfile != NULL || (recfile = fopen(path, "wb")) == NULL )
+        return -1;
+    setvbuf(recfile, NULL, _IOFBF, 1<<16);
+    u4_t tps = OSTICKS_PER_SEC;
+    fwrite(HR_MAGIC, 4, 1, recfile);
+    fwrite(&tps, 4, 1, recfile);
+    reclast = recidle = recticks = 0;
+    return 0;
+}
+
+void hal_recordClose (void) {
+    if( recfile == NULL )
+        return;
+    flockfile(recfile);
+    putRecord(NULL, 0);
+    funlockfile(recfile);
+    fclose(recfile);
+    recfile = NULL;
+}
+
+// records may come from the main loop and from the wiringPi ISR threads,
+// so each one is written with the stream locked
+void hrec_spi (u1_t out, u1_t in) {
+    if( recfile == NULL )
+        return;
+    u1_t r[3] = { HR_SPI, out, in };
+    flockfile(recfile);
+    putRecord(r, 3);
+    funlockfile(recfile);
+}
+
+void hrec_ticks (osticks_t ticks) {
+    if( recfile == NULL )
+        return;
+    flockfile(recfile);
+    u4_t d = (u4_t)(ticks - reclast);
+    reclast = ticks;
+    if( d == 0 && recticks ) {
+        recidle++;
+    } else {
+        u1_t r[6] = { HR_TICKS };
+        putRecord(r, 1 + putLeb(r+1, d));
+        recticks = 1;
+    }
+    funlockfile(recfile);
+}
+
+void hrec_nss (u1_t val) {
+    if( recfile == NULL )
+        return;
+    u1_t r = val ? HR_NSS1 : HR_NSS0;
+    flockfile(recfile);
+    putRecord(&r, 1);
+    funlockfile(recfile);
+}
+
+void hrec_dio (u1_t dio) {
+    if( recfile == NULL )
+        return;
+    u1_t r = HR_DIO + dio;
+    flockfile(recfile);
+    putRecord(&r, 1);
+    funlockfile(recfile);
+}
+
+#endif // CFG_halrec
+
+#if defined(CFG_halreplay)
+
+// -----------------------------------------------------------------------------
+// REPLAY (replaces hal.c)
+
+static u1_t* rlog;
+static long  loglen;
+static long  logpos;
+static osticks_t ticks;
+static u4_t  idle;      // HR_TICKS records with delta 0 still owed by HR_IDLE
+static u4_t  nrec;
+static u1_t  irqlevel;
+
+int hal_replay (const char* path) {
+    FILE* f = fopen(path, "rb");
+    if( f == NULL )
+        return -1;
+    fseek(f, 0, SEEK_END);
+    loglen = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    rlog = (u1_t*)malloc(loglen);
+    if( rlog == NULL || fread(rlog, 1, loglen, f) != (size_t)loglen || loglen < 8
+        || memcmp(rlog, HR_MAGIC, 4) != 0 || *(u4_t*)(rlog+4) != OSTICKS_PER_SEC ) {
+        fclose(f);
+        free(rlog);
+        rlog = NULL;
+        return -1;
+    }
+    fclose(f);
+    logpos = 8;
+    return 0;
+}
+
+static void replayEnd (void) {
+    fprintf(stderr, "replay complete: %u records, last tick %llu\n", nrec, (u8_t)ticks);
+    exit(0);
+}
+
+static u1_t nextByte (void) {
+    if( logpos >= loglen )
+        replayEnd();
+    return rlog[logpos++];
+}
+
+static u4_t nextLeb (void) {
+    u4_t v = 0;
+    u1_t b, s = 0;
+    do {
+        b = nextByte();
+        v |= (u4_t)(b & 0x7F) << s;
+        s += 7;
+    } while( b & 0x80 );
+    return v;
+}
+
+// run radio_irq_handler() for DIO edges recorded at this point
+static void dispatchIrqs (void) {
+    while( irqlevel == 0 && idle == 0 && logpos < loglen && (rlog[logpos] & ~3) == HR_DIO ) {
+        u1_t dio = rlog[logpos++] - HR_DIO;
+        nrec++;
+        radio_irq_handler(dio);
+    }
+}
+
+static void expect (u1_t tag) {
+    if( idle ) {
+        if( tag == HR_TICKS )
+            return;
+        fprintf(stderr, "replay diverged at offset %ld: expected record %02x, log has idle ticks\n",
+                logpos, tag);
+        hal_failed(__FILE__, __LINE__);
+    }
+    dispatchIrqs();
+    u1_t t = nextByte();
+    nrec++;
+    if( t == HR_IDLE && tag == HR_TICKS ) {
+        idle = nextLeb();
+        return;
+    }
+    if( t != tag ) {
+        fprintf(stderr, "replay diverged at offset %ld: expected record %02x, rlog has %02x\n",
+                logpos-1, tag, t);
+        hal_failed(__FILE__, __LINE__);
+    }
+}
+
+void hal_init (void) {
+    ASSERT(rlog != NULL);
+}
+
+void hal_pin_nss (u1_t val) {
+    expect(val ? HR_NSS1 : HR_NSS0);
+}
+
+void hal_pin_rxtx (u1_t val) {
+}
+
+void hal_pin_rst (u1_t val) {
+}
+
+u1_t hal_spi (u1_t out) {
+    expect(HR_SPI);
+    u1_t o = nextByte();
+    if( o != out ) {
+        fprintf(stderr, "replay diverged at offset %ld: spi out %02x, rlog has %02x\n",
+                logpos-1, out, o);
+        hal_failed(__FILE__, __LINE__);
+    }
+    return nextByte();
+}
+
+// transactions replay as the byte-wise calls hal.c records for them
+void hal_spi_xfer (u1_t* buf, u2_t len) {
+    hal_pin_nss(0);
+    for( u2_t i = 0; i < len; i++ )
+        buf[i] = hal_spi(buf[i]);
+    hal_pin_nss(1);
+}
+
+void hal_spi_batch (const u1_t* buf, const u1_t* seglen, u1_t nseg) {
+    for( u1_t i = 0; i < nseg; i++ ) {
+        hal_pin_nss(0);
+        for( u1_t b = 0; b < seglen[i]; b++ )
+            hal_spi(*buf++);
+        hal_pin_nss(1);
+    }
+}
+
+osticks_t hal_ticks (void) {
+    if( idle ) {
+        idle--;
+        return ticks;
+    }
+    expect(HR_TICKS);
+    if( idle ) { // HR_IDLE record consumed
+        idle--;
+        return ticks;
+    }
+    return ticks += nextLeb();
+}
+
+// same call sequence as hal.c, so the recorded ticks line up
+static osticks_t delta_time (osticks_t time) {
+    osticks_t t = hal_ticks();
+    ostime_t d = os_timeDiff(time, t);
+    return d <= 5 ? 0 : (osticks_t)d;
+}
+
+void hal_waitUntil (osticks_t time) {
+    hal_ticks();
+    delta_time(time);
+}
+
+u1_t hal_checkTimer (osticks_t time) {
+    return delta_time(time) <= 0;
+}
+
+void hal_disableIRQs (void) {
+    irqlevel++;
+}
+
+void hal_enableIRQs (void) {
+    if( --irqlevel == 0 )
+        dispatchIrqs();
+}
+
+void hal_sleep (void) {
+}
+
+void hal_failed (const char* file, u2_t line) {
+    fprintf(stderr, "FAILURE\n");
+    fprintf(stderr, "%s:%d\n", file, line);
+    exit(1);
+}
+
+#endif // CFG_halreplay
@@ -0,0 +1,47 @@
+/*******************************************************************************
+ * Record/replay of HAL interactions.
+ *
+ * CFG_halrec: hal.c logs every SPI byte, hal_ticks() value, NSS change and
+ * DIO edge dispatched to radio_irq_handler() into a compact binary log.
+ * CFG_halreplay: halrec.c replaces hal.c and feeds such a log back into
+ * radio.c/lmic.c, so a field trace can be re-run on a workstation.
+ *
+ * Log format: "LHR" 0x01, OSTICKS_PER_SEC (u4, LE), then one record per HAL
+ * interaction, tagged by its first byte:
+ *   HR_SPI   out in
+ *   HR_TICKS LEB128 delta to the previous ticks value
+ *   HR_IDLE  LEB128 count of further HR_TICKS records with delta 0
+ *            (collapses the busy-polling run loop)
+ *   HR_NSS0 / HR_NSS1
+ *   HR_DIO+n
+ *******************************************************************************/
+
+#ifndef _halrec_h_
+#define _halrec_h_
+
+enum { HR_SPI=0x01, HR_TICKS=0x02, HR_NSS0=0x03, HR_NSS1=0x04, HR_IDLE=0x05, HR_DIO=0x08 };
+
+#if defined(CFG_halrec)
+/*
+ * start recording to given file (0=ok, -1=error); call before os_init().
+ */
+int hal_record (const char* path);
+void hal_recordClose (void);
+
+// called by hal.c
+void hrec_spi (u1_t out, u1_t in);
+void hrec_ticks (osticks_t ticks);
+void hrec_nss (u1_t val);
+void hrec_dio (u1_t dio);
+#endif
+
+#if defined(CFG_halreplay)
+/*
+ * replay given log (0=ok, -1=error); call before os_init().
+ *   - the process exits when the log is exhausted
+ *   - hal_failed() is invoked when the code under test diverges from the log
+ */
+int hal_replay (const char* path);
+#endif
+
+#endif // _halrec_h_
@@ -11,10 +11,21 @@
 
 //! \file
 #include "lmic.h"
+#if defined(CFG_energy)
+#include "energy.h"
+#endif
+#if defined(CFG_frag)
+#include "frag.h"
+#endif
 
 #if !defined(MINRX_SYMS)
 #define MINRX_SYMS 5
 #endif // !defined(MINRX_SYMS)
+#if defined(CFG_rxcal)
+#define RXCAL_K           4                   // default guard in mean deviations
+#define RXCAL_RAMPUP_MIN  (us2osticks(300))   // learned ramp-up guard bounds
+#define RXCAL_RAMPUP_MAX  (ms2osticks(100))
+#endif
 #define PAMBL_SYMS 8
 #define PAMBL_FSK  5
 #define PRERX_FSK  1
@@ -108,19 +119,47 @@ u1_t os_getBattLevel (void) {
 #endif
 
 #if !defined(os_crc16)
+// CRC-16 CCITT(XMODEM) remainder for each value of the top byte
+static const u2_t CRC16_TABLE[256] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+    0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
+    0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
+    0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
+    0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
+    0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
+    0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+    0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
+    0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
+    0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+    0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
+    0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
+    0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
+    0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+    0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
+    0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
+    0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+    0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
+    0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
+    0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+    0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
+    0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0,
+};
+
 // New CRC-16 CCITT(XMODEM) checksum for beacons:
 u2_t os_crc16 (xref2u1_t data, uint len) {
     u2_t remainder = 0;
-    u2_t polynomial = 0x1021;
-    for( uint i = 0; i < len; i++ ) {
-        remainder ^= data[i] << 8;
-        for( u1_t bit = 8; bit > 0; bit--) {
-            if( (remainder & 0x8000) )
-                remainder = (remainder << 1) ^ polynomial;
-            else 
-                remainder <<= 1;
-        }
-    }
+    for( uint i = 0; i < len; i++ )
+        remainder = (remainder << 8) ^ CRC16_TABLE[(remainder >> 8) ^ data[i]];
     return remainder;
 }
 #endif
@@ -143,18 +182,28 @@ static void micB0 (u4_t devaddr, u4_t seqno, int dndir, int len) {
 }
 
 
-static int aes_verifyMic (xref2cu1_t key, u4_t devaddr, u4_t seqno, int dndir, xref2u1_t pdu, int len) {
+// Encrypt pdu[poff..len) with ckey (if not NULL) and append MIC - single pass
+static void aes_cipherAppendMic (xref2cu1_t ckey, xref2cu1_t key, u4_t devaddr, u4_t seqno, int dndir, xref2u1_t pdu, int poff, int len) {
     micB0(devaddr, seqno, dndir, len);
     os_copyMem(AESkey,key,16);
-    return os_aes(AES_MIC, pdu, len) == os_rmsbf4(pdu+len);
+    os_wmsbf4(pdu+len, os_aesFrame(AES_ENC, ckey, pdu, poff, len));
 }
 
 
-static void aes_appendMic (xref2cu1_t key, u4_t devaddr, u4_t seqno, int dndir, xref2u1_t pdu, int len) {
+// Same with the payload pdu[poff..len) gathered from frags while it is ciphered
+static void aes_gatherCipherAppendMic (xref2cu1_t ckey, xref2cu1_t key, u4_t devaddr, u4_t seqno, int dndir, xref2u1_t pdu, int poff, int len, const txfrag_t* frags) {
     micB0(devaddr, seqno, dndir, len);
     os_copyMem(AESkey,key,16);
-    // MSB because of internal structure of AES
-    os_wmsbf4(pdu+len, os_aes(AES_MIC, pdu, len));
+    os_wmsbf4(pdu+len, os_aesFrameV(ckey, pdu, poff, len, frags));
+}
+
+
+// Verify MIC and decrypt pdu[poff..len) with ckey (if not NULL) - single pass.
+// Payload is deciphered even if the MIC turns out to be bad.
+static int aes_verifyMicDecipher (xref2cu1_t ckey, xref2cu1_t key, u4_t devaddr, u4_t seqno, int dndir, xref2u1_t pdu, int poff, int len) {
+    micB0(devaddr, seqno, dndir, len);
+    os_copyMem(AESkey,key,16);
+    return os_aesFrame(AES_DEC, ckey, pdu, poff, len) == os_rmsbf4(pdu+len);
 }
 
 
@@ -176,19 +225,6 @@ static void aes_encrypt (xref2u1_t pdu, int len) {
 }
 
 
-static void aes_cipher (xref2cu1_t key, u4_t devaddr, u4_t seqno, int dndir, xref2u1_t payload, int len) {
-    if( len <= 0 )
-        return;
-    os_clearMem(AESaux, 16);
-    AESaux[0] = AESaux[15] = 1; // mode=cipher / dir=down / block counter=1
-    AESaux[5] = dndir?1:0;
-    os_wlsbf4(AESaux+ 6,devaddr);
-    os_wlsbf4(AESaux+10,seqno);
-    os_copyMem(AESkey,key,16);
-    os_aes(AES_CTR, payload, len);
-}
-
-
 static void aes_sessKeys (u2_t devnonce, xref2cu1_t artnonce, xref2u1_t nwkkey, xref2u1_t artkey) {
     os_clearMem(nwkkey, 16);
     nwkkey[0] = 0x01;
@@ -233,6 +269,9 @@ static const s1_t TXPOWLEVELS[] = {
 };
 #define pow2dBm(mcmd_ladr_p1) (TXPOWLEVELS[(mcmd_ladr_p1&MCMD_LADR_POW_MASK)>>MCMD_LADR_POW_SHIFT])
 
+// Device side ADR: fastest DR tried, TX power ladder and gateway noise floor at 125kHz (dBm)
+enum { DEVADR_MAXDR = DR_SF7, DEVADR_POWMIN = 2, DEVADR_POWMAX = 14, DEVADR_POWSTEP = 3, DEVADR_NOISE = -120 };
+
 #elif defined(CFG_us915) // ========================================
 
 #define maxFrameLen(dr) ((dr)<=DR_SF11CR ? maxFrameLens[(dr)] : 0xFF)
@@ -259,6 +298,9 @@ const u1_t _DR2RPS_CRC[] = {
 
 #define pow2dBm(mcmd_ladr_p1) ((s1_t)(30 - (((mcmd_ladr_p1)&MCMD_LADR_POW_MASK)<<1)))
 
+// Device side ADR: fastest DR tried (125kHz only), TX power ladder and gateway noise floor at 125kHz (dBm)
+enum { DEVADR_MAXDR = DR_SF7, DEVADR_POWMIN = 10, DEVADR_POWMAX = 30, DEVADR_POWSTEP = 2, DEVADR_NOISE = -120 };
+
 #endif // ================================================
 
 static const u1_t SENSITIVITY[7][3] = {
@@ -277,6 +319,17 @@ int getSensitivity (rps_t rps) {
     return -141 + SENSITIVITY[getSf(rps)][getBw(rps)];
 }
 
+// Minimum demodulation SNR per SF (scaled by SNR_SCALEUP)
+static const s1_t SNR_FLOOR[7] = {
+    0,      // FSK - not used
+    -30,    // SF7  -7.5dB
+    -40,    // SF8  -10dB
+    -50,    // SF9  -12.5dB
+    -60,    // SF10 -15dB
+    -70,    // SF11 -17.5dB
+    -80     // SF12 -20dB
+};
+
 ostime_t calcAirTime (rps_t rps, u1_t plen) {
     u1_t bw = getBw(rps);  // 0,1,2 = 125,250,500kHz
     u1_t sf = getSf(rps);  // 0=FSK, 1..6 = SF7..12
@@ -315,6 +368,63 @@ ostime_t calcAirTime (rps_t rps, u1_t plen) {
     return (((ostime_t)tmp << sfx) * OSTICKS_PER_SEC + div/2) / div;
 }
 
+// Air time of uplink frames per DR and frame length (filled by LMIC_init)
+static ostime_t AIRTIME_osticks[DR_NONE][MAX_LEN_FRAME+1];
+
+static void initAirTime (void) {
+    for( u1_t dr=0; dr<DR_NONE; dr++ ) {
+        for( u1_t len=0; len<=MAX_LEN_FRAME; len++ )
+            AIRTIME_osticks[dr][len] = calcAirTime(updr2rps(dr), len);
+    }
+}
+
+// Air time of the TX frame in LMIC.frame (LMIC.dndr carries the TX datarate)
+static ostime_t txAirTime (void) {
+    if( LMIC.dndr < DR_NONE && LMIC.rps == updr2rps(LMIC.dndr) && LMIC.dataLen <= MAX_LEN_FRAME )
+        return AIRTIME_osticks[LMIC.dndr][LMIC.dataLen];
+    return calcAirTime(LMIC.rps, LMIC.dataLen);
+}
+
+// Frame length of an uplink carrying plen application bytes (no MAC options)
+static u2_t upFrameLen (u1_t plen) {
+    return OFF_DAT_OPTS + (plen ? 1+plen : 0) + 4;
+}
+
+// Longest uplink frame allowed at dr (region limit, capped by LMIC.frame)
+static u1_t upFrameMax (dr_t dr) {
+    return maxFrameLen(dr) < MAX_LEN_FRAME ? maxFrameLen(dr) : MAX_LEN_FRAME;
+}
+
+// Ledger slot number of time t. Slots are counted from dutySlotBeg, which
+// follows the clock, so the numbers keep going up when the ticks wrap.
+static u4_t dutySlotOf (ostime_t t) {
+    ostime_t d = os_timeDiff(t, LMIC.dutySlotBeg);
+    if( d < -(ostime_t)(DUTY_SLOTS * DUTY_SLOT_osticks) ) {
+        // over 2^31 ticks without a look at the ledger - all slots expired
+        LMIC.dutySlot += DUTY_SLOTS;
+        LMIC.dutySlotBeg = t;
+        return LMIC.dutySlot;
+    }
+    if( d < 0 ) // before the current slot (TX began ahead of the last look)
+        return LMIC.dutySlot - 1 - (u4_t)((-d - 1) / DUTY_SLOT_osticks);
+    u4_t n = (u4_t)(d / DUTY_SLOT_osticks);
+    LMIC.dutySlot += n;
+    LMIC.dutySlotBeg += (ostime_t)n * DUTY_SLOT_osticks;
+    return LMIC.dutySlot;
+}
+
+// Book air time into the sliding window of the given ledger
+static void dutyRecord (u1_t ledger, ostime_t txbeg, ostime_t airtime) {
+    dutyledger_t* l = &LMIC.dutyLedger[ledger];
+    u4_t sn = dutySlotOf(txbeg);
+    u1_t si = sn % DUTY_SLOTS;
+    if( l->slot[si] != sn ) { // slot left the window - reuse
+        l->slot[si] = sn;
+        l->airtime[si] = 0;
+    }
+    l->airtime[si] += airtime;
+}
+
 extern inline rps_t updr2rps (dr_t dr);
 extern inline rps_t dndr2rps (dr_t dr);
 extern inline int isFasterDR (dr_t dr1, dr_t dr2);
@@ -440,7 +550,7 @@ static void rxschedInit (xref2rxsched_t rxsched) {
 
 static bit_t rxschedNext (xref2rxsched_t rxsched, ostime_t cando) {
   again:
-    if( rxsched->rxtime - cando >= 0 )
+    if( os_timeDiff(rxsched->rxtime, cando) >= 0 )
         return 1;
     u1_t slot;
     if( (slot=rxsched->slot) >= 128 )
@@ -469,7 +579,7 @@ static ostime_t rndDelay (u1_t secSpan) {
 
 static void txDelay (ostime_t reftime, u1_t secSpan) {
     reftime += rndDelay(secSpan);
-    if( LMIC.globalDutyRate == 0  ||  (reftime - LMIC.globalDutyAvail) > 0 ) {
+    if( LMIC.globalDutyRate == 0  ||  os_timeDiff(reftime, LMIC.globalDutyAvail) > 0 ) {
         LMIC.globalDutyAvail = reftime;
         LMIC.opmode |= OP_RNDTX;
     }
@@ -613,7 +723,7 @@ void LMIC_disableChannel (u1_t channel) {
     LMIC.channelMap &= ~(1<<channel);
 }
 
-static u4_t convFreq (xref2u1_t ptr) {
+static u4_t convFreq (xref2cu1_t ptr) {
     u4_t freq = (os_rlsbf4(ptr-1) >> 8) * 100;
     if( freq < EU868_FREQ_MIN || freq > EU868_FREQ_MAX )
         freq = 0;
@@ -636,13 +746,16 @@ static u1_t mapChannels (u1_t chpage, u2_t chmap) {
 static void updateTx (ostime_t txbeg) {
     u4_t freq = LMIC.channelFreq[LMIC.txChnl];
     // Update global/band specific duty cycle stats
-    ostime_t airtime = calcAirTime(LMIC.rps, LMIC.dataLen);
+    ostime_t airtime = txAirTime();
     // Update channel/global duty cycle stats
     xref2band_t band = &LMIC.bands[freq & 0x3];
     LMIC.freq  = freq & ~(u4_t)3;
     LMIC.txpow = band->txpow;
+    if( LMIC.devAdrMargin != 0 && LMIC.adrTxPow < LMIC.txpow )
+        LMIC.txpow = LMIC.adrTxPow;
     band->avail = txbeg + airtime * band->txcap;
-    printf("%lu: freq=%lu\n", os_getTime(), LMIC.freq);
+    dutyRecord(freq & 0x3, txbeg, airtime);
+    printf("%lu: freq=%lu\n", (unsigned long)(osticks_t)os_getTime(), (unsigned long)LMIC.freq);
     if( LMIC.globalDutyRate != 0 )
         LMIC.globalDutyAvail = txbeg + (airtime<<LMIC.globalDutyRate);
 }
@@ -653,7 +766,7 @@ static ostime_t nextTx (ostime_t now) {
         ostime_t mintime = now + /*10h*/36000*OSTICKS_PER_SEC;
         u1_t band=0;
         for( u1_t bi=0; bi<4; bi++ ) {
-            if( (bmap & (1<<bi)) && mintime - LMIC.bands[bi].avail > 0 )
+            if( (bmap & (1<<bi)) && os_timeDiff(mintime, LMIC.bands[bi].avail) > 0 )
                 mintime = LMIC.bands[band = bi].avail;
         }
         // Find next channel in given band
@@ -683,6 +796,7 @@ static void setBcnRxParams (void) {
 }
 
 #define setRx1Params() /*LMIC.freq/rps remain unchanged*/
+#define rx1DR(dr) (dr)  // RX1 DN datarate for a TX datarate
 
 static void initJoinLoop (void) {
     LMIC.txChnl = os_getRndU1() % 6;
@@ -713,7 +827,7 @@ static ostime_t nextJoinState (void) {
     // Move txend to randomize synchronized concurrent joins.
     // Duty cycle is based on txend.
     ostime_t time = os_getTime();
-    if( time - LMIC.bands[BAND_MILLI].avail < 0 )
+    if( os_timeDiff(time, LMIC.bands[BAND_MILLI].avail) < 0 )
         time = LMIC.bands[BAND_MILLI].avail;
     LMIC.txend = time +
         (isTESTMODE()
@@ -743,7 +857,7 @@ static void initDefaultChannels (void) {
     LMIC.channelMap[4] = 0x00FF;
 }
 
-static u4_t convFreq (xref2u1_t ptr) {
+static u4_t convFreq (xref2cu1_t ptr) {
     u4_t freq = (os_rlsbf4(ptr-1) >> 8) * 100;
     if( freq < US915_FREQ_MIN || freq > US915_FREQ_MAX )
         freq = 0;
@@ -783,25 +897,26 @@ static void updateTx (ostime_t txbeg) {
     u1_t chnl = LMIC.txChnl;
     if( chnl < 64 ) {
         //LMIC.freq = US915_125kHz_UPFBASE + chnl*US915_125kHz_UPFSTEP;
-        LMIC.freq = US915_125kHz_UPFBASE;
+        LMIC.freq = US915_125kHz_UPFBASE + (LMIC.chSpread ? chnl*US915_125kHz_UPFSTEP : 0);
         LMIC.txpow = 30;
-    	printf("%lu: freq=%lu\n", os_getTime(), LMIC.freq);
-        return;
-    }
-    LMIC.txpow = 26;
-    if( chnl < 64+8 ) {
-        LMIC.freq = US915_500kHz_UPFBASE + (chnl-64)*US915_500kHz_UPFSTEP;
     } else {
-        ASSERT(chnl < 64+8+MAX_XCHANNELS);
-        LMIC.freq = LMIC.xchFreq[chnl-72];
+        LMIC.txpow = 26;
+        if( chnl < 64+8 ) {
+            LMIC.freq = US915_500kHz_UPFBASE + (chnl-64)*US915_500kHz_UPFSTEP;
+        } else {
+            ASSERT(chnl < 64+8+MAX_XCHANNELS);
+            LMIC.freq = LMIC.xchFreq[chnl-72];
+        }
     }
+    if( LMIC.devAdrMargin != 0 && LMIC.adrTxPow < LMIC.txpow )
+        LMIC.txpow = LMIC.adrTxPow;
 
-    printf("%lu: freq=%lu\n", os_getTime(), LMIC.freq);
-    // Update global duty cycle stats
-    if( LMIC.globalDutyRate != 0 ) {
-        ostime_t airtime = calcAirTime(LMIC.rps, LMIC.dataLen);
+    printf("%lu: freq=%lu\n", (unsigned long)(osticks_t)os_getTime(), (unsigned long)LMIC.freq);
+    // Update air time ledger and global duty cycle stats
+    ostime_t airtime = txAirTime();
+    dutyRecord(0, txbeg, airtime);
+    if( LMIC.globalDutyRate != 0 )
         LMIC.globalDutyAvail = txbeg + (airtime<<LMIC.globalDutyRate);
-    }
 }
 
 // US does not have duty cycling - return now as earliest TX time
@@ -835,12 +950,12 @@ static void setBcnRxParams (void) {
     LMIC.rps  = setIh(setNocrc(dndr2rps((dr_t)DR_BCN),1),LEN_BCN);
 }
 
+// RX1 DN datarate for a TX datarate
+#define rx1DR(dr) ((dr) < DR_SF8C ? (dr_t)((dr) + DR_SF10CR - DR_SF10) : (dr) == DR_SF8C ? DR_SF7CR : (dr_t)(dr))
+
 #define setRx1Params() {                                                \
     LMIC.freq = US915_500kHz_DNFBASE + (LMIC.txChnl & 0x7) * US915_500kHz_DNFSTEP; \
-    if( /* TX datarate */LMIC.dndr < DR_SF8C )                          \
-        LMIC.dndr += DR_SF10CR - DR_SF10;                               \
-    else if( LMIC.dndr == DR_SF8C )                                     \
-        LMIC.dndr = DR_SF7CR;                                           \
+    LMIC.dndr = rx1DR(/* TX datarate */LMIC.dndr);                      \
     LMIC.rps = dndr2rps(LMIC.dndr);                                     \
 }
 
@@ -916,9 +1031,9 @@ static void runReset (xref2osjob_t osjob) {
 static void stateJustJoined (void) {
     LMIC.seqnoDn     = LMIC.seqnoUp = 0;
     LMIC.rejoinCnt   = 0;
-    LMIC.dnConf      = LMIC.adrChanged = LMIC.ladrAns = LMIC.devsAns = 0;
-    LMIC.moreData    = LMIC.dn2Ans = LMIC.snchAns = LMIC.dutyCapAns = 0;
-    LMIC.pingSetAns  = 0;
+    LMIC.dnConf      = LMIC.adrChanged = LMIC.moreData = 0;
+    LMIC.pendOptsLen = 0;
+    LMIC.devAdrCnt   = LMIC.devAdrIdx = 0;
     LMIC.upRepeat    = 0;
     LMIC.adrAckReq   = LINK_CHECK_INIT;
     LMIC.dn2Dr       = DR_DNW2;
@@ -970,11 +1085,213 @@ static int decodeBeacon (void) {
 }
 
 
+// ================================================================================
+// MAC commands
+
+
+// length of uplink MAC commands by CID (including CID)
+static const u1_t MCMD_UP_LEN[] = {
+    0, 0,
+    1,  // MCMD_LCHK_REQ
+    2,  // MCMD_LADR_ANS
+    1,  // MCMD_DCAP_ANS
+    2,  // MCMD_DN2P_ANS
+    3,  // MCMD_DEVS_ANS
+    2,  // MCMD_SNCH_ANS
+    0, 0, 0, 0, 0, 0, 0, 0,
+    2,  // MCMD_PING_IND
+    2,  // MCMD_PING_ANS
+    1,  // MCMD_BCNI_REQ
+};
+
+// arguments of the answer to cid in the next UP frame - replaces an unsent answer with the same CID
+static xref2u1_t mcmdAnswer (u1_t cid) {
+    u1_t i = 0;
+    while( i < LMIC.pendOptsLen && LMIC.pendOpts[i] != cid )
+        i += MCMD_UP_LEN[LMIC.pendOpts[i]];
+    if( i == LMIC.pendOptsLen ) {
+        LMIC.pendOptsLen += MCMD_UP_LEN[cid];
+        ASSERT(LMIC.pendOptsLen <= sizeof(LMIC.pendOpts));
+    }
+    LMIC.pendOpts[i] = cid;
+    return &LMIC.pendOpts[i+1];
+}
+
+static void mcmdLchkAns (xref2cu1_t cmd) {
+    //int gwmargin = cmd[1];
+    //int ngws = cmd[2];
+}
+
+static void mcmdLadrReq (xref2cu1_t cmd) {
+    u1_t p1     = cmd[1];                             // txpow + DR
+    u2_t chmap  = os_rlsbf2(&cmd[2]);                 // list of enabled channels
+    u1_t chpage = cmd[4] & MCMD_LADR_CHPAGE_MASK;     // channel page
+    u1_t uprpt  = cmd[4] & MCMD_LADR_REPEAT_MASK;     // up repeat count
+    u1_t ans    = MCMD_LADR_ANS_POWACK | MCMD_LADR_ANS_CHACK | MCMD_LADR_ANS_DRACK;
+
+    if( !mapChannels(chpage, chmap) )
+        ans &= ~MCMD_LADR_ANS_CHACK;
+    dr_t dr = (dr_t)(p1>>MCMD_LADR_DR_SHIFT);
+    if( !validDR(dr) ) {
+        ans &= ~MCMD_LADR_ANS_DRACK;
+        EV(specCond, ERR, (e_.reason = EV::specCond_t::BAD_MAC_CMD,
+                           e_.eui    = MAIN::CDEV->getEui(),
+                           e_.info   = 0,
+                           e_.info2  = Base::msbf4(&cmd[1])));
+    }
+    if( ans == (MCMD_LADR_ANS_POWACK | MCMD_LADR_ANS_CHACK | MCMD_LADR_ANS_DRACK) ) {
+        // Nothing went wrong - use settings
+        LMIC.upRepeat = uprpt;
+        setDrTxpow(DRCHG_NWKCMD, dr, pow2dBm(p1));
+    }
+    LMIC.adrChanged = 1;  // Trigger an ACK to NWK
+    *mcmdAnswer(MCMD_LADR_ANS) = ans;
+}
+
+static void mcmdDcapReq (xref2cu1_t cmd) {
+    u1_t cap = cmd[1];
+    // A value cap=0xFF means device is OFF unless enabled again manually.
+    if( cap==0xFF )
+        LMIC.opmode |= OP_SHUTDOWN;  // stop any sending
+    LMIC.globalDutyRate  = cap & 0xF;
+    LMIC.globalDutyAvail = os_getTime();
+    DO_DEVDB(cap,dutyCap);
+    mcmdAnswer(MCMD_DCAP_ANS);
+}
+
+static void mcmdDn2pSet (xref2cu1_t cmd) {
+    dr_t dr = (dr_t)(cmd[1] & 0x0F);
+    u4_t freq = convFreq(&cmd[2]);
+    u1_t ans = 0;
+    if( validDR(dr) )
+        ans |= MCMD_DN2P_ANS_DRACK;
+    if( freq != 0 )
+        ans |= MCMD_DN2P_ANS_CHACK;
+    if( ans == (MCMD_DN2P_ANS_DRACK|MCMD_DN2P_ANS_CHACK) ) {
+        LMIC.dn2Dr = dr;
+        LMIC.dn2Freq = freq;
+        DO_DEVDB(LMIC.dn2Dr,dn2Dr);
+        DO_DEVDB(LMIC.dn2Freq,dn2Freq);
+    }
+    *mcmdAnswer(MCMD_DN2P_ANS) = ans;
+}
+
+static void mcmdDevsReq (xref2cu1_t cmd) {
+    xref2u1_t ans = mcmdAnswer(MCMD_DEVS_ANS);
+    ans[0] = os_getBattLevel();
+    ans[1] = LMIC.margin;
+}
+
+static void mcmdSnchReq (xref2cu1_t cmd) {
+    u1_t chidx = cmd[1];             // channel
+    u4_t freq  = convFreq(&cmd[2]);  // freq
+    u1_t drs   = cmd[5];             // datarate span
+    u1_t ans   = 0;
+    if( freq != 0 && LMIC_setupChannel(chidx, freq, DR_RANGE_MAP(drs&0xF,drs>>4), -1) )
+        ans = MCMD_SNCH_ANS_DRACK|MCMD_SNCH_ANS_FQACK;
+    *mcmdAnswer(MCMD_SNCH_ANS) = ans;
+}
+
+static void mcmdPingSet (xref2cu1_t cmd) {
+    u4_t freq = convFreq(&cmd[1]);
+    if( freq != 0 ) {
+        LMIC.ping.freq = freq;
+        DO_DEVDB(LMIC.ping.intvExp, pingIntvExp);
+        DO_DEVDB(LMIC.ping.freq, pingFreq);
+        DO_DEVDB(LMIC.ping.dr, pingDr);
+    }
+    *mcmdAnswer(MCMD_PING_ANS) = freq != 0 ? MCMD_PING_ANS_FQACK : 0;
+}
+
+static void mcmdBcniAns (xref2cu1_t cmd) {
+    // Ignore if tracking already enabled
+    if( (LMIC.opmode & OP_TRACK) != 0 )
+        return;
+    LMIC.bcnChnl = cmd[3];
+    // Enable tracking - bcninfoTries
+    LMIC.opmode |= OP_TRACK;
+    // Cleared later in txComplete handling - triggers EV_BEACON_FOUND
+    ASSERT(LMIC.bcninfoTries!=0);
+    // Setup RX parameters
+    LMIC.bcninfo.txtime = (LMIC.rxtime
+                           + ms2osticks(os_rlsbf2(&cmd[1]) * MCMD_BCNI_TUNIT)
+                           + ms2osticksCeil(MCMD_BCNI_TUNIT/2)
+                           - BCN_INTV_osticks);
+    LMIC.bcninfo.flags = 0;  // txtime above cannot be used as reference (BCN_PARTIAL|BCN_FULL cleared)
+    calcBcnRxWindowFromMillis(MCMD_BCNI_TUNIT,1);  // error of +/-N ms 
+
+    EV(lostFrame, INFO, (e_.reason  = EV::lostFrame_t::MCMD_BCNI_ANS,
+                         e_.eui     = MAIN::CDEV->getEui(),
+                         e_.lostmic = 0,
+                         e_.info    = (LMIC.missedBcns |
+                                       (osticks2us(LMIC.bcninfo.txtime + BCN_INTV_osticks
+                                                   - LMIC.bcnRxtime) << 8)),
+                         e_.time    = MAIN::CDEV->ostime2ustime(LMIC.bcninfo.txtime + BCN_INTV_osticks)));
+}
+
+// MAC commands in FOpts of DN frames by CID: length (including CID, 0=unknown) and handler
+static const struct {
+    u1_t len;
+    void (*fn) (xref2cu1_t cmd);
+} MCMD_DN[] = {
+    { 0, NULL },
+    { 0, NULL },
+    { 3, mcmdLchkAns },  // MCMD_LCHK_ANS
+    { 5, mcmdLadrReq },  // MCMD_LADR_REQ
+    { 2, mcmdDcapReq },  // MCMD_DCAP_REQ
+    { 5, mcmdDn2pSet },  // MCMD_DN2P_SET
+    { 1, mcmdDevsReq },  // MCMD_DEVS_REQ
+    { 6, mcmdSnchReq },  // MCMD_SNCH_REQ
+    { 0, NULL }, { 0, NULL }, { 0, NULL }, { 0, NULL },
+    { 0, NULL }, { 0, NULL }, { 0, NULL }, { 0, NULL },
+    { 0, NULL },
+    { 4, mcmdPingSet },  // MCMD_PING_SET
+    { 4, mcmdBcniAns },  // MCMD_BCNI_ANS
+};
+enum { MCMD_DN_MAX = sizeof(MCMD_DN)/sizeof(MCMD_DN[0]) };
+
+
+// ================================================================================
+// Multicast sessions
+
+
+static u1_t mcastHash (devaddr_t addr) {
+    return (u1_t)((u4_t)(addr * 0x9E3779B1) >> 24) & (MCAST_SLOTS-1);
+}
+
+// 1+index of the session for addr or 0 - one probe unless addresses collide
+static u1_t mcastFind (devaddr_t addr) {
+    u1_t h = mcastHash(addr);
+    for( u1_t i = 0; i < MCAST_SLOTS; i++, h = (h+1) & (MCAST_SLOTS-1) ) {
+        u1_t mc = LMIC.mcastSlot[h];
+        if( mc == 0 )
+            return 0;
+        if( LMIC.mcast[mc-1].addr == addr )
+            return mc;
+    }
+    return 0;
+}
+
+// rebuild the address hash (linear probing, no tombstones)
+static void mcastIndex (void) {
+    os_clearMem(LMIC.mcastSlot, sizeof(LMIC.mcastSlot));
+    for( u1_t i = 0; i < MAX_MCAST; i++ ) {
+        if( LMIC.mcast[i].addr == 0 )
+            continue;
+        u1_t h = mcastHash(LMIC.mcast[i].addr);
+        while( LMIC.mcastSlot[h] != 0 )
+            h = (h+1) & (MCAST_SLOTS-1);
+        LMIC.mcastSlot[h] = i+1;
+    }
+}
+
+
 static bit_t decodeFrame (void) {
     xref2u1_t d = LMIC.frame;
     u1_t hdr    = d[0];
     u1_t ftype  = hdr & HDR_FTYPE;
     int  dlen   = LMIC.dataLen;
+    LMIC.dataMcast = 0;
     if( dlen < OFF_DAT_OPTS+4 ||
         (hdr & HDR_MAJOR) != HDR_MAJOR_V1 ||
         (ftype != HDR_FTYPE_DADN  &&  ftype != HDR_FTYPE_DCDN) ) {
@@ -996,8 +1313,9 @@ static bit_t decodeFrame (void) {
     int  ackup = (fct & FCT_ACK) != 0 ? 1 : 0;   // ACK last up frame
     int  poff  = OFF_DAT_OPTS+olen;
     int  pend  = dlen-4;  // MIC
+    u1_t mc    = addr == LMIC.devaddr ? 0 : mcastFind(addr);
 
-    if( addr != LMIC.devaddr ) {
+    if( addr != LMIC.devaddr && mc == 0 ) {
         EV(specCond, WARN, (e_.reason = EV::specCond_t::ALIEN_ADDRESS,
                             e_.eui    = MAIN::CDEV->getEui(),
                             e_.info   = addr,
@@ -1017,9 +1335,33 @@ static bit_t decodeFrame (void) {
     if( pend > poff )
         port = d[poff++];
 
+    if( mc != 0 ) {
+        // Multicast: unconfirmed, no MAC commands, application port, class C continuous RX
+        mcast_t* grp = &LMIC.mcast[mc-1];
+        if( ftype != HDR_FTYPE_DADN || olen != 0 || port <= 0 ||
+            (LMIC.txrxFlags & TXRX_CLASSC) == 0 )
+            goto norx;
+        seqno = grp->seqnoDn + (u2_t)(seqno - grp->seqnoDn);
+        if( !aes_verifyMicDecipher(grp->artKey, grp->nwkKey, addr, seqno, /*dn*/1, d, poff, pend) ||
+            seqno < grp->seqnoDn )
+            goto norx;
+        grp->seqnoDn = seqno+1;
+#if defined(CFG_frag)
+        if( port == FRAG_PORT )
+            frag_rx(d+poff, pend-poff);
+#endif
+        LMIC.dataMcast = mc;
+        LMIC.txrxFlags |= TXRX_PORT;
+        LMIC.dataBeg = poff;
+        LMIC.dataLen = pend-poff;
+        return 1;
+    }
+
     seqno = LMIC.seqnoDn + (u2_t)(seqno - LMIC.seqnoDn);
 
-    if( !aes_verifyMic(LMIC.nwkKey, LMIC.devaddr, seqno, /*dn*/1, d, pend) ) {
+    // MIC check and payload decryption (if any) in one pass
+    xref2cu1_t ckey = port < 0 || pend-poff <= 0 ? NULL : port == 0 ? LMIC.nwkKey : LMIC.artKey;
+    if( !aes_verifyMicDecipher(ckey, LMIC.nwkKey, LMIC.devaddr, seqno, /*dn*/1, d, poff, pend) ) {
         EV(spe3Cond, ERR, (e_.reason = EV::spe3Cond_t::CORRUPTED_MIC,
                            e_.eui1   = MAIN::CDEV->getEui(),
                            e_.info1  = Base::lsbf4(&d[pend]),
@@ -1074,131 +1416,17 @@ static bit_t decodeFrame (void) {
     xref2u1_t opts = &d[OFF_DAT_OPTS];
     int oidx = 0;
     while( oidx < olen ) {
-        switch( opts[oidx] ) {
-        case MCMD_LCHK_ANS: {
-            //int gwmargin = opts[oidx+1];
-            //int ngws = opts[oidx+2];
-            oidx += 3;
-            continue;
-        }
-        case MCMD_LADR_REQ: {
-            u1_t p1     = opts[oidx+1];            // txpow + DR
-            u2_t chmap  = os_rlsbf2(&opts[oidx+2]);// list of enabled channels
-            u1_t chpage = opts[oidx+4] & MCMD_LADR_CHPAGE_MASK;     // channel page
-            u1_t uprpt  = opts[oidx+4] & MCMD_LADR_REPEAT_MASK;     // up repeat count
-            oidx += 5;
-
-            LMIC.ladrAns = 0x80 |     // Include an answer into next frame up
-                MCMD_LADR_ANS_POWACK | MCMD_LADR_ANS_CHACK | MCMD_LADR_ANS_DRACK;
-            if( !mapChannels(chpage, chmap) )
-                LMIC.ladrAns &= ~MCMD_LADR_ANS_CHACK;
-            dr_t dr = (dr_t)(p1>>MCMD_LADR_DR_SHIFT);
-            if( !validDR(dr) ) {
-                LMIC.ladrAns &= ~MCMD_LADR_ANS_DRACK;
-                EV(specCond, ERR, (e_.reason = EV::specCond_t::BAD_MAC_CMD,
-                                   e_.eui    = MAIN::CDEV->getEui(),
-                                   e_.info   = Base::lsbf4(&d[pend]),
-                                   e_.info2  = Base::msbf4(&opts[oidx-4])));
-            }
-            if( (LMIC.ladrAns & 0x7F) == (MCMD_LADR_ANS_POWACK | MCMD_LADR_ANS_CHACK | MCMD_LADR_ANS_DRACK) ) {
-                // Nothing went wrong - use settings
-                LMIC.upRepeat = uprpt;
-                setDrTxpow(DRCHG_NWKCMD, dr, pow2dBm(p1));
-            }
-            LMIC.adrChanged = 1;  // Trigger an ACK to NWK
-            continue;
-        }
-        case MCMD_DEVS_REQ: {
-            LMIC.devsAns = 1;
-            oidx += 1;
-            continue;
-        }
-        case MCMD_DN2P_SET: {
-            dr_t dr = (dr_t)(opts[oidx+1] & 0x0F);
-            u4_t freq = convFreq(&opts[oidx+2]);
-            oidx += 5;
-            LMIC.dn2Ans = 0x80;   // answer pending
-            if( validDR(dr) )
-                LMIC.dn2Ans |= MCMD_DN2P_ANS_DRACK;
-            if( freq != 0 )
-                LMIC.dn2Ans |= MCMD_DN2P_ANS_CHACK;
-            if( LMIC.dn2Ans == (0x80|MCMD_DN2P_ANS_DRACK|MCMD_DN2P_ANS_CHACK) ) {
-                LMIC.dn2Dr = dr;
-                LMIC.dn2Freq = freq;
-                DO_DEVDB(LMIC.dn2Dr,dn2Dr);
-                DO_DEVDB(LMIC.dn2Freq,dn2Freq);
-            }
-            continue;
-        }
-        case MCMD_DCAP_REQ: {
-            u1_t cap = opts[oidx+1];
-            oidx += 2;
-            // A value cap=0xFF means device is OFF unless enabled again manually.
-            if( cap==0xFF )
-                LMIC.opmode |= OP_SHUTDOWN;  // stop any sending
-            LMIC.globalDutyRate  = cap & 0xF;
-            LMIC.globalDutyAvail = os_getTime();
-            DO_DEVDB(cap,dutyCap);
-            LMIC.dutyCapAns = 1;
-            continue;
-        }
-        case MCMD_SNCH_REQ: {
-            u1_t chidx = opts[oidx+1];  // channel
-            u4_t freq  = convFreq(&opts[oidx+2]); // freq
-            u1_t drs   = opts[oidx+5];  // datarate span
-            LMIC.snchAns = 0x80;
-            if( freq != 0 && LMIC_setupChannel(chidx, freq, DR_RANGE_MAP(drs&0xF,drs>>4), -1) )
-                LMIC.snchAns |= MCMD_SNCH_ANS_DRACK|MCMD_SNCH_ANS_FQACK;
-            oidx += 6;
-            continue;
+        u1_t cid = opts[oidx];
+        if( cid >= MCMD_DN_MAX || MCMD_DN[cid].len == 0 || oidx+MCMD_DN[cid].len > olen ) {
+            // unknown or truncated - length of the rest unknown
+            EV(specCond, ERR, (e_.reason = EV::specCond_t::BAD_MAC_CMD,
+                               e_.eui    = MAIN::CDEV->getEui(),
+                               e_.info   = Base::lsbf4(&d[pend]),
+                               e_.info2  = Base::msbf4(&opts[oidx])));
+            break;
         }
-        case MCMD_PING_SET: {
-            u4_t freq = convFreq(&opts[oidx+1]);
-            oidx += 4;
-            u1_t flags = 0x80;
-            if( freq != 0 ) {
-                flags |= MCMD_PING_ANS_FQACK;
-                LMIC.ping.freq = freq;
-                DO_DEVDB(LMIC.ping.intvExp, pingIntvExp);
-                DO_DEVDB(LMIC.ping.freq, pingFreq);
-                DO_DEVDB(LMIC.ping.dr, pingDr);
-            }
-            LMIC.pingSetAns = flags;
-            continue;
-        }
-        case MCMD_BCNI_ANS: {
-            // Ignore if tracking already enabled
-            if( (LMIC.opmode & OP_TRACK) == 0 ) {
-                LMIC.bcnChnl = opts[oidx+3];
-                // Enable tracking - bcninfoTries
-                LMIC.opmode |= OP_TRACK;
-                // Cleared later in txComplete handling - triggers EV_BEACON_FOUND
-                ASSERT(LMIC.bcninfoTries!=0);
-                // Setup RX parameters
-                LMIC.bcninfo.txtime = (LMIC.rxtime
-                                       + ms2osticks(os_rlsbf2(&opts[oidx+1]) * MCMD_BCNI_TUNIT)
-                                       + ms2osticksCeil(MCMD_BCNI_TUNIT/2)
-                                       - BCN_INTV_osticks);
-                LMIC.bcninfo.flags = 0;  // txtime above cannot be used as reference (BCN_PARTIAL|BCN_FULL cleared)
-                calcBcnRxWindowFromMillis(MCMD_BCNI_TUNIT,1);  // error of +/-N ms 
-
-                EV(lostFrame, INFO, (e_.reason  = EV::lostFrame_t::MCMD_BCNI_ANS,
-                                     e_.eui     = MAIN::CDEV->getEui(),
-                                     e_.lostmic = Base::lsbf4(&d[pend]),
-                                     e_.info    = (LMIC.missedBcns |
-                                                   (osticks2us(LMIC.bcninfo.txtime + BCN_INTV_osticks
-                                                               - LMIC.bcnRxtime) << 8)),
-                                     e_.time    = MAIN::CDEV->ostime2ustime(LMIC.bcninfo.txtime + BCN_INTV_osticks)));
-            }
-            oidx += 4;
-            continue;
-        }
-        }
-        EV(specCond, ERR, (e_.reason = EV::specCond_t::BAD_MAC_CMD,
-                           e_.eui    = MAIN::CDEV->getEui(),
-                           e_.info   = Base::lsbf4(&d[pend]),
-                           e_.info2  = Base::msbf4(&opts[oidx])));
-        break;
+        MCMD_DN[cid].fn(&opts[oidx]);
+        oidx += MCMD_DN[cid].len;
     }
     if( oidx != olen ) {
         EV(specCond, ERR, (e_.reason = EV::specCond_t::CORRUPTED_FRAME,
@@ -1207,11 +1435,11 @@ static bit_t decodeFrame (void) {
     }
 
     if( !replayConf ) {
-        // Handle payload only if not a replay
-        // Decrypt payload - if any
-        if( port >= 0  &&  pend-poff > 0 )
-            aes_cipher(port <= 0 ? LMIC.nwkKey : LMIC.artKey, LMIC.devaddr, seqno, /*dn*/1, d+poff, pend-poff);
-
+        // Handle payload only if not a replay (already decrypted with MIC check)
+#if defined(CFG_frag)
+        if( port == FRAG_PORT )
+            frag_rx(d+poff, pend-poff);
+#endif
         EV(dfinfo, DEBUG, (e_.deveui  = MAIN::CDEV->getEui(),
                            e_.devaddr = LMIC.devaddr,
                            e_.seqno   = seqno,
@@ -1262,39 +1490,145 @@ static bit_t decodeFrame (void) {
 // TX/RX transaction support
 
 
+#if defined(CFG_rxcal)
+static void rxestAdd (rxest_t* e, ostime_t s) {
+    if( e->n == 0 ) {
+        e->mean8 = s*8;
+        e->dev4  = (s < 0 ? -s : s)*2;  // dev = |s|/2
+    } else {
+        s4_t err = s - e->mean8/8;
+        e->mean8 += err;
+        e->dev4  += (err < 0 ? -err : err) - e->dev4/4;
+    }
+    if( e->n != 0xFFFF )
+        e->n++;
+}
+
+// Window for a DN preamble starting delay after the true end of TX: the
+// TXDONE IRQ latency is taken off txend, the window is widened by k
+// deviations of the TX/DN timing each side, and the RX job is started
+// early enough for the learned wake-up/setup time. Returns that ramp-up.
+static ostime_t rxcalWindow (ostime_t delay, dr_t dr) {
+    rxcal_t* c = &LMIC.rxcal;
+    ostime_t hsym = dr2hsym(dr);
+    ostime_t off = 0, err = 0, ramp = RX_RAMPUP;
+    c->expect = LMIC.txend - c->txirq.mean8/8 + delay;
+    if( c->k != 0 ) {
+        off = c->dnoff.mean8/8 - c->txirq.mean8/8;
+        err = c->k * (c->txirq.dev4 + c->dnoff.dev4) / 4;
+        if( err > (MAX_RXSYMS-MINRX_SYMS)*hsym )
+            err = (MAX_RXSYMS-MINRX_SYMS)*hsym;
+        if( c->wake.n != 0 ) {
+            ramp = c->wake.mean8/8 + c->k * c->wake.dev4/4 + RXCAL_RAMPUP_MIN;
+            ramp = ramp > RXCAL_RAMPUP_MAX ? RXCAL_RAMPUP_MAX : ramp;
+        }
+    }
+    // Add 1.5 symbols we need 5 out of 8, plus err each side
+    LMIC.rxtime = LMIC.txend + delay + off + (PAMBL_SYMS-MINRX_SYMS)*hsym - err;
+    LMIC.rxsyms = MINRX_SYMS + err/hsym;
+    c->job = LMIC.rxtime - ramp;
+    return ramp;
+}
+
+// RX window set up (radio.c stamped rxcal.ready)
+static void rxcalOpened (void) {
+    rxcal_t* c = &LMIC.rxcal;
+    rxestAdd(&c->wake, c->ready - c->job);
+    c->windows++;
+    if( os_timeDiff(c->ready, LMIC.rxtime) > 0 )
+        c->late++;
+}
+#endif
+
+
 static void setupRx2 (void) {
     LMIC.txrxFlags = TXRX_DNW2;
     LMIC.rps = dndr2rps(LMIC.dn2Dr);
     LMIC.freq = LMIC.dn2Freq;
     LMIC.dataLen = 0;
     os_radio(RADIO_RX);
+#if defined(CFG_rxcal)
+    rxcalOpened();
+#endif
 }
 
 
 static void schedRx2 (ostime_t delay, osjobcb_t func) {
+#if defined(CFG_rxcal)
+    ostime_t ramp = rxcalWindow(delay, LMIC.dn2Dr);
+#else
     // Add 1.5 symbols we need 5 out of 8. Try to sync 1.5 symbols into the preamble.
     LMIC.rxtime = LMIC.txend + delay + (PAMBL_SYMS-MINRX_SYMS)*dr2hsym(LMIC.dn2Dr);
-    os_setTimedCallback(&LMIC.osjob, LMIC.rxtime - RX_RAMPUP, func);
+    ostime_t ramp = RX_RAMPUP;
+#endif
+    os_setTimedCallback(&LMIC.osjob, LMIC.rxtime - ramp, func);
 }
 
 static void setupRx1 (osjobcb_t func) {
     LMIC.txrxFlags = TXRX_DNW1;
     // Turn LMIC.rps from TX over to RX
-    LMIC.rps = setNocrc(LMIC.rps,1);
+    LMIC.freq = LMIC.rx1Freq;
+    LMIC.rps = setNocrc(LMIC.rx1Rps,1);
     LMIC.dataLen = 0;
     LMIC.osjob.func = func;
     os_radio(RADIO_RX);
+#if defined(CFG_rxcal)
+    rxcalOpened();
+#endif
+}
+
+
+// Class C listens on the RX2 channel (not possible with FSK, no continuous RX there)
+static bit_t rxcEnabled (void) {
+    return (LMIC.opmode & OP_CLASSC) != 0 && getSf(dndr2rps(LMIC.dn2Dr)) != FSK;
+}
+
+// Radio not needed otherwise: joined, no TX/RX transaction, scan or beacon tracking
+static bit_t rxcIdle (void) {
+    return rxcEnabled() && LMIC.devaddr != 0 &&
+        (LMIC.opmode & (OP_SCAN|OP_TRACK|OP_JOINING|OP_TXRXPEND|OP_SHUTDOWN)) == 0;
+}
+
+static void processRxC (xref2osjob_t osjob);
+
+// Park the radio in continuous RX on dn2Freq/dn2Dr until the next os_radio() request
+static void rxcListen (void) {
+    LMIC.freq = LMIC.dn2Freq;
+    LMIC.rps = dndr2rps(LMIC.dn2Dr);
+    if( radio_rxcActive(LMIC.freq, LMIC.rps) )
+        return; // restarting would abort a frame on air and drop one not yet processed
+    LMIC.dataLen = 0;
+    LMIC.rxcJob.func = FUNC_ADDR(processRxC);
+    os_radio(RADIO_RXC);
+}
+
+// Class C data uplinks: also listen on RX2 between TX end and RX1
+static void rxcUntilRx1 (void) {
+    if( rxcEnabled() && (LMIC.opmode & (OP_JOINING|OP_REJOIN)) == 0 )
+        rxcListen();
+}
+
+// Leave continuous RX and drop a frame not yet processed (LMIC.frame is reused)
+static void rxcStop (void) {
+    os_clearCallback(&LMIC.rxcJob);
+    os_radio(RADIO_RST);
 }
 
 
 // Called by HAL once TX complete and delivers exact end of TX time stamp in LMIC.rxtime
 static void txDone (ostime_t delay, osjobcb_t func) {
+#if defined(CFG_rxcal)
+    // LMIC.rps/dataLen still describe the frame sent
+    rxestAdd(&LMIC.rxcal.txirq, LMIC.txend - LMIC.rxcal.txbeg - calcAirTime(LMIC.rps, LMIC.dataLen));
+#endif
     if( (LMIC.opmode & (OP_TRACK|OP_PINGABLE|OP_PINGINI)) == (OP_TRACK|OP_PINGABLE) ) {
         rxschedInit(&LMIC.ping);    // note: reuses LMIC.frame buffer!
         LMIC.opmode |= OP_PINGINI;
     }
     // Change RX frequency / rps (US only) before we increment txChnl
     setRx1Params();
+    LMIC.rx1Freq = LMIC.freq;
+    LMIC.rx1Rps = LMIC.rps;
     // LMIC.rxsyms carries the TX datarate (can be != LMIC.datarate [confirm retries etc.])
     // Setup receive - LMIC.rxtime is preloaded with 1.5 symbols offset to tune
     // into the middle of the 8 symbols preamble.
@@ -1306,10 +1640,18 @@ static void txDone (ostime_t delay, osjobcb_t func) {
     else
 #endif
     {
+#if defined(CFG_rxcal)
+        ostime_t ramp = rxcalWindow(delay, LMIC.dndr);
+        os_setTimedCallback(&LMIC.osjob, LMIC.rxtime - ramp, func);
+        rxcUntilRx1();
+        return;
+#else
         LMIC.rxtime = LMIC.txend + delay + (PAMBL_SYMS-MINRX_SYMS)*dr2hsym(LMIC.dndr);
         LMIC.rxsyms = MINRX_SYMS;
+#endif
     }
     os_setTimedCallback(&LMIC.osjob, LMIC.rxtime - RX_RAMPUP, func);
+    rxcUntilRx1();
 }
 
 
@@ -1479,9 +1821,25 @@ static void setupRx2DnData (xref2osjob_t osjob) {
 }
 
 
+// Class C: RX2 is covered by continuous RX, its end only marks that nothing came
+static void processRx2DnDataC (xref2osjob_t osjob) {
+    LMIC.dataLen = 0;
+    LMIC.rxtime = os_getTime();
+    processRx2DnData(osjob);
+}
+
+
 static void processRx1DnData (xref2osjob_t osjob) {
-    if( LMIC.dataLen == 0 || !processDnData() )
-        schedRx2(DELAY_DNW2_osticks, FUNC_ADDR(setupRx2DnData));
+    if( LMIC.dataLen == 0 || !processDnData() ) {
+        if( rxcEnabled() ) {
+            rxcListen();
+            os_setTimedCallback(&LMIC.osjob,
+                                LMIC.txend + DELAY_DNW2_osticks + 2*PAMBL_SYMS*dr2hsym(LMIC.dn2Dr),
+                                FUNC_ADDR(processRx2DnDataC));
+        } else {
+            schedRx2(DELAY_DNW2_osticks, FUNC_ADDR(setupRx2DnData));
+        }
+    }
 }
 
 
@@ -1501,8 +1859,7 @@ static void buildDataFrame (void) {
     bit_t txdata = ((LMIC.opmode & (OP_TXDATA|OP_POLL)) != OP_POLL);
     u1_t dlen = txdata ? LMIC.pendTxLen : 0;
 
-    // Piggyback MAC options
-    // Prioritize by importance
+    // Piggyback MAC options: requests, then answers collected by decodeFrame
     int  end = OFF_DAT_OPTS;
     if( (LMIC.opmode & (OP_TRACK|OP_PINGABLE)) == (OP_TRACK|OP_PINGABLE) ) {
         // Indicate pingability in every UP frame
@@ -1510,52 +1867,19 @@ static void buildDataFrame (void) {
         LMIC.frame[end+1] = LMIC.ping.dr | (LMIC.ping.intvExp<<4);
         end += 2;
     }
-    if( LMIC.dutyCapAns ) {
-        LMIC.frame[end] = MCMD_DCAP_ANS;
-        end += 1;
-        LMIC.dutyCapAns = 0;
-    }
-    if( LMIC.dn2Ans ) {
-        LMIC.frame[end+0] = MCMD_DN2P_ANS;
-        LMIC.frame[end+1] = LMIC.dn2Ans & ~MCMD_DN2P_ANS_RFU;
-        end += 2;
-        LMIC.dn2Ans = 0;
-    }
-    if( LMIC.devsAns ) {  // answer to device status
-        LMIC.frame[end+0] = MCMD_DEVS_ANS;
-        LMIC.frame[end+1] = LMIC.margin;
-        LMIC.frame[end+2] = os_getBattLevel();
-        end += 3;
-        LMIC.devsAns = 0;
-    }
-    if( LMIC.ladrAns ) {  // answer to ADR change
-        LMIC.frame[end+0] = MCMD_LADR_ANS;
-        LMIC.frame[end+1] = LMIC.ladrAns & ~MCMD_LADR_ANS_RFU;
-        end += 2;
-        LMIC.ladrAns = 0;
-    }
     if( LMIC.bcninfoTries > 0 ) {
         LMIC.frame[end] = MCMD_BCNI_REQ;
         end += 1;
     }
+    os_copyMem(LMIC.frame+end, LMIC.pendOpts, LMIC.pendOptsLen);
+    end += LMIC.pendOptsLen;
+    LMIC.pendOptsLen = 0;
     if( LMIC.adrChanged ) {
         if( LMIC.adrAckReq < 0 )
             LMIC.adrAckReq = 0;
         LMIC.adrChanged = 0;
     }
-    if( LMIC.pingSetAns != 0 ) {
-        LMIC.frame[end+0] = MCMD_PING_ANS;
-        LMIC.frame[end+1] = LMIC.pingSetAns & ~MCMD_PING_ANS_RFU;
-        end += 2;
-        LMIC.pingSetAns = 0;
-    }
-    if( LMIC.snchAns ) {
-        LMIC.frame[end+0] = MCMD_SNCH_ANS;
-        LMIC.frame[end+1] = LMIC.snchAns & ~MCMD_SNCH_ANS_RFU;
-        end += 2;
-        LMIC.snchAns = 0;
-    }
-    ASSERT(end <= OFF_DAT_OPTS+16);
+    ASSERT(end <= OFF_DAT_OPTS+MAX_LEN_FOPTS);
 
     u1_t flen = end + (txdata ? 5+dlen : 4);
     if( flen > MAX_LEN_FRAME ) {
@@ -1592,15 +1916,18 @@ static void buildDataFrame (void) {
             if( LMIC.txCnt == 0 ) LMIC.txCnt = 1;
         }
         LMIC.frame[end] = LMIC.pendTxPort;
-        os_copyMem(LMIC.frame+end+1, LMIC.pendTxData, dlen);
-        if (LMIC.pendTxPort != 223) {  // port 223 unencrypted for testing (TT)
-          aes_cipher(LMIC.pendTxPort==0 ? LMIC.nwkKey : LMIC.artKey,
-                     LMIC.devaddr, LMIC.seqnoUp-1,
-                     /*up*/0, LMIC.frame+end+1, dlen);
-        }
-
+        if( LMIC.pendTxNfrags == 0 )
+            os_copyMem(LMIC.frame+end+1, LMIC.pendTxData, dlen);
+    }
+    // Encrypt payload (port 223 unencrypted for testing (TT)) and append MIC in one pass
+    xref2cu1_t ckey = !txdata || LMIC.pendTxPort == 223 ? NULL
+        : LMIC.pendTxPort == 0 ? LMIC.nwkKey : LMIC.artKey;
+    if( txdata && LMIC.pendTxNfrags != 0 ) {
+        // Application fragments are copied into the frame by the cipher pass
+        aes_gatherCipherAppendMic(ckey, LMIC.nwkKey, LMIC.devaddr, LMIC.seqnoUp-1, /*up*/0, LMIC.frame, end+1, flen-4, LMIC.pendTxFrags);
+    } else {
+        aes_cipherAppendMic(ckey, LMIC.nwkKey, LMIC.devaddr, LMIC.seqnoUp-1, /*up*/0, LMIC.frame, end+1, flen-4);
     }
-    aes_appendMic(LMIC.nwkKey, LMIC.devaddr, LMIC.seqnoUp-1, /*up*/0, LMIC.frame, flen-4);
 
     EV(dfinfo, DEBUG, (e_.deveui  = MAIN::CDEV->getEui(),
                        e_.devaddr = LMIC.devaddr,
@@ -1736,6 +2063,108 @@ bit_t LMIC_startJoining (void) {
 }
 
 
+// ================================================================================
+//
+// Device side ADR
+//
+// ================================================================================
+
+#define DEVADR_MISS ((s2_t)0x8000)
+
+static void devAdrRecord (s2_t v) {
+    LMIC.devAdrHist[LMIC.devAdrIdx] = v;
+    if( ++LMIC.devAdrIdx == DEVADR_HIST )
+        LMIC.devAdrIdx = 0;
+    if( LMIC.devAdrCnt < DEVADR_HIST )
+        LMIC.devAdrCnt++;
+}
+
+// Link margin in dB at given DR/txpow over the given path loss: the uplink above the
+// sensitivity of the DR and above its demodulation SNR at the gateway noise floor,
+// and the RX1 DN frame (ACK) at the gateway EIRP above its sensitivity
+static int devAdrLinkMargin (dr_t dr, int pow, s2_t loss) {
+    rps_t rps = updr2rps(dr);
+    int m = pow - loss - getSensitivity(rps);
+    int s = ((pow - loss - DEVADR_NOISE) * SNR_SCALEUP - SNR_FLOOR[getSf(rps)]) / SNR_SCALEUP;
+    int d = LMIC.devAdrEirp - loss - getSensitivity(dndr2rps(rx1DR(dr)));
+    if( s < m )
+        m = s;
+    return d < m ? d : m;
+}
+
+// TX power needed at given DR to keep the configured margin (> DEVADR_POWMAX if unreachable)
+static int devAdrPow (dr_t dr, s2_t loss) {
+    int pow = DEVADR_POWMIN;
+    while( devAdrLinkMargin(dr, pow, loss) < LMIC.devAdrMargin && pow <= DEVADR_POWMAX )
+        pow += DEVADR_POWSTEP;
+    return pow;
+}
+
+// Called once per TX-RX transaction with final txrxFlags.
+// Each DN frame yields the path loss from the gateway EIRP to the signal received:
+// RSSI, less the SNR when negative (packet RSSI then reads the noise, not the signal).
+// The fastest DR / lowest power keeping the uplink margin over the mean loss in the
+// window is selected (the margin covers fading). Repeated NACKs fall back like DRCHG_NOACK and restart learning.
+static void devAdrUpdate (void) {
+    if( LMIC.devAdrMargin == 0 )
+        return;
+    if( (LMIC.txrxFlags & TXRX_NACK) != 0 ) {
+        devAdrRecord(DEVADR_MISS);
+    }
+    else if( (LMIC.txrxFlags & (TXRX_DNW1|TXRX_DNW2)) != 0 && getSf(LMIC.rps) != FSK ) {
+        int sig = LMIC.rssi - RSSI_OFF + (LMIC.snr < 0 ? LMIC.snr / SNR_SCALEUP : 0);
+        devAdrRecord((s2_t)(LMIC.devAdrEirp - sig));
+    }
+    else {
+        return;  // nothing learned from this transaction
+    }
+
+    // Scan window newest first: mean loss, NACK count and NACKs since last DN frame
+    int sum = 0;
+    u1_t misses = 0, trail = 0;
+    for( u1_t i=0; i<LMIC.devAdrCnt; i++ ) {
+        s2_t v = LMIC.devAdrHist[(LMIC.devAdrIdx + DEVADR_HIST-1 - i) % DEVADR_HIST];
+        if( v == DEVADR_MISS ) {
+            if( misses++ == i )
+                trail++;
+        } else {
+            sum += v;
+        }
+    }
+    if( trail >= DEVADR_NOACK_LIMIT ) {
+        // Max power first, then lower DR
+        if( LMIC.adrTxPow < DEVADR_POWMAX )
+            setDrTxpow(DRCHG_NOACK, LMIC.datarate, DEVADR_POWMAX);
+        else
+            setDrTxpow(DRCHG_NOACK, decDR((dr_t)LMIC.datarate), KEEP_TXPOW);
+        LMIC.devAdrCnt = LMIC.devAdrIdx = 0;
+        return;
+    }
+    if( misses != 0 || LMIC.devAdrCnt < DEVADR_MINSAMPLES )
+        return;
+
+    s2_t loss = (s2_t)((sum + LMIC.devAdrCnt/2) / LMIC.devAdrCnt);
+    dr_t dr = DEVADR_MAXDR;
+    int pow;
+    while( (pow = devAdrPow(dr, loss)) > DEVADR_POWMAX ) {
+        dr_t lower = decDR(dr);
+        if( lower == dr ) {
+            pow = DEVADR_POWMAX;
+            break;
+        }
+        dr = lower;
+    }
+    // Speed up one DR at a time - slow down right away
+    if( isFasterDR(dr, LMIC.datarate) && dr != incDR((dr_t)LMIC.datarate) ) {
+        dr = incDR((dr_t)LMIC.datarate);
+        if( (pow = devAdrPow(dr, loss)) > DEVADR_POWMAX )
+            pow = DEVADR_POWMAX;
+    }
+    if( dr != LMIC.datarate || pow != LMIC.adrTxPow )
+        setDrTxpow(DRCHG_SET, dr, (s1_t)pow);
+}
+
+
 // ================================================================================
 //
 //
@@ -1755,6 +2184,44 @@ static void processPingRx (xref2osjob_t osjob) {
 }
 
 
+// End of a TX/RX transaction (with final txrxFlags)
+static void txrxComplete (void) {
+    LMIC.opmode &= ~(OP_TXDATA|OP_TXRXPEND);
+    devAdrUpdate();
+    if( (LMIC.txrxFlags & (TXRX_DNW1|TXRX_DNW2|TXRX_PING)) != 0  &&  (LMIC.opmode & OP_LINKDEAD) != 0 ) {
+        LMIC.opmode &= ~OP_LINKDEAD;
+        reportEvent(EV_LINK_ALIVE);
+    }
+#if defined(CFG_energy)
+    energy_uplink();
+#endif
+    reportEvent(EV_TXCOMPLETE);
+    // If we haven't heard from NWK in a while although we asked for a sign
+    // assume link is dead - notify application and keep going
+    if( LMIC.adrAckReq > LINK_CHECK_DEAD ) {
+        // We haven't heard from NWK for some time although we
+        // asked for a response for some time - assume we're disconnected. Lower DR one notch.
+        EV(devCond, ERR, (e_.reason = EV::devCond_t::LINK_DEAD,
+                          e_.eui    = MAIN::CDEV->getEui(),
+                          e_.info   = LMIC.adrAckReq));
+        setDrTxpow(DRCHG_NOADRACK, decDR((dr_t)LMIC.datarate), KEEP_TXPOW);
+        LMIC.adrAckReq = LINK_CHECK_CONT;
+        LMIC.opmode |= OP_REJOIN|OP_LINKDEAD;
+        reportEvent(EV_LINK_DEAD);
+    }
+    // If this falls to zero the NWK did not answer our MCMD_BCNI_REQ commands - try full scan
+    if( LMIC.bcninfoTries > 0 ) {
+        if( (LMIC.opmode & OP_TRACK) != 0 ) {
+            reportEvent(EV_BEACON_FOUND);
+            LMIC.bcninfoTries = 0;
+        }
+        else if( --LMIC.bcninfoTries == 0 ) {
+            startScan();   // NWK did not answer - try scan
+        }
+    }
+}
+
+
 static bit_t processDnData (void) {
     ASSERT((LMIC.opmode & OP_TXRXPEND)!=0);
 
@@ -1777,45 +2244,44 @@ static bit_t processDnData (void) {
         }
         if( LMIC.adrAckReq != LINK_CHECK_OFF )
             LMIC.adrAckReq += 1;
-        LMIC.dataBeg = LMIC.dataLen = 0;
-      txcomplete:
-        LMIC.opmode &= ~(OP_TXDATA|OP_TXRXPEND);
-        if( (LMIC.txrxFlags & (TXRX_DNW1|TXRX_DNW2|TXRX_PING)) != 0  &&  (LMIC.opmode & OP_LINKDEAD) != 0 ) {
-            LMIC.opmode &= ~OP_LINKDEAD;
-            reportEvent(EV_LINK_ALIVE);
-        }
-        reportEvent(EV_TXCOMPLETE);
-        // If we haven't heard from NWK in a while although we asked for a sign
-        // assume link is dead - notify application and keep going
-        if( LMIC.adrAckReq > LINK_CHECK_DEAD ) {
-            // We haven't heard from NWK for some time although we
-            // asked for a response for some time - assume we're disconnected. Lower DR one notch.
-            EV(devCond, ERR, (e_.reason = EV::devCond_t::LINK_DEAD,
-                              e_.eui    = MAIN::CDEV->getEui(),
-                              e_.info   = LMIC.adrAckReq));
-            setDrTxpow(DRCHG_NOADRACK, decDR((dr_t)LMIC.datarate), KEEP_TXPOW);
-            LMIC.adrAckReq = LINK_CHECK_CONT;
-            LMIC.opmode |= OP_REJOIN|OP_LINKDEAD;
-            reportEvent(EV_LINK_DEAD);
-        }
-        // If this falls to zero the NWK did not answer our MCMD_BCNI_REQ commands - try full scan
-        if( LMIC.bcninfoTries > 0 ) {
-            if( (LMIC.opmode & OP_TRACK) != 0 ) {
-                reportEvent(EV_BEACON_FOUND);
-                LMIC.bcninfoTries = 0;
-            }
-            else if( --LMIC.bcninfoTries == 0 ) {
-                startScan();   // NWK did not answer - try scan
-            }
-        }
+        LMIC.dataBeg = LMIC.dataLen = LMIC.dataMcast = 0;
+        txrxComplete();
         return 1;
     }
+#if defined(CFG_rxcal)
+    // preamble start: RXDONE time stamp less its IRQ latency and the air time
+    ostime_t start = LMIC.rxtime - LMIC.rxcal.txirq.mean8/8 - calcAirTime(LMIC.rps, LMIC.dataLen);
+#endif
     if( !decodeFrame() ) {
         if( (LMIC.txrxFlags & TXRX_DNW1) != 0 )
             return 0;
         goto norx;
     }
-    goto txcomplete;
+#if defined(CFG_rxcal)
+    if( (LMIC.txrxFlags & (TXRX_DNW1|TXRX_DNW2)) != 0 )
+        rxestAdd(&LMIC.rxcal.dnoff, start - LMIC.rxcal.expect);
+#endif
+    txrxComplete();
+    return 1;
+}
+
+
+// Frame received in class C continuous RX - the radio keeps listening
+static void processRxC (xref2osjob_t osjob) {
+    if( !rxcEnabled() || (LMIC.opmode & (OP_SCAN|OP_TRACK|OP_JOINING|OP_SHUTDOWN)) != 0 )
+        return;
+    LMIC.txrxFlags = TXRX_CLASSC;
+    if( !decodeFrame() )
+        return; // e.g. another device's downlink
+    if( (LMIC.opmode & OP_TXRXPEND) != 0 && LMIC.dataMcast == 0 &&
+        LMIC.osjob.func == FUNC_ADDR(processRx2DnDataC) ) {
+        // answer to the uplink after RX1: drop the RX2 end/safety zone job
+        LMIC.txrxFlags ^= TXRX_CLASSC|TXRX_DNW2;
+        os_clearCallback(&LMIC.osjob);
+        txrxComplete();
+        return;
+    }
+    reportEvent(EV_RXCOMPLETE);
 }
 
 
@@ -1925,12 +2391,12 @@ static void engineUpdate (void) {
             txbeg = LMIC.txend;
         }
         // Delayed TX or waiting for duty cycle?
-        if( (LMIC.globalDutyRate != 0 || (LMIC.opmode & OP_RNDTX) != 0)  &&  (txbeg - LMIC.globalDutyAvail) < 0 )
+        if( (LMIC.globalDutyRate != 0 || (LMIC.opmode & OP_RNDTX) != 0)  &&  os_timeDiff(txbeg, LMIC.globalDutyAvail) < 0 )
             txbeg = LMIC.globalDutyAvail;
         // If we're tracking a beacon...
         // then make sure TX-RX transaction is complete before beacon
         if( (LMIC.opmode & OP_TRACK) != 0 &&
-            txbeg + (jacc ? JOIN_GUARD_osticks : TXRX_GUARD_osticks) - rxtime > 0 ) {
+            os_timeDiff(txbeg + (jacc ? JOIN_GUARD_osticks : TXRX_GUARD_osticks), rxtime) > 0 ) {
             // Not enough time to complete TX-RX before beacon - postpone after beacon.
             // In order to avoid clustering of postponed TX right after beacon randomize start!
             txDelay(rxtime + BCN_RESERVE_osticks, 16);
@@ -1938,9 +2404,11 @@ static void engineUpdate (void) {
             goto checkrx;
         }
         // Earliest possible time vs overhead to setup radio
-        if( txbeg - (now + TX_RAMPUP) < 0 ) {
+        if( os_timeDiff(txbeg, now + TX_RAMPUP) < 0 ) {
             // We could send right now!
         txbeg = now;
+            if( rxcEnabled() )
+                rxcStop();
             dr_t txdr = (dr_t)LMIC.datarate;
             if( jacc ) {
                 u1_t ftype;
@@ -1992,8 +2460,11 @@ static void engineUpdate (void) {
             txbeg += 1;  // TX delayed by one tick (insignificant amount of time)
     } else {
         // No TX pending - no scheduled RX
-        if( (LMIC.opmode & OP_TRACK) == 0 )
+        if( (LMIC.opmode & OP_TRACK) == 0 ) {
+            if( rxcIdle() )
+                rxcListen();
             return;
+        }
     }
 
     // Are we pingable?
@@ -2001,27 +2472,27 @@ static void engineUpdate (void) {
     if( (LMIC.opmode & OP_PINGINI) != 0 ) {
         // One more RX slot in this beacon period?
         if( rxschedNext(&LMIC.ping, now+RX_RAMPUP) ) {
-            if( txbeg != 0  &&  (txbeg - LMIC.ping.rxtime) < 0 )
+            if( txbeg != 0  &&  os_timeDiff(txbeg, LMIC.ping.rxtime) < 0 )
                 goto txdelay;
             LMIC.rxsyms  = LMIC.ping.rxsyms;
             LMIC.rxtime  = LMIC.ping.rxtime;
             LMIC.freq    = LMIC.ping.freq;
             LMIC.rps     = dndr2rps(LMIC.ping.dr);
             LMIC.dataLen = 0;
-            ASSERT(LMIC.rxtime - now+RX_RAMPUP >= 0 );
+            ASSERT(os_timeDiff(LMIC.rxtime, now) + RX_RAMPUP >= 0 );
             os_setTimedCallback(&LMIC.osjob, LMIC.rxtime - RX_RAMPUP, FUNC_ADDR(startRxPing));
             return;
         }
         // no - just wait for the beacon
     }
 
-    if( txbeg != 0  &&  (txbeg - rxtime) < 0 )
+    if( txbeg != 0  &&  os_timeDiff(txbeg, rxtime) < 0 )
         goto txdelay;
 
     setBcnRxParams();
     LMIC.rxsyms = LMIC.bcnRxsyms;
     LMIC.rxtime = LMIC.bcnRxtime;
-    if( now - rxtime >= 0 ) {
+    if( os_timeDiff(now, rxtime) >= 0 ) {
         LMIC.osjob.func = FUNC_ADDR(processBeacon);
         os_radio(RADIO_RX);
         return;
@@ -2035,11 +2506,30 @@ static void engineUpdate (void) {
                        e_.info   = osticks2ms(txbeg-now),
                        e_.info2  = LMIC.seqnoUp-1));
     os_setTimedCallback(&LMIC.osjob, txbeg-TX_RAMPUP, FUNC_ADDR(runEngineUpdate));
+    if( rxcIdle() )
+        rxcListen();
 }
 
 
 void LMIC_setAdrMode (bit_t enabled) {
     LMIC.adrEnabled = enabled ? FCT_ADREN : 0;
+    if( enabled )
+        LMIC.devAdrMargin = 0;  // NWK controls DR/txpow
+}
+
+
+// Let the device pick DR/txpow from its own DN frame history, keeping margin dB
+// above sensitivity. The path loss is taken against eirp, the gateway's DN power
+// (EIRP_DN if unknown). Turns off NWK driven ADR. A margin of 0 disables the policy.
+void LMIC_setDevAdr (u1_t margin, s1_t eirp) {
+    LMIC.devAdrMargin = margin;
+    LMIC.devAdrEirp = eirp;
+    LMIC.devAdrCnt = LMIC.devAdrIdx = 0;
+    if( margin == 0 )
+        return;
+    LMIC.adrEnabled = 0;
+    if( LMIC.adrTxPow < DEVADR_POWMIN )
+        LMIC.adrTxPow = DEVADR_POWMAX;
 }
 
 
@@ -2051,17 +2541,47 @@ void LMIC_setDrTxpow (dr_t dr, s1_t txpow) {
 
 void LMIC_shutdown (void) {
     os_clearCallback(&LMIC.osjob);
+    os_clearCallback(&LMIC.rxcJob);
     os_radio(RADIO_RST);
     LMIC.opmode |= OP_SHUTDOWN;
 }
 
 
+// Class C: keep the radio in continuous RX on the RX2 channel (dn2Freq/dn2Dr)
+// except while it transmits or has RX1 open. Frames other than the answer to
+// an uplink are reported with EV_RXCOMPLETE and TXRX_CLASSC.
+void LMIC_setClassC (bit_t enabled) {
+    if( enabled ) {
+        LMIC.opmode |= OP_CLASSC;
+        if( rxcIdle() )
+            rxcListen();
+    } else {
+        if( rxcIdle() )
+            rxcStop();
+        os_clearCallback(&LMIC.rxcJob);
+        LMIC.opmode &= ~OP_CLASSC;
+    }
+}
+
+
+void LMIC_startGateway (u4_t freq, rps_t rps, osjobcb_t rxfunc) {
+    os_clearCallback(&LMIC.osjob);
+    LMIC.opmode |= OP_SHUTDOWN; // MAC stays idle while forwarding
+    LMIC.freq = freq;
+    LMIC.rps  = setNocrc(rps, 0); // uplinks carry a payload CRC
+    LMIC.rxsyms = 0;
+    LMIC.osjob.func = rxfunc;
+    os_radio(RADIO_RXGW);
+}
+
+
 void LMIC_reset (void) {
     EV(devCond, INFO, (e_.reason = EV::devCond_t::LMIC_EV,
                        e_.eui    = MAIN::CDEV->getEui(),
                        e_.info   = EV_RESET));
     os_radio(RADIO_RST);
     os_clearCallback(&LMIC.osjob);
+    os_clearCallback(&LMIC.rxcJob);
 
     os_clearMem((xref2u1_t)&LMIC,SIZEOFEXPR(LMIC));
     LMIC.devaddr      =  0;
@@ -2074,6 +2594,10 @@ void LMIC_reset (void) {
     LMIC.ping.freq    =  FREQ_PING; // defaults for ping
     LMIC.ping.dr      =  DR_PING;   // ditto
     LMIC.ping.intvExp =  0xFF;
+    LMIC.dutySlotBeg  =  os_getTime();
+#if defined(CFG_rxcal)
+    LMIC.rxcal.k      =  RXCAL_K;
+#endif
 #if defined(CFG_us915)
     initDefaultChannels();
 #endif
@@ -2089,12 +2613,105 @@ void LMIC_reset (void) {
 
 void LMIC_init (void) {
     LMIC.opmode = OP_SHUTDOWN;
+    initAirTime();
+}
+
+
+ostime_t LMIC_airtimeFor (dr_t dr, u1_t plen) {
+    if( dr >= DR_NONE || !validDR(dr) || upFrameLen(plen) > upFrameMax(dr) )
+        return 0;
+    return AIRTIME_osticks[dr][upFrameLen(plen)];
+}
+
+
+u2_t LMIC_dutyUtilization (u1_t ledger) {
+    if( ledger >= DUTY_LEDGERS )
+        return 0;
+    dutyledger_t* l = &LMIC.dutyLedger[ledger];
+    u4_t sn = dutySlotOf(os_getTime());
+    u8_t sum = 0;
+    for( u1_t si=0; si<DUTY_SLOTS; si++ ) {
+        if( sn - l->slot[si] < DUTY_SLOTS )
+            sum += l->airtime[si];
+    }
+    return sum * 10000 / ((u8_t)DUTY_SLOTS * DUTY_SLOT_osticks);
+}
+
+
+ostime_t LMIC_nextTxTime (u1_t plen, dr_t dr) {
+    ostime_t now = os_getTime();
+    ostime_t never = now + /*10h*/36000*OSTICKS_PER_SEC;
+    if( LMIC_airtimeFor(dr, plen) == 0 )
+        return never;
+    // a running TX/RX transaction ends with the RX2 window at the earliest
+    ostime_t t = now;
+    if( (LMIC.opmode & OP_TXRXPEND) != 0 && os_timeDiff(LMIC.txend + DELAY_DNW2_osticks, t) > 0 )
+        t = LMIC.txend + DELAY_DNW2_osticks;
+#if defined(CFG_eu868)
+    // earliest band with an enabled channel supporting dr
+    ostime_t avail = never;
+    for( u1_t chnl=0; chnl<MAX_CHANNELS; chnl++ ) {
+        if( (LMIC.channelMap & (1<<chnl)) != 0  &&
+            (LMIC.channelDrMap[chnl] & (1<<(dr&0xF))) != 0  &&
+            os_timeDiff(avail, LMIC.bands[LMIC.channelFreq[chnl] & 0x3].avail) > 0 )
+            avail = LMIC.bands[LMIC.channelFreq[chnl] & 0x3].avail;
+    }
+    if( os_timeDiff(avail, t) > 0 )
+        t = avail;
+#endif
+    if( (LMIC.globalDutyRate != 0 || (LMIC.opmode & OP_RNDTX) != 0)  &&  os_timeDiff(LMIC.globalDutyAvail, t) > 0 )
+        t = LMIC.globalDutyAvail;
+    return t;
+}
+
+
+int LMIC_maxPayloadWithin (ostime_t budget) {
+    dr_t dr = LMIC.datarate;
+    if( dr >= DR_NONE || upFrameMax(dr) < upFrameLen(0) || AIRTIME_osticks[dr][upFrameLen(0)] > budget )
+        return -1;
+    // air time grows with length - find last payload size within budget
+    u1_t lo = 0, hi = upFrameMax(dr) - upFrameLen(0); // hi: first size not fitting a frame at dr
+    while( hi - lo > 1 ) {
+        u1_t mid = (lo + hi) / 2;
+        if( AIRTIME_osticks[dr][upFrameLen(mid)] <= budget )
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+
+#if defined(CFG_energy)
+u4_t LMIC_uplinkEnergy (void) {
+    struct energystat_t st;
+    energy_stats(&st);
+    if( st.uplinks == 0 )
+        return 0;
+    // everything but sleep belongs to some TX/RX transaction (incl. joins and retries)
+    return (st.nJ[RSTATE_STANDBY] + st.nJ[RSTATE_TX] + st.nJ[RSTATE_RX]) / st.uplinks / 1000;
 }
 
 
+u4_t LMIC_dailyEnergy (void) {
+    struct energystat_t st;
+    energy_stats(&st);
+    u8_t ticks = 0, nJ = 0;
+    for( u1_t i=0; i<RSTATE_MAX; i++ ) {
+        ticks += st.ticks[i];
+        nJ += st.nJ[i];
+    }
+    if( ticks == 0 )
+        return 0;
+    u8_t nW = nJ * OSTICKS_PER_SEC / ticks;  // average power
+    return nW * 86400 / 1000000;
+}
+#endif
+
+
 void LMIC_clrTxData (void) {
     LMIC.opmode &= ~(OP_TXDATA|OP_TXRXPEND|OP_POLL);
-    LMIC.pendTxLen = 0;
+    LMIC.pendTxLen = LMIC.pendTxNfrags = 0;
     if( (LMIC.opmode & (OP_JOINING|OP_SCAN)) != 0 ) // do not interfere with JOINING
         return;
     os_clearCallback(&LMIC.osjob);
@@ -2120,6 +2737,27 @@ int LMIC_setTxData2 (u1_t port, xref2u1_t data, u1_t dlen, u1_t confirmed) {
     LMIC.pendTxConf = confirmed;
     LMIC.pendTxPort = port;
     LMIC.pendTxLen  = dlen;
+    LMIC.pendTxNfrags = 0;
+    LMIC_setTxData();
+    return 0;
+}
+
+
+// Like LMIC_setTxData2 but the payload is gathered from frags directly into
+// the frame when it is built - nothing is staged in pendTxData. The fragment
+// array and the data it points to must stay untouched until EV_TXCOMPLETE
+// (a confirmed frame is rebuilt from them on every retry).
+int LMIC_setTxDataV (u1_t port, const txfrag_t* frags, u1_t nfrags, u1_t confirmed) {
+    uint dlen = 0;
+    for( u1_t i=0; i<nfrags; i++ )
+        dlen += frags[i].len;
+    if( dlen > SIZEOFEXPR(LMIC.pendTxData) )
+        return -2;
+    LMIC.pendTxConf = confirmed;
+    LMIC.pendTxPort = port;
+    LMIC.pendTxLen  = dlen;
+    LMIC.pendTxFrags  = frags;
+    LMIC.pendTxNfrags = nfrags;
     LMIC_setTxData();
     return 0;
 }
@@ -2188,4 +2826,41 @@ void LMIC_setLinkCheckMode (bit_t enabled) {
     LMIC.adrAckReq = enabled ? LINK_CHECK_INIT : LINK_CHECK_OFF;
 }
 
+#if defined(CFG_rxcal)
+// Set the RX window guard. The learned timing is kept, so k can be changed
+// at any time; LMIC_reset() restores RXCAL_K and forgets what was learned.
+void LMIC_setRxCal (u1_t k) {
+    LMIC.rxcal.k = k;
+}
+#endif
+
+// Join a multicast group (or update the keys/seqno of one already joined).
+// Frames to addr are accepted in class C continuous RX (no per-group ping
+// slots are scheduled for class B) and reported with EV_RXCOMPLETE and LMIC.dataMcast = 1+index into LMIC.mcast.
+// They carry no MAC commands and do not count as downlinks of this device.
+// Returns 0 if addr is 0 or all MAX_MCAST sessions are in use.
+bit_t LMIC_addMcast (devaddr_t addr, xref2u1_t nwkKey, xref2u1_t artKey, u4_t seqnoDn) {
+    u1_t mc = mcastFind(addr);
+    if( mc == 0 ) {
+        for( mc = 1; mc <= MAX_MCAST && LMIC.mcast[mc-1].addr != 0; mc++ );
+        if( addr == 0 || mc > MAX_MCAST )
+            return 0;
+    }
+    mcast_t* grp = &LMIC.mcast[mc-1];
+    grp->addr = addr;
+    grp->seqnoDn = seqnoDn;
+    os_copyMem(grp->nwkKey, nwkKey, 16);
+    os_copyMem(grp->artKey, artKey, 16);
+    mcastIndex();
+    return 1;
+}
+
+void LMIC_removeMcast (devaddr_t addr) {
+    u1_t mc = mcastFind(addr);
+    if( mc == 0 )
+        return;
+    os_clearMem((xref2u1_t)&LMIC.mcast[mc-1], sizeof(mcast_t));
+    mcastIndex();
+}
+
  
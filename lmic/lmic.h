@@ -29,6 +29,11 @@ enum { MAX_FRAME_LEN      =  64 };   //!< Library cap on max frame length
 enum { TXCONF_ATTEMPTS    =   8 };   //!< Transmit attempts for confirmed frames
 enum { MAX_MISSED_BCNS    =  20 };   // threshold for triggering rejoin requests
 enum { MAX_RXSYMS         = 100 };   // stop tracking beacon beyond this
+enum { DEVADR_HIST        =   8 };   // device ADR: TX-RX transactions kept in sliding window
+enum { DEVADR_MINSAMPLES  =   4 };   // device ADR: samples required before speeding up
+enum { DEVADR_NOACK_LIMIT =   2 };   // device ADR: consecutive NACKs before falling back
+enum { MAX_MCAST          =   4 };   // multicast sessions (LMIC_addMcast)
+enum { MCAST_SLOTS        =   8 };   // multicast address hash slots (power of 2, > MAX_MCAST)
 
 enum { LINK_CHECK_CONT    =  12 ,    // continue with this after reported dead link
        LINK_CHECK_DEAD    =  24 ,    // after this UP frames and no response from NWK assume link is dead
@@ -47,6 +52,7 @@ enum { MAX_CHANNELS = 16 };      //!< Max supported channels
 enum { MAX_BANDS    =  4 };
 
 enum { LIMIT_CHANNELS = (1<<4) };   // EU868 will never have more channels
+enum { DUTY_LEDGERS = MAX_BANDS };  // air time ledger per band
 //! \internal
 struct band_t {
     u2_t     txcap;     // duty cycle limitation: 1/txcap
@@ -60,9 +66,19 @@ TYPEDEF_xref2band_t; //!< \internal
 
 enum { MAX_XCHANNELS = 2 };      // extra channels in RAM, channels 0-71 are immutable 
 enum { MAX_TXPOW_125kHz = 30 };
+enum { DUTY_LEDGERS = 1 };       // no bands - one air time ledger for all channels
 
 #endif // ==========================================================================
 
+// Air time ledger: sliding window of DUTY_SLOTS x DUTY_SLOT_secs (1 hour)
+enum { DUTY_SLOTS = 16, DUTY_SLOT_secs = 225 };
+#define DUTY_SLOT_osticks sec2osticks(DUTY_SLOT_secs)
+//! \internal
+struct dutyledger_t {
+    u4_t     slot[DUTY_SLOTS];     // slot number (LMIC.dutySlot at the time)
+    ostime_t airtime[DUTY_SLOTS];  // air time spent in that slot
+};
+
 // Keep in sync with evdefs.hpp::drChange
 enum { DRCHG_SET, DRCHG_NOJACC, DRCHG_NOACK, DRCHG_NOADRACK, DRCHG_NWKCMD };
 enum { KEEP_TXPOW = -128 };
@@ -100,8 +116,46 @@ struct bcninfo_t {
     s4_t     lon;     //!< Lon field of last beacon (valid only if BCN_FULL set)
 };
 
+//! Piece of an uplink payload gathered by LMIC_setTxDataV().
+struct txfrag_t {
+    xref2cu1_t data;  //!< Fragment bytes (must stay valid until EV_TXCOMPLETE)
+    u1_t       len;   //!< Fragment length
+};
+
+//! Multicast group session - frames to `addr` are checked and decrypted with its keys.
+struct mcast_t {
+    devaddr_t addr;
+    u4_t      seqnoDn;     //!< Next expected down stream seqno
+    u1_t      nwkKey[16];  //!< Group network session key (MIC)
+    u1_t      artKey[16];  //!< Group application session key (payload)
+};
+
+#if defined(CFG_rxcal)
+//! Running estimate of a timing offset in ticks (mean and mean deviation, as for TCP RTTs).
+struct rxest_t {
+    s4_t mean8;  //!< Mean * 8
+    s4_t dev4;   //!< Mean absolute deviation * 4
+    u2_t n;      //!< Samples so far (saturates)
+};
+
+//! Class A RX window calibration (see LMIC_setRxCal).
+struct rxcal_t {
+    rxest_t  txirq;    //!< TXDONE time stamp - (TX start + air time)
+    rxest_t  wake;     //!< Radio ready for the window - RX job scheduled time
+    rxest_t  dnoff;    //!< Preamble start of received DN frames - expected start
+    ostime_t txbeg;    //!< Radio switched to TX (set by radio.c)
+    ostime_t ready;    //!< Radio set up for the window, waiting for rxtime (set by radio.c)
+    ostime_t job;      //!< RX job scheduled time of the current window
+    ostime_t expect;   //!< Expected preamble start of the current window
+    u4_t     windows;  //!< RX1/RX2 windows opened
+    u4_t     late;     //!< ... of which opened after rxtime
+    u1_t     k;        //!< Guard in mean deviations (0=fixed windows)
+};
+#endif
+
 // purpose of receive window - lmic_t.rxState
-enum { RADIO_RST=0, RADIO_TX=1, RADIO_RX=2, RADIO_RXON=3 };
+enum { RADIO_RST=0, RADIO_TX=1, RADIO_RX=2, RADIO_RXON=3, RADIO_RXGW=4, RADIO_RXC=5 };
+bit_t radio_rxcActive (u4_t freq, rps_t rps); // RADIO_RXC running on freq/rps
 // Netid values /  lmic_t.netid
 enum { NETID_NONE=(int)~0U, NETID_MASK=(int)0xFFFFFF };
 // MAC operation modes (lmic_t.opmode).
@@ -120,6 +174,7 @@ enum { OP_NONE     = 0x0000,
        OP_NEXTCHNL = 0x0800, // find a new channel
        OP_LINKDEAD = 0x1000, // link was reported as dead
        OP_TESTMODE = 0x2000, // developer test mode
+       OP_CLASSC   = 0x4000, // class C: continuous RX on RX2 channel except in TX and RX1
 };
 // TX-RX transaction flags - report back to user
 enum { TXRX_ACK    = 0x80,   // confirmed UP frame was acked
@@ -128,7 +183,8 @@ enum { TXRX_ACK    = 0x80,   // confirmed UP frame was acked
        TXRX_PORT   = 0x10,   // set if a frame with a port was RXed, LMIC.frame[LMIC.dataBeg-1] => port
        TXRX_DNW1   = 0x01,   // received in 1st DN slot
        TXRX_DNW2   = 0x02,   // received in 2dn DN slot
-       TXRX_PING   = 0x04 }; // received in a scheduled RX slot
+       TXRX_PING   = 0x04,   // received in a scheduled RX slot
+       TXRX_CLASSC = 0x08 }; // received in class C continuous RX (not the answer to an uplink)
 // Event types for event callback
 enum _ev_t { EV_SCAN_TIMEOUT=1, EV_BEACON_FOUND,
              EV_BEACON_MISSED, EV_BEACON_TRACKED, EV_JOINING,
@@ -149,8 +205,11 @@ struct lmic_t {
     u1_t        rxsyms;
     u1_t        dndr;
     s1_t        txpow;     // dBm
+    u4_t        rx1Freq;   // RX1 channel, freq/rps may serve class C until then
+    rps_t       rx1Rps;
 
     osjob_t     osjob;
+    osjob_t     rxcJob;    // class C: run once per frame received in continuous RX
 
     // Channel scheduling
 #if defined(CFG_eu868)
@@ -163,7 +222,11 @@ struct lmic_t {
     u2_t        xchDrMap[MAX_XCHANNELS];   // extra channel datarate ranges  ---XXX: ditto
     u2_t        channelMap[(72+MAX_XCHANNELS+15)/16];  // enabled bits
     u2_t        chRnd;        // channel randomizer
+    u1_t        chSpread;     // 125kHz uplinks on their channel frequency, not all on the first (radios_shareChannels)
 #endif
+    dutyledger_t dutyLedger[DUTY_LEDGERS];
+    u4_t        dutySlot;        // ledger slot number, counted up from LMIC_reset
+    ostime_t    dutySlotBeg;     // time slot dutySlot began
     u1_t        txChnl;          // channel for next TX
     u1_t        globalDutyRate;  // max rate: 1/2^k
     ostime_t    globalDutyAvail; // time device can send again
@@ -183,6 +246,8 @@ struct lmic_t {
     u1_t        pendTxConf;   // confirmed data
     u1_t        pendTxLen;    // +0x80 = confirmed
     u1_t        pendTxData[MAX_LEN_PAYLOAD];
+    const txfrag_t* pendTxFrags;  // payload fragments (used instead of pendTxData if pendTxNfrags>0)
+    u1_t        pendTxNfrags;
 
     u2_t        devNonce;     // last generated nonce
     u1_t        nwkKey[16];   // network session key
@@ -190,27 +255,31 @@ struct lmic_t {
     devaddr_t   devaddr;
     u4_t        seqnoDn;      // device level down stream seqno
     u4_t        seqnoUp;
+    mcast_t     mcast[MAX_MCAST];        // multicast sessions (addr=0: unused)
+    u1_t        mcastSlot[MCAST_SLOTS];  // address hash -> 1+index into mcast (0=empty)
 
     u1_t        dnConf;       // dn frame confirm pending: LORA::FCT_ACK or 0
     s1_t        adrAckReq;    // counter until we reset data rate (0=off)
     u1_t        adrChanged;
 
     u1_t        margin;
-    bit_t       ladrAns;      // link adr adapt answer pending
-    bit_t       devsAns;      // device status answer pending
+    u1_t        pendOpts[MAX_LEN_FOPTS-3];  // MAC answers for next UP frame (room left for PING_IND/BCNI_REQ)
+    u1_t        pendOptsLen;
     u1_t        adrEnabled;
     u1_t        moreData;     // NWK has more data pending
-    bit_t       dutyCapAns;   // have to ACK duty cycle settings
-    u1_t        snchAns;      // answer set new channel
+    // Device side ADR (see LMIC_setDevAdr)
+    u1_t        devAdrMargin; // required link margin in dB (0=off)
+    s1_t        devAdrEirp;   // gateway EIRP of DN frames in dBm
+    u1_t        devAdrIdx;    // next slot in devAdrHist
+    u1_t        devAdrCnt;    // valid slots in devAdrHist
+    s2_t        devAdrHist[DEVADR_HIST]; // path loss in dB per transaction or NACK marker
     // 2nd RX window (after up stream)
     u1_t        dn2Dr;
     u4_t        dn2Freq;
-    u1_t        dn2Ans;       // 0=no answer pend, 0x80+ACKs
 
     // Class B state
     u1_t        missedBcns;   // unable to track last N beacons
     u1_t        bcninfoTries; // how often to try (scan mode only)
-    u1_t        pingSetAns;   // answer set cmd and ACK bits
     rxsched_t   ping;         // pingable setup
 
     // Public part of MAC state
@@ -218,6 +287,10 @@ struct lmic_t {
     u1_t        txrxFlags;  // transaction flags (TX-RX combo)
     u1_t        dataBeg;    // 0 or start of data (dataBeg-1 is port)
     u1_t        dataLen;    // 0 no data or zero length data, >0 byte count of data
+    u1_t        dataMcast;  // 0 unicast frame, else 1+index into mcast of the group it was sent to
+#if defined(CFG_rxcal)
+    rxcal_t     rxcal;      // learned RX window timing
+#endif
     u1_t        frame[MAX_LEN_FRAME];
 
     u1_t        bcnChnl;
@@ -240,6 +313,7 @@ void  LMIC_disableChannel (u1_t channel);
 
 void  LMIC_setDrTxpow   (dr_t dr, s1_t txpow);  // set default/start DR/txpow
 void  LMIC_setAdrMode   (bit_t enabled);        // set ADR mode (if mobile turn off)
+void  LMIC_setDevAdr    (u1_t margin, s1_t eirp); // device side ADR keeping margin dB (0=off), gateway EIRP dBm
 bit_t LMIC_startJoining (void);
 
 void  LMIC_shutdown     (void);
@@ -248,17 +322,49 @@ void  LMIC_reset        (void);
 void  LMIC_clrTxData    (void);
 void  LMIC_setTxData    (void);
 int   LMIC_setTxData2   (u1_t port, xref2u1_t data, u1_t dlen, u1_t confirmed);
+int   LMIC_setTxDataV   (u1_t port, const txfrag_t* frags, u1_t nfrags, u1_t confirmed);
 void  LMIC_sendAlive    (void);
 
+// Uplink air time of plen application bytes at dr (0=invalid or longer than
+// the region allows at dr) and largest payload at the current DR whose air
+// time fits budget and the region's frame limit (-1=none).
+ostime_t LMIC_airtimeFor      (dr_t dr, u1_t plen);
+int      LMIC_maxPayloadWithin (ostime_t budget);
+// Air time used during the last hour in 1/100 % (ledger=band, 0 for US915)
+// and predicted earliest start of an uplink of plen bytes at dr.
+u2_t     LMIC_dutyUtilization (u1_t ledger);
+ostime_t LMIC_nextTxTime      (u1_t plen, dr_t dr);
+#if defined(CFG_energy)
+// Radio energy in uJ per completed uplink (TX, RX windows, retries, joins) and
+// in mJ per day at the average power so far (see energy.h).
+u4_t     LMIC_uplinkEnergy    (void);
+u4_t     LMIC_dailyEnergy     (void);
+#endif
+
 bit_t LMIC_enableTracking  (u1_t tryBcnInfo);
 void  LMIC_disableTracking (void);
 
 void  LMIC_stopPingable  (void);
 void  LMIC_setPingable   (u1_t intvExp);
+void  LMIC_setClassC     (bit_t enabled);
 void  LMIC_tryRejoin     (void);
 
 void LMIC_setSession (u4_t netid, devaddr_t devaddr, xref2u1_t nwkKey, xref2u1_t artKey);
 void LMIC_setLinkCheckMode (bit_t enabled);
+#if defined(CFG_rxcal)
+// RX1/RX2 windows open k mean deviations of the learned timing early and
+// stay open as long again (0=fixed windows as without CFG_rxcal).
+void LMIC_setRxCal (u1_t k);
+#endif
+
+// Multicast groups: frames to addr (class C continuous RX only) are
+// reported with EV_RXCOMPLETE and LMIC.dataMcast set. 0 if the table is full.
+bit_t LMIC_addMcast    (devaddr_t addr, xref2u1_t nwkKey, xref2u1_t artKey, u4_t seqnoDn);
+void  LMIC_removeMcast (devaddr_t addr);
+
+// Single channel gateway: keep the radio in RX on freq/rps and run rxfunc
+// for each frame received (LMIC.frame/dataLen/rxtime/rssi/snr).
+void LMIC_startGateway (u4_t freq, rps_t rps, osjobcb_t rxfunc);
 
 // Special APIs - for development or testing
 // !!!See implementation for caveats!!!
@@ -19,10 +19,16 @@ struct lmic_pinmap {
     u1_t rxtx;
     u1_t rst;
     u1_t dio[NUM_DIO];
+    u1_t spi;   // SPI channel (0=CE0, 1=CE1)
 };
 
 // Declared here, to be defined an initialized by the application
 extern lmic_pinmap pins;
 
+#if defined(CFG_multiradio)
+// Pin mapping of the radio driven by the calling thread (see radios.h)
+extern OS_TLS lmic_pinmap* radio_pins;
+#endif
+
 #endif // _localhal_hal_h_
 
@@ -93,6 +93,7 @@ enum { CHNL_BCN          = 10 };
 enum { FREQ_BCN          = EU868_DN };
 enum { DR_BCN            = DR_SF9 };
 enum { AIRTIME_BCN       = 144384 };  // micros
+enum { EIRP_DN           = 14 };      // gateway EIRP assumed for DN frames (dBm)
 
 enum {
     // Beacon frame format EU SF9
@@ -139,6 +140,7 @@ enum { DR_DNW2           = DR_SF12CR };
 enum { CHNL_BCN          = 0 }; // used only for default init of state (rotating beacon scheme)
 enum { DR_BCN            = DR_SF10CR };
 enum { AIRTIME_BCN       = 72192 };  // micros
+enum { EIRP_DN           = 27 };     // gateway EIRP assumed for DN frames (dBm)
 
 enum {
     // Beacon frame format US SF10
@@ -186,6 +188,7 @@ enum {
     OFF_DAT_OPTS     = 8,
 };
 enum { MAX_LEN_PAYLOAD = MAX_LEN_FRAME-(int)OFF_DAT_OPTS-4 };
+enum { MAX_LEN_FOPTS = 15 };  // FOpts bytes in a frame (FCT_OPTLEN)
 enum {
     // Bitfields in frame format octet
     HDR_FTYPE   = 0xE0,
@@ -0,0 +1,115 @@
+/*******************************************************************************
+ * Command mailbox: intrusive MPSC queue (producers exchange the head, the
+ * LMIC thread walks from the tail) with a stub node so it is never empty.
+ *******************************************************************************/
+
+#include "lmic.h"
+
+#if defined(CFG_mbox)
+
+#include "mbox.h"
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static OS_TLS mbox_t* self;
+
+static void push (mbox_t* mb, mboxcmd_t* cmd) {
+    __atomic_store_n(&cmd->next, (mboxcmd_t*)NULL, __ATOMIC_RELAXED);
+    mboxcmd_t* prev = __atomic_exchange_n(&mb->head, cmd, __ATOMIC_ACQ_REL);
+    // a producer preempted here hides cmd and all later ones until it links it
+    __atomic_store_n(&prev->next, cmd, __ATOMIC_RELEASE);
+}
+
+// next command, NULL if none (or the last one is still being linked)
+static mboxcmd_t* pop (mbox_t* mb) {
+    mboxcmd_t* tail = mb->tail;
+    mboxcmd_t* next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if( tail == &mb->stub ) {
+        if( next == NULL )
+            return NULL;
+        mb->tail = tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+    if( next == NULL ) {
+        // tail is the last command: put the stub behind it before taking it
+        if( tail != __atomic_load_n(&mb->head, __ATOMIC_ACQUIRE) )
+            return NULL;
+        push(mb, &mb->stub);
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+        if( next == NULL )
+            return NULL;
+    }
+    mb->tail = next;
+    return tail;
+}
+
+static void apply (mboxcmd_t* cmd) {
+    cmd->result = 0;
+    switch( cmd->op ) {
+    case MBOX_SETTXDATA:
+        cmd->result = LMIC_setTxData2(cmd->a.tx.port, cmd->a.tx.data, cmd->a.tx.dlen, cmd->a.tx.confirmed);
+        break;
+    case MBOX_SETDRTXPOW:
+        LMIC_setDrTxpow(cmd->a.drtxpow.dr, cmd->a.drtxpow.txpow);
+        break;
+    case MBOX_SETSESSION:
+        LMIC_setSession(cmd->a.session.netid, cmd->a.session.devaddr, cmd->a.session.nwkKey, cmd->a.session.artKey);
+        break;
+    case MBOX_SETADRMODE:
+        LMIC_setAdrMode(cmd->a.enabled);
+        break;
+    case MBOX_SETLINKCHECK:
+        LMIC_setLinkCheckMode(cmd->a.enabled);
+        break;
+    case MBOX_SHUTDOWN:
+        LMIC_shutdown();
+        break;
+    case MBOX_RESET:
+        LMIC_reset();
+        break;
+    case MBOX_CALL:
+        cmd->a.fn(cmd);
+        break;
+    default:
+        cmd->result = -1;
+        break;
+    }
+}
+
+void mbox_init (mbox_t* mb) {
+    mb->stub.next = NULL;
+    mb->head = mb->tail = &mb->stub;
+}
+
+void mbox_attach (mbox_t* mb) {
+    self = mb;
+}
+
+void mbox_post (mbox_t* mb, mboxcmd_t* cmd) {
+    cmd->state = MBOX_POSTED;
+    push(mb, cmd);
+}
+
+int mbox_wait (mboxcmd_t* cmd) {
+    while( __atomic_load_n(&cmd->state, __ATOMIC_ACQUIRE) == MBOX_POSTED )
+        syscall(SYS_futex, &cmd->state, FUTEX_WAIT_PRIVATE, MBOX_POSTED, NULL, NULL, 0);
+    return cmd->result;
+}
+
+void mbox_run (void) {
+    mboxcmd_t* cmd;
+    if( self == NULL )
+        return;
+    while( (cmd = pop(self)) != NULL ) {
+        apply(cmd);
+        if( cmd->done )
+            cmd->done(cmd);
+        // cmd may be reused or freed as soon as the state is set
+        int* state = &cmd->state;
+        __atomic_store_n(state, MBOX_DONE, __ATOMIC_RELEASE);
+        syscall(SYS_futex, state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+#endif // CFG_mbox
@@ -0,0 +1,82 @@
+/*******************************************************************************
+ * Command mailbox for driving the LMIC from other threads (enabled with
+ * CFG_mbox in config.h).
+ *
+ * The LMIC is not thread-safe: hal_disableIRQs() only holds off the radio IRQ
+ * polling of the thread running os_runloop_once(). Other threads (MQTT,
+ * sensors) post commands to the mailbox attached to that thread instead of
+ * calling LMIC_* themselves, and os_runloop_once() applies them before it
+ * runs the next job. Posting is one atomic exchange on an intrusive MPSC
+ * list: no lock and no allocation, the command belongs to the caller until it
+ * is completed. Completion is signalled by the done callback (called on the
+ * LMIC thread) and to mbox_wait().
+ *******************************************************************************/
+
+#ifndef _mbox_h_
+#define _mbox_h_
+
+// mboxcmd_t.op
+enum { MBOX_SETTXDATA,    // LMIC_setTxData2(a.tx), result is its return value
+       MBOX_SETDRTXPOW,   // LMIC_setDrTxpow(a.drtxpow)
+       MBOX_SETSESSION,   // LMIC_setSession(a.session)
+       MBOX_SETADRMODE,   // LMIC_setAdrMode(a.enabled)
+       MBOX_SETLINKCHECK, // LMIC_setLinkCheckMode(a.enabled)
+       MBOX_SHUTDOWN,     // LMIC_shutdown()
+       MBOX_RESET,        // LMIC_reset()
+       MBOX_CALL };       // a.fn(cmd) for anything else, result set by fn
+
+// mboxcmd_t.state
+enum { MBOX_IDLE, MBOX_POSTED, MBOX_DONE };
+
+typedef struct mboxcmd_t mboxcmd_t;
+typedef void (*mboxfn_t) (mboxcmd_t* cmd);
+
+struct mboxcmd_t {
+    mboxcmd_t* next;  // queue link
+    u1_t       op;
+    union {
+        struct { u1_t port; u1_t dlen; u1_t confirmed; u1_t data[MAX_LEN_PAYLOAD]; } tx;
+        struct { dr_t dr; s1_t txpow; } drtxpow;
+        struct { u4_t netid; devaddr_t devaddr; u1_t nwkKey[16]; u1_t artKey[16]; } session;
+        bit_t    enabled;
+        mboxfn_t fn;
+    } a;
+    mboxfn_t   done;   // called on the LMIC thread once applied (NULL=none)
+    void*      ctx;    // for done/fn
+    int        result;
+    int        state;  // MBOX_* (futex word of mbox_wait)
+};
+
+typedef struct mbox_t {
+    mboxcmd_t* head;  // last posted (producers)
+    mboxcmd_t* tail;  // next to apply (LMIC thread)
+    mboxcmd_t  stub;
+} mbox_t;
+
+/*
+ * set up an empty mailbox.
+ */
+void mbox_init (mbox_t* mb);
+
+/*
+ * attach mb to the calling thread: its os_runloop_once() applies the commands
+ * (call from the LMIC thread, e.g. in the radios_start() setup).
+ */
+void mbox_attach (mbox_t* mb);
+
+/*
+ * queue cmd (any thread). cmd must stay valid and untouched until MBOX_DONE.
+ */
+void mbox_post (mbox_t* mb, mboxcmd_t* cmd);
+
+/*
+ * block until cmd is applied, returns its result (not from the LMIC thread).
+ */
+int mbox_wait (mboxcmd_t* cmd);
+
+/*
+ * apply everything posted to the attached mailbox (called by os_runloop_once()).
+ */
+void mbox_run (void);
+
+#endif // _mbox_h_
@@ -10,9 +10,12 @@
  *******************************************************************************/
 
 #include "lmic.h"
+#if defined(CFG_mbox)
+#include "mbox.h"
+#endif
 
 // RUNTIME STATE
-static struct {
+static OS_TLS struct {
     osjob_t* scheduledjobs;
     osjob_t* runnablejobs;
 } OS;
@@ -25,7 +28,7 @@ void os_init () {
 }
 
 ostime_t os_getTime () {
-    return hal_ticks();
+    return (ostime_t)hal_ticks();
 }
 
 static u1_t unlinkjob (osjob_t** pnext, osjob_t* job) {
@@ -72,7 +75,7 @@ void os_setTimedCallback (osjob_t* job, ostime_t time, osjobcb_t cb) {
     job->next = NULL;
     // insert into schedule
     for(pnext=&OS.scheduledjobs; *pnext; pnext=&((*pnext)->next)) {
-        if((*pnext)->deadline - time > 0) { // (cmp diff, not abs!)
+        if(os_timeDiff((*pnext)->deadline, time) > 0) { // (cmp diff, not abs!)
             // enqueue before next element and stop
             job->next = *pnext;
             break;
@@ -85,6 +88,9 @@ void os_setTimedCallback (osjob_t* job, ostime_t time, osjobcb_t cb) {
 // execute jobs from timer and from run queue
 void os_runloop_once () {
         osjob_t* j = NULL;
+#if defined(CFG_mbox)
+        mbox_run(); // LMIC calls posted by other threads, between jobs
+#endif
         hal_disableIRQs();
         // check for runnable jobs
         if(OS.runnablejobs) {
@@ -34,6 +34,13 @@ typedef          long long s8_t;
 typedef unsigned int       uint;
 typedef const char* str_t;
 
+// hal_ticks() value (CFG_ostime64: 64-bit, otherwise wraps after 2^32 ticks)
+#if defined(CFG_ostime64)
+typedef u8_t osticks_t;
+#else
+typedef u4_t osticks_t;
+#endif
+
 #include <string.h>
 #include "hal.h"
 #define EV(a,b,c) /**/
@@ -52,6 +59,11 @@ typedef      struct band_t band_t;
 typedef   struct chnldef_t chnldef_t;
 typedef   struct rxsched_t rxsched_t;
 typedef   struct bcninfo_t bcninfo_t;
+typedef    struct txfrag_t txfrag_t;
+typedef    struct mcast_t mcast_t;
+typedef    struct rxest_t rxest_t;
+typedef    struct rxcal_t rxcal_t;
+typedef struct dutyledger_t dutyledger_t;
 typedef        const u1_t* xref2cu1_t;
 typedef              u1_t* xref2u1_t;
 #define TYPEDEF_xref2rps_t     typedef         rps_t* xref2rps_t
@@ -65,17 +77,31 @@ typedef              u1_t* xref2u1_t;
 #define ON_LMIC_EVENT(ev)  onEvent(ev)
 #define DECL_ON_LMIC_EVENT void onEvent(ev_t e)
 
-extern u4_t AESAUX[];
-extern u4_t AESKEY[];
+// CFG_multiradio: one thread per radio, each with its own MAC/OS/radio state
+#if defined(CFG_multiradio)
+#define OS_TLS __thread
+#else
+#define OS_TLS
+#endif
+
+extern OS_TLS u4_t AESAUX[];
+extern OS_TLS u4_t AESKEY[];
 #define AESkey ((u1_t*)AESKEY)
 #define AESaux ((u1_t*)AESAUX)
 #define FUNC_ADDR(func) (&(func))
 
+#if defined(CFG_rngpool)
+u1_t rng_u1 (void);
+u2_t rng_u2 (void);
+#define os_getRndU1() rng_u1()
+#define os_getRndU2() rng_u2()
+#else
 u1_t radio_rand1 (void);
 #define os_getRndU1() radio_rand1()
+#endif
 
-#define DEFINE_LMIC  struct lmic_t LMIC
-#define DECLARE_LMIC extern struct lmic_t LMIC
+#define DEFINE_LMIC  OS_TLS struct lmic_t LMIC
+#define DECLARE_LMIC extern OS_TLS struct lmic_t LMIC
 
 void radio_init (void);
 void radio_irq_handler (u1_t dio);
@@ -100,14 +126,45 @@ void os_runloop_once (void);
 #error Illegal OSTICKS_PER_SEC - must be in range [10000:64516]. One tick must be 15.5us .. 100us long.
 #endif
 
+#if defined(CFG_ostime64)
+typedef s8_t  ostime_t;   // monotonic, never wraps
+#else
 typedef s4_t  ostime_t;
+#endif
+
+// Signed distance a-b between two times. Compare this against 0 instead of
+// comparing times directly - with 32-bit ticks it stays correct across the wrap.
+#if defined(CFG_ostime64)
+#define os_timeDiff(a,b)  ((ostime_t)((a)-(b)))
+#else
+#define os_timeDiff(a,b)  ((ostime_t)((osticks_t)(a)-(osticks_t)(b)))
+#endif
 
 #if !HAS_ostick_conv
+#if defined(CFG_ostime64)
+// x*num/den as fixed-point multiply-shift, factor ceil((num<<sh)/den) folded at
+// compile time. Rounds towards -inf; exact while |x| < 2^sh/den (den reduced),
+// beyond that at most 0.02ppm high (sh below, any OSTICKS_PER_SEC). The product
+// is formed in two halves, so any x whose result fits in 64 bits is safe
+// (absolute times included); sh keeps 2^sh*factor below 2^63.
+static inline s8_t os_mulshift (s8_t x, s8_t f, int sh) {
+    // (x*f)>>sh == (x>>sh)*f + ((x mod 2^sh)*f)>>sh, neither term overflows
+    return (x >> sh) * f + (((x & (((s8_t)1 << sh) - 1)) * f) >> sh);
+}
+#define OS_MULSHIFT(x,num,den,sh) \
+    os_mulshift((s8_t)(x), (s8_t)((((u8_t)(num)<<(sh)) + (den) - 1) / (den)), sh)
+#define us2osticks(us)   ((ostime_t)OS_MULSHIFT(us, OSTICKS_PER_SEC, 1000000, 33))
+#define ms2osticks(ms)   ((ostime_t)OS_MULSHIFT(ms, OSTICKS_PER_SEC,    1000, 28))
+#define sec2osticks(sec) ((ostime_t)( (s8_t)(sec) * OSTICKS_PER_SEC))
+#define osticks2ms(os)   ((s8_t)OS_MULSHIFT(os,    1000, OSTICKS_PER_SEC, 33))
+#define osticks2us(os)   ((s8_t)OS_MULSHIFT(os, 1000000, OSTICKS_PER_SEC, 28))
+#else
 #define us2osticks(us)   ((ostime_t)( ((s8_t)(us) * OSTICKS_PER_SEC) / 1000000))
 #define ms2osticks(ms)   ((ostime_t)( ((s8_t)(ms) * OSTICKS_PER_SEC)    / 1000))
 #define sec2osticks(sec) ((ostime_t)( (s8_t)(sec) * OSTICKS_PER_SEC))
 #define osticks2ms(os)   ((s4_t)(((os)*(s8_t)1000    ) / OSTICKS_PER_SEC))
 #define osticks2us(os)   ((s4_t)(((os)*(s8_t)1000000 ) / OSTICKS_PER_SEC))
+#endif
 // Special versions
 #define us2osticksCeil(us)  ((ostime_t)( ((s8_t)(us) * OSTICKS_PER_SEC + 999999) / 1000000))
 #define us2osticksRound(us) ((ostime_t)( ((s8_t)(us) * OSTICKS_PER_SEC + 500000) / 1000000))
@@ -212,6 +269,15 @@ extern xref2u1_t AESaux;
 #ifndef os_aes
 u4_t os_aes (u1_t mode, xref2u1_t buf, u2_t len);
 #endif
+#ifndef os_aesFrame
+//! Cipher payload buf[poff..len) with ckey and compute MIC over buf[0..len) in one pass.
+//! AESkey/AESaux as for AES_MIC. mode: AES_ENC (encrypt-then-MIC), AES_DEC (MIC-then-decrypt).
+u4_t os_aesFrame (u1_t mode, xref2cu1_t ckey, xref2u1_t buf, u1_t poff, u1_t len);
+#endif
+#ifndef os_aesFrameV
+//! os_aesFrame(AES_ENC,..) with the payload buf[poff..len) copied from frags (in order) as it is ciphered.
+u4_t os_aesFrameV (xref2cu1_t ckey, xref2u1_t buf, u1_t poff, u1_t len, const txfrag_t* frags);
+#endif
 
 
 
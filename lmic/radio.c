@@ -9,8 +9,33 @@
  *    IBM Zurich Research Lab - initial API, implementation and documentation
  *******************************************************************************/
 
-#include <wiringPi.h>
 #include "lmic.h"
+#if defined(CFG_capture)
+#include "capture.h"
+#define CAPTURE(dir,time) cap_frame(dir,time)
+#else
+#define CAPTURE(dir,time)
+#endif
+#if defined(CFG_energy)
+#include "energy.h"
+// accounted state per SX127x mode (FSTX/FSRX as standby, CAD as RX)
+static const u1_t MODE_RSTATE[8] = { RSTATE_SLEEP, RSTATE_STANDBY, RSTATE_STANDBY, RSTATE_TX,
+                                     RSTATE_STANDBY, RSTATE_RX, RSTATE_RX, RSTATE_RX };
+#define ENERGY_STATE(state) energy_state(state)
+#define ENERGY_TXPOW(dbm)   energy_txpow(dbm)
+#else
+#define ENERGY_STATE(state)
+#define ENERGY_TXPOW(dbm)
+#endif
+#if defined(CFG_rngpool)
+#include "rng.h"
+#endif
+#if defined(CFG_rxcal)
+// time stamps for the RX window calibration in lmic.c
+#define RXCAL_STAMP(t) (LMIC.rxcal.t = os_getTime())
+#else
+#define RXCAL_STAMP(t)
+#endif
 
 // ---------------------------------------- 
 // Registers Mapping
@@ -249,7 +274,7 @@
 
 // RADIO STATE
 // (initialized by radio_init(), used by radio_rand1())
-static u1_t randbuf[16];
+static OS_TLS u1_t randbuf[16];
 
 
 #ifdef CFG_sx1276_radio
@@ -261,41 +286,92 @@ static u1_t randbuf[16];
 #endif
 
 
+// Register writes and FIFO loads between cmdBegin() and cmdEnd() are collected
+// into one command list and handed to the HAL as a single SPI submission.
+// Reads flush the pending list first, so register order is preserved.
+enum { CMD_BYTES = 2*32 + 1+MAX_LEN_FRAME, CMD_SEGS = 40 };
+static OS_TLS struct {
+    u1_t active;
+    u1_t nseg;
+    u2_t len;
+    u1_t seglen[CMD_SEGS];
+    u1_t buf[CMD_BYTES];
+} cmds;
+// last value written to/read from RegOpMode (the radio only changes its mode bits)
+static OS_TLS u1_t opmodeReg;
+
+static void cmdFlush () {
+    if( cmds.nseg ) {
+        hal_spi_batch(cmds.buf, cmds.seglen, cmds.nseg);
+        cmds.nseg = 0;
+        cmds.len = 0;
+    }
+}
+
+static void cmdBegin () {
+    cmds.active = 1;
+}
+
+static void cmdEnd () {
+    cmdFlush();
+    cmds.active = 0;
+}
+
+// append write transaction addr+data[0..len) (0 if not batching or too large)
+static bit_t cmdWrite (u1_t addr, xref2u1_t data, u1_t len) {
+    if( !cmds.active || 1+len > CMD_BYTES )
+        return 0;
+    if( cmds.nseg == CMD_SEGS || cmds.len+1+len > CMD_BYTES )
+        cmdFlush();
+    u1_t* p = cmds.buf + cmds.len;
+    p[0] = addr | 0x80;
+    os_copyMem(p+1, data, len);
+    cmds.seglen[cmds.nseg++] = 1+len;
+    cmds.len += 1+len;
+    return 1;
+}
+
 static void writeReg (u1_t addr, u1_t data ) {
-    hal_pin_nss(0);
-    hal_spi(addr | 0x80);
-    hal_spi(data);
-    hal_pin_nss(1);
+    if( addr == RegOpMode ) {
+        opmodeReg = data;
+        ENERGY_STATE(MODE_RSTATE[data & OPMODE_MASK]);
+    }
+    if( cmdWrite(addr, &data, 1) )
+        return;
+    u1_t b[2] = { (u1_t)(addr | 0x80), data };
+    hal_spi_xfer(b, 2);
 }
 
 static u1_t readReg (u1_t addr) {
-    hal_pin_nss(0);
-    hal_spi(addr & 0x7F);
-    u1_t val = hal_spi(0x00);
-    hal_pin_nss(1);
-    return val;
+    cmdFlush();
+    u1_t b[2] = { (u1_t)(addr & 0x7F), 0x00 };
+    hal_spi_xfer(b, 2);
+    if( addr == RegOpMode )
+        opmodeReg = b[1];
+    return b[1];
 }
 
 static void writeBuf (u1_t addr, xref2u1_t buf, u1_t len) {
-    hal_pin_nss(0);
-    hal_spi(addr | 0x80);
-    for (u1_t i=0; i<len; i++) {
-        hal_spi(buf[i]);
-    }
-    hal_pin_nss(1);
+    if( cmdWrite(addr, buf, len) )
+        return;
+    u1_t b[1+255];
+    b[0] = addr | 0x80;
+    os_copyMem(b+1, buf, len);
+    hal_spi_xfer(b, 1+len);
 }
 
 static void readBuf (u1_t addr, xref2u1_t buf, u1_t len) {
-    hal_pin_nss(0);
-    hal_spi(addr & 0x7F);
-    for (u1_t i=0; i<len; i++) {
-        buf[i] = hal_spi(0x00);
-    }
-    hal_pin_nss(1);
+    cmdFlush();
+    u1_t b[1+255];
+    b[0] = addr & 0x7F;
+    os_clearMem(b+1, len);
+    hal_spi_xfer(b, 1+len);
+    os_copyMem(buf, b+1, len);
 }
 
 static void opmode (u1_t mode) {
-    writeReg(RegOpMode, (readReg(RegOpMode) & ~OPMODE_MASK) | mode);
+    u1_t cur = cmds.active ? opmodeReg : readReg(RegOpMode);
+    writeReg(RegOpMode, (cur & ~OPMODE_MASK) | mode);
 }
 
 static void opmodeLora() {
@@ -409,6 +485,7 @@ static void configPower () {
     // check board type for BOOST pin
     writeReg(RegPaConfig, (u1_t)(0x80|(pw&0xf)));
     writeReg(RegPaDac, readReg(RegPaDac)|0x4);
+    ENERGY_TXPOW(pw+2); // PA_BOOST: Pout = 17-(15-OutputPower)
 
 #elif CFG_sx1272_radio
     // set PA config (2-17 dBm using PA_BOOST)
@@ -419,16 +496,18 @@ static void configPower () {
         pw = 2;
     }
     writeReg(RegPaConfig, (u1_t)(0x80|(pw-2)));
+    ENERGY_TXPOW(pw);
 #else
 #error Missing CFG_sx1272_radio/CFG_sx1276_radio
 #endif /* CFG_sx1272_radio */
 }
 
 static void txfsk () {
+    cmdBegin();
     // select FSK modem (from sleep mode)
     writeReg(RegOpMode, 0x10); // FSK, BT=0.5
     //ASSERT(readReg(RegOpMode) == 0x10);
-    if (readReg(RegOpMode) != 0x10) return;
+    if (readReg(RegOpMode) != 0x10) { cmdEnd(); return; }
     // enter standby mode (required for FIFO loading))
     opmode(OPMODE_STANDBY);
     // set bitrate
@@ -466,14 +545,16 @@ static void txfsk () {
     
     // now we actually start the transmission
     opmode(OPMODE_TX);
+    cmdEnd();
 }
 
 static void txlora () {
+    cmdBegin();
     // select LoRa modem (from sleep mode)
     writeReg(RegOpMode, OPMODE_LORA);
     opmodeLora();
     //ASSERT((readReg(RegOpMode) & OPMODE_LORA) != 0);
-    if((readReg(RegOpMode) & OPMODE_LORA) == 0) return;
+    if((readReg(RegOpMode) & OPMODE_LORA) == 0) { cmdEnd(); return; }
 
     // enter standby mode (required for FIFO loading))
     opmode(OPMODE_STANDBY);
@@ -507,6 +588,8 @@ static void txlora () {
     
     // now we actually start the transmission
     opmode(OPMODE_TX);
+    cmdEnd();
+    RXCAL_STAMP(txbeg);
 }
 
 // start transmitter (buf=LMIC.frame, len=LMIC.dataLen)
@@ -522,20 +605,28 @@ static void starttx () {
     // the corresponding IRQ will inform us about completion.
 }
 
-enum { RXMODE_SINGLE, RXMODE_SCAN, RXMODE_RSSI };
+enum { RXMODE_SINGLE, RXMODE_SCAN, RXMODE_RSSI, RXMODE_GW };
 
 static const u1_t rxlorairqmask[] = {
     [RXMODE_SINGLE] = IRQ_LORA_RXDONE_MASK|IRQ_LORA_RXTOUT_MASK,
     [RXMODE_SCAN]   = IRQ_LORA_RXDONE_MASK,
     [RXMODE_RSSI]   = 0x00,
+    [RXMODE_GW]     = IRQ_LORA_RXDONE_MASK|IRQ_LORA_CRCERR_MASK,
 };
 
+// RADIO_RXGW/RADIO_RXC while the modem is kept in continuous RX (gateway
+// mode, class C), 0 otherwise
+static OS_TLS u1_t rxcont;
+static OS_TLS u4_t rxcFreq;  // channel of RADIO_RXC
+static OS_TLS rps_t rxcRps;
+
 // start LoRa receiver (time=LMIC.rxtime, timeout=LMIC.rxsyms, result=LMIC.frame[LMIC.dataLen])
 static void rxlora (u1_t rxmode) {
+    cmdBegin();
     // select LoRa modem (from sleep mode)
     opmodeLora();
     //ASSERT((readReg(RegOpMode) & OPMODE_LORA) != 0);
-    if ((readReg(RegOpMode) & OPMODE_LORA) == 0) return;
+    if ((readReg(RegOpMode) & OPMODE_LORA) == 0) { cmdEnd(); return; }
     // enter standby mode (warm up))
     opmode(OPMODE_STANDBY);
     // don't use MAC settings at startup
@@ -552,8 +643,11 @@ static void rxlora (u1_t rxmode) {
     writeReg(RegLna, LNA_RX_GAIN); 
     // set max payload size
     writeReg(LORARegPayloadMaxLength, 64);
-    // use inverted I/Q signal (prevent mote-to-mote communication)
-    writeReg(LORARegInvertIQ, readReg(LORARegInvertIQ)|(1<<6));
+    if(rxmode == RXMODE_GW) { // listen for uplinks (non-inverted I/Q)
+        writeReg(LORARegInvertIQ, readReg(LORARegInvertIQ)&~(1<<6));
+    } else { // use inverted I/Q signal (prevent mote-to-mote communication)
+        writeReg(LORARegInvertIQ, readReg(LORARegInvertIQ)|(1<<6));
+    }
     // set symbol timeout (for single rx)
     writeReg(LORARegSymbTimeoutLsb, LMIC.rxsyms);
     // set sync word
@@ -571,10 +665,13 @@ static void rxlora (u1_t rxmode) {
 
     // now instruct the radio to receive
     if (rxmode == RXMODE_SINGLE) { // single rx
+        cmdEnd(); // configured ahead, only the mode switch is timed
+        RXCAL_STAMP(ready);
         hal_waitUntil(LMIC.rxtime); // busy wait until exact rx time
         opmode(OPMODE_RX_SINGLE);
     } else { // continous rx (scan or rssi)
         opmode(OPMODE_RX); 
+        cmdEnd();
     }
 }
 
@@ -582,11 +679,12 @@ static void rxfsk (u1_t rxmode) {
     // only single rx (no continuous scanning, no noise sampling)
     ASSERT( rxmode == RXMODE_SINGLE );
     if ( rxmode != RXMODE_SINGLE ) return;
+    cmdBegin();
     // select FSK modem (from sleep mode)
     //writeReg(RegOpMode, 0x00); // (not LoRa)
     opmodeFSK();
     //ASSERT((readReg(RegOpMode) & OPMODE_LORA) == 0);
-    if ((readReg(RegOpMode) & OPMODE_LORA) != 0) return;
+    if ((readReg(RegOpMode) & OPMODE_LORA) != 0) { cmdEnd(); return; }
     // enter standby mode (warm up))
     opmode(OPMODE_STANDBY);
     // configure frequency
@@ -627,6 +725,8 @@ static void rxfsk (u1_t rxmode) {
     hal_pin_rxtx(0);
     
     // now instruct the radio to receive
+    cmdEnd();
+    RXCAL_STAMP(ready);
     hal_waitUntil(LMIC.rxtime); // busy wait until exact rx time
     opmode(OPMODE_RX); // no single rx mode available in FSK
 }
@@ -687,6 +787,9 @@ void radio_init () {
         }
     }
     randbuf[0] = 16; // set initial index
+#if defined(CFG_rngpool)
+    rng_mix(randbuf+1, 15);
+#endif
   
 #ifdef CFG_sx1276mb1_board
     // chain calibration
@@ -712,6 +815,7 @@ void radio_init () {
     hal_enableIRQs();
 }
 
+#if !defined(CFG_rngpool)
 // return next random byte derived from seed buffer
 // (buf[0] holds index of next byte to be returned)
 u1_t radio_rand1 () {
@@ -725,6 +829,7 @@ u1_t radio_rand1 () {
     randbuf[0] = i;
     return v;
 }
+#endif
 
 u1_t radio_rssi () {
     hal_disableIRQs();
@@ -747,6 +852,8 @@ static const u2_t LORA_RXDONE_FIXUP[] = {
 // (radio goes to stanby mode after tx/rx operations)
 void radio_irq_handler (u1_t dio) {
     ostime_t now = os_getTime();
+    if( !rxcont ) // TX/RX done or timed out: the radio is back in standby
+        ENERGY_STATE(RSTATE_STANDBY);
     if( 1) {//(readReg(RegOpMode) & OPMODE_LORA) != 0) { // LORA modem
         u1_t flags = readReg(LORARegIrqFlags);
         if( flags & IRQ_LORA_TXDONE_MASK ) {
@@ -768,10 +875,21 @@ void radio_irq_handler (u1_t dio) {
             // read rx quality parameters
             LMIC.snr  = readReg(LORARegPktSnrValue); // SNR [dB] * 4
             LMIC.rssi = readReg(LORARegPktRssiValue) - 125 + 64; // RSSI [dBm] (-196...+63)
+            CAPTURE(CAP_RX, now);
+            if( rxcont ) {
+                // modem is still in RX: just ack the IRQ so the next RXDONE raises DIO0 again
+                writeReg(LORARegIrqFlags, 0xFF);
+                if( flags & IRQ_LORA_CRCERR_MASK )
+                    return; // drop corrupted frame, nothing to forward
+                osjob_t* job = rxcont == RADIO_RXC ? &LMIC.rxcJob : &LMIC.osjob;
+                os_setCallback(job, job->func);
+                return;
+            }
         } else if( flags & IRQ_LORA_RXTOUT_MASK ) {
             // indicate timeout
             LMIC.dataLen = 0;
         }
+        cmdBegin();
         // mask all radio IRQs
         writeReg(LORARegIrqFlagsMask, 0xFF);
         // clear radio IRQ flags
@@ -792,6 +910,7 @@ void radio_irq_handler (u1_t dio) {
             // read rx quality parameters
             LMIC.snr  = 0; // determine snr
             LMIC.rssi = 0; // determine rssi
+            CAPTURE(CAP_RX, now);
         } else if( flags1 & IRQ_FSK1_TIMEOUT_MASK ) {
             // indicate timeout
             LMIC.dataLen = 0;
@@ -802,12 +921,21 @@ void radio_irq_handler (u1_t dio) {
     }
     // go from stanby to sleep
     opmode(OPMODE_SLEEP);
+    cmdEnd();
     // run os job (use preset func ptr)
     os_setCallback(&LMIC.osjob, LMIC.osjob.func);
 }
 
+bit_t radio_rxcActive (u4_t freq, rps_t rps) {
+    return rxcont == RADIO_RXC && rxcFreq == freq && rxcRps == rps;
+}
+
 void os_radio (u1_t mode) {
     hal_disableIRQs();
+    if( rxcont ) { // any new request ends continuous RX
+        rxcont = 0;
+        opmode(OPMODE_SLEEP);
+    }
     switch (mode) {
       case RADIO_RST:
         // put radio to sleep
@@ -816,6 +944,7 @@ void os_radio (u1_t mode) {
       case RADIO_TX:
         // transmit frame now
         starttx(); // buf=LMIC.frame, len=LMIC.dataLen
+        CAPTURE(CAP_TX, os_getTime());
         break;
       
       case RADIO_RX:
@@ -827,6 +956,20 @@ void os_radio (u1_t mode) {
         // start scanning for beacon now
         startrx(RXMODE_SCAN); // buf=LMIC.frame
         break;
+
+      case RADIO_RXGW:
+        // receive uplinks continuously (freq=LMIC.freq, rps=LMIC.rps)
+        rxcont = RADIO_RXGW;
+        startrx(RXMODE_GW); // buf=LMIC.frame, one osjob callback per frame
+        break;
+
+      case RADIO_RXC:
+        // receive downlinks continuously (class C, freq=LMIC.freq, rps=LMIC.rps)
+        rxcont = RADIO_RXC;
+        rxcFreq = LMIC.freq;
+        rxcRps = LMIC.rps;
+        startrx(RXMODE_SCAN); // buf=LMIC.frame, one rxcJob callback per frame
+        break;
     }
     hal_enableIRQs();
 }
@@ -0,0 +1,89 @@
+/*******************************************************************************
+ * Several radios driven from one process: one LMIC instance per thread.
+ *******************************************************************************/
+
+#include "lmic.h"
+
+#if defined(CFG_multiradio)
+
+#include "radios.h"
+#include <pthread.h>
+
+struct radio_t {
+    u1_t         id;
+    u1_t         running;
+    lmic_pinmap* pins;
+    radiosetup_t setup;
+    pthread_t    thread;
+};
+
+static struct radio_t radios[MAX_RADIOS];
+static volatile int stopping;
+// os_init/LMIC_reset touch hardware setup and shared tables, run them one at a time
+static pthread_mutex_t initLock = PTHREAD_MUTEX_INITIALIZER;
+static OS_TLS u1_t self;
+
+OS_TLS lmic_pinmap* radio_pins = &pins;
+
+static void* radioMain (void* arg) {
+    struct radio_t* r = (struct radio_t*)arg;
+    self = r->id;
+    radio_pins = r->pins;
+    pthread_mutex_lock(&initLock);
+    os_init();
+    LMIC_reset();
+    r->setup(r->id);
+    pthread_mutex_unlock(&initLock);
+    while( !stopping )
+        os_runloop_once();
+    return NULL;
+}
+
+int radios_start (u1_t id, lmic_pinmap* pm, radiosetup_t setup) {
+    if( id >= MAX_RADIOS || radios[id].running )
+        return -1;
+    struct radio_t* r = &radios[id];
+    r->id = id;
+    r->pins = pm;
+    r->setup = setup;
+    stopping = 0;
+    if( pthread_create(&r->thread, NULL, radioMain, r) != 0 )
+        return -1;
+    r->running = 1;
+    return 0;
+}
+
+void radios_stop (void) {
+    stopping = 1;
+    for( u1_t id = 0; id < MAX_RADIOS; id++ ) {
+        if( radios[id].running ) {
+            pthread_join(radios[id].thread, NULL);
+            radios[id].running = 0;
+        }
+    }
+}
+
+u1_t radios_self (void) {
+    return self;
+}
+
+void radios_shareChannels (u1_t id, u1_t n) {
+#if defined(CFG_eu868)
+    u1_t nch = MAX_CHANNELS;
+#elif defined(CFG_us915)
+    u1_t nch = 72+MAX_XCHANNELS;
+    // one frequency for all 125kHz channels would make the radios collide
+    LMIC.chSpread = n > 1;
+#endif
+    for( u1_t ch = 0; ch < nch; ch++ ) {
+        if( ch % n != id )
+            LMIC_disableChannel(ch);
+#if defined(CFG_us915)
+        // a 500kHz channel spans 8 125kHz ones, which belong to all radios
+        else if( n > 1 && ch >= 64 && ch < 72 )
+            LMIC_disableChannel(ch);
+#endif
+    }
+}
+
+#endif // CFG_multiradio
@@ -0,0 +1,46 @@
+/*******************************************************************************
+ * Several radios driven from one process (enabled with CFG_multiradio).
+ *
+ * Each radio runs its own LMIC instance in a thread of its own: LMIC, the
+ * job queue, the AES state and the radio/HAL state are thread-local, so the
+ * MAC code is unchanged. Application callbacks (onEvent, os_getDevEui, ...)
+ * are called on the radio's thread and can tell the radios apart with
+ * radios_self(). Every radio needs a session of its own (DevAddr, keys), as
+ * frame counters and MAC state are per LMIC instance.
+ *******************************************************************************/
+
+#ifndef _radios_h_
+#define _radios_h_
+
+#include "local_hal.h"
+
+enum { MAX_RADIOS = 4 };
+
+typedef void (*radiosetup_t) (u1_t id);
+
+/*
+ * start radio id with pin mapping pm (0=ok, -1=error).
+ *   - the thread runs os_init(), LMIC_reset() and setup(id) (one radio at a
+ *     time), then os_runloop_once() until radios_stop()
+ */
+int radios_start (u1_t id, lmic_pinmap* pm, radiosetup_t setup);
+
+/*
+ * stop and join all radio threads.
+ */
+void radios_stop (void);
+
+/*
+ * id of the radio driven by the calling thread.
+ */
+u1_t radios_self (void);
+
+/*
+ * spread uplinks: keep only channels ch with ch % n == id enabled. US915 with
+ * n > 1: 125kHz uplinks go out on their own channel frequency instead of all
+ * on channel 0, and the 500kHz channels 64..71 (overlapping 8 of them each)
+ * are disabled.
+ */
+void radios_shareChannels (u1_t id, u1_t n);
+
+#endif // _radios_h_
@@ -0,0 +1,133 @@
+/*******************************************************************************
+ * Random number pool: ChaCha20 keyed from the kernel entropy pool.
+ *******************************************************************************/
+
+#include "lmic.h"
+
+#if defined(CFG_rngpool)
+
+#if defined(CFG_halrec) || defined(CFG_halreplay)
+#error CFG_rngpool does not draw its randomness through the HAL, logs would not replay
+#endif
+
+#include "rng.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/random.h>
+
+enum { RNG_KEY = 32, RNG_POOL = RNG_BLOCKS*64 };
+
+static OS_TLS struct {
+    u4_t key[RNG_KEY/4];
+    u2_t idx;       // next unused byte in pool (RNG_POOL=empty)
+    u2_t refills;   // since the last getrandom() re-key (0=never keyed)
+    u1_t pool[RNG_POOL];
+} rng = { { 0 }, RNG_POOL, 0 };
+
+#define ROTL(v,n) (((v)<<(n)) | ((v)>>(32-(n))))
+#define QR(a,b,c,d) \
+    a += b; d ^= a; d = ROTL(d,16); \
+    c += d; b ^= c; b = ROTL(b,12); \
+    a += b; d ^= a; d = ROTL(d, 8); \
+    c += d; b ^= c; b = ROTL(b, 7)
+
+// ChaCha20 block (RFC 7539) with a zero nonce
+static void chachaBlock (u4_t* out, const u4_t* key, u4_t ctr) {
+    u4_t in[16] = { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+                    key[0], key[1], key[2], key[3], key[4], key[5], key[6], key[7],
+                    ctr, 0, 0, 0 };
+    u4_t x[16];
+    os_copyMem(x, in, sizeof(x));
+    for( u1_t i = 0; i < 10; i++ ) {
+        QR(x[0], x[4], x[ 8], x[12]);
+        QR(x[1], x[5], x[ 9], x[13]);
+        QR(x[2], x[6], x[10], x[14]);
+        QR(x[3], x[7], x[11], x[15]);
+        QR(x[0], x[5], x[10], x[15]);
+        QR(x[1], x[6], x[11], x[12]);
+        QR(x[2], x[7], x[ 8], x[13]);
+        QR(x[3], x[4], x[ 9], x[14]);
+    }
+    for( u1_t i = 0; i < 16; i++ )
+        out[i] = x[i] + in[i];
+}
+
+static void kernelKey (void) {
+    u1_t* k = (u1_t*)rng.key;
+    int n = 0;
+    while( n < RNG_KEY ) {
+        ssize_t r = getrandom(k+n, RNG_KEY-n, 0);
+        if( r < 0 && errno == EINTR )
+            continue;
+        if( r < 0 ) // no getrandom() syscall (kernel < 3.17)
+            break;
+        n += r;
+    }
+    if( n < RNG_KEY ) {
+        int fd = open("/dev/urandom", O_RDONLY);
+        if( fd < 0 || read(fd, k, RNG_KEY) != RNG_KEY )
+            hal_failed(__FILE__, __LINE__);
+        close(fd);
+    }
+    rng.refills = 1;
+}
+
+// new pool: first block's key part replaces the key (fast key erasure)
+static void refill (void) {
+    if( rng.refills == 0 || rng.refills >= RNG_RESEED )
+        kernelKey();
+    else
+        rng.refills++;
+    u4_t blk[16];
+    for( u1_t b = 0; b < RNG_BLOCKS; b++ ) {
+        chachaBlock(blk, rng.key, b);
+        os_copyMem(rng.pool + b*64, blk, 64);
+    }
+    os_copyMem(rng.key, rng.pool, RNG_KEY);
+    os_clearMem(blk, sizeof(blk));
+    rng.idx = RNG_KEY;
+}
+
+void rng_mix (xref2cu1_t buf, u1_t len) {
+    if( rng.refills == 0 )
+        kernelKey();
+    for( u1_t i = 0; i < len; i++ )
+        ((u1_t*)rng.key)[i % RNG_KEY] ^= buf[i];
+    rng.idx = RNG_POOL; // pool came from the old key
+}
+
+void rng_fill (xref2u1_t buf, u2_t len) {
+    while( len ) {
+        if( rng.idx == RNG_POOL )
+            refill();
+        u2_t n = RNG_POOL - rng.idx < len ? RNG_POOL - rng.idx : len;
+        os_copyMem(buf, rng.pool + rng.idx, n);
+        os_clearMem(rng.pool + rng.idx, n); // handed out once only
+        rng.idx += n;
+        buf += n;
+        len -= n;
+    }
+}
+
+u1_t rng_u1 (void) {
+    if( rng.idx == RNG_POOL )
+        refill();
+    u1_t v = rng.pool[rng.idx];
+    rng.pool[rng.idx++] = 0;
+    return v;
+}
+
+u2_t rng_u2 (void) {
+    if( rng.idx > RNG_POOL-2 ) {
+        u1_t b[2];
+        rng_fill(b, 2);
+        return os_rlsbf2(b);
+    }
+    u2_t v = os_rlsbf2(rng.pool + rng.idx);
+    rng.pool[rng.idx] = rng.pool[rng.idx+1] = 0;
+    rng.idx += 2;
+    return v;
+}
+
+#endif // CFG_rngpool
@@ -0,0 +1,31 @@
+/*******************************************************************************
+ * Random number pool (enabled with CFG_rngpool in config.h).
+ *
+ * os_getRndU1()/os_getRndU2() are served from a pool refilled RNG_BLOCKS
+ * ChaCha20 blocks at a time. The key comes from getrandom() (/dev/urandom on
+ * old kernels) and is replaced by the first 32 bytes of every refill, so
+ * earlier output cannot be recovered from the state. The radio's wideband RSSI
+ * noise is mixed into the key by radio_init(), and the key is re-drawn from the
+ * kernel every RNG_RESEED refills. The AES key of the MAC is never touched.
+ *******************************************************************************/
+
+#ifndef _rng_h_
+#define _rng_h_
+
+enum { RNG_BLOCKS = 8 };      // ChaCha20 blocks (64 bytes) per refill
+enum { RNG_RESEED = 4096 };   // refills between getrandom() re-keys
+
+/*
+ * XOR buf into the key and start a new pool with it.
+ */
+void rng_mix (xref2cu1_t buf, u1_t len);
+
+/*
+ * fill buf with random bytes.
+ */
+void rng_fill (xref2u1_t buf, u2_t len);
+
+u1_t rng_u1 (void);
+u2_t rng_u2 (void);
+
+#endif // _rng_h_
@@ -0,0 +1,206 @@
+/*******************************************************************************
+ * Low-overhead tick source: CPU counter scaled to osticks.
+ *
+ * tick_now() is a counter read, one subtraction and one multiply-shift. The
+ * scale factor lives in one of two slots; the thread that notices an expired
+ * re-sync interval computes the next slot and publishes it, readers never
+ * block.
+ *******************************************************************************/
+
+#include "lmic.h"
+
+#if defined(CFG_fastticks)
+
+#include "tick.h"
+#include <time.h>
+#include <signal.h>
+#include <setjmp.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#include <cpuid.h>
+#define TICK_TSC 1
+#elif defined(__aarch64__) || (defined(__arm__) && __ARM_ARCH >= 7)
+#define TICK_CNTVCT 1
+#endif
+
+enum { TICK_STEP_ms = 100 };     // clock ahead by more: step instead of slew
+
+struct tickscale_t {
+    u8_t      cbase;   // counter at re-sync
+    osticks_t tbase;   // ticks at re-sync
+    u8_t      mult;    // ticks = tbase + (counter-cbase)*mult >> shift
+    u8_t      dmax;    // largest counter delta the multiply can take
+    u8_t      resync;  // counter delta after which to re-sync
+};
+
+static struct tickscale_t scale[2];
+static u1_t   cur;       // slot readers use
+static u1_t   busy;      // re-sync in progress
+static u1_t   counting;  // counter usable
+static u1_t   shift;
+static s8_t   nstart;    // CLOCK_MONOTONIC at tick_init()
+static u8_t   ccal;      // counter at calibration start
+static s8_t   ncal;      // CLOCK_MONOTONIC at calibration start
+static struct tickstat_t stat = { "clock", 0, 0, 0, 0 };
+
+static s8_t clockNs (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (s8_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static osticks_t nsToTicks (s8_t ns) {
+    return (osticks_t)((ns / 1000000000) * OSTICKS_PER_SEC
+                       + (ns % 1000000000) * OSTICKS_PER_SEC / 1000000000);
+}
+
+static osticks_t clockTicks (void) {
+    return nsToTicks(clockNs() - nstart);
+}
+
+#if defined(TICK_TSC)
+
+static inline u8_t readCounter (void) {
+    return __rdtsc();
+}
+
+// only an invariant TSC runs at a constant rate across P/C-states
+static int counterUsable (void) {
+    unsigned a, b, c, d;
+    if( !__get_cpuid(0x80000007, &a, &b, &c, &d) || (d & (1<<8)) == 0 )
+        return 0;
+    stat.source = "tsc";
+    return 1;
+}
+
+#elif defined(TICK_CNTVCT)
+
+static inline u8_t readCounter (void) {
+    u8_t v;
+#if defined(__aarch64__)
+    asm volatile("isb\n\tmrs %0, cntvct_el0" : "=r" (v));
+#else
+    asm volatile("isb\n\tmrrc p15, 1, %Q0, %R0, c14" : "=r" (v));
+#endif
+    return v;
+}
+
+static sigjmp_buf probeJmp;
+
+static void probeFault (int sig) {
+    siglongjmp(probeJmp, 1);
+}
+
+// the kernel may not grant user space access to the virtual counter (SIGILL)
+static int counterUsable (void) {
+    struct sigaction sa, old;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = probeFault;
+    sigaction(SIGILL, &sa, &old);
+    int ok = 0;
+    if( sigsetjmp(probeJmp, 1) == 0 ) {
+        u8_t c0 = readCounter();
+        ok = readCounter() - c0 < (1ULL<<32);
+    }
+    sigaction(SIGILL, &old, NULL);
+    if( ok )
+        stat.source = "cntvct";
+    return ok;
+}
+
+#else
+
+static inline u8_t readCounter (void) {
+    return 0;
+}
+
+static int counterUsable (void) {
+    return 0;
+}
+
+#endif
+
+// fill slot with rate ticks per counter cycle, starting at (c, t)
+static void setScale (struct tickscale_t* s, u8_t c, osticks_t t, double rate, double freq) {
+    s->cbase  = c;
+    s->tbase  = t;
+    s->mult   = (u8_t)(rate * (double)(1ULL << shift) + 0.5);
+    s->dmax   = ~0ULL / s->mult;
+    s->resync = (u8_t)(freq * TICK_RESYNC_ms / 1000);
+}
+
+// called by the one thread that won the busy flag
+static osticks_t resync (const struct tickscale_t* o, u8_t c) {
+    s8_t ns = clockNs();
+    osticks_t ref = nsToTicks(ns - nstart);
+    u8_t d = c - o->cbase;
+    osticks_t t = d <= o->dmax ? o->tbase + (osticks_t)((d * o->mult) >> shift) : ref;
+    s4_t err = os_timeDiff(ref, t);
+    if( err > ms2osticks(TICK_STEP_ms) ) { // e.g. resumed from suspend
+        t = ref;
+        err = 0;
+    }
+    // long-term counter frequency, then slew towards the clock
+    double freq = (double)(c - ccal) * 1e9 / (double)(ns - ncal);
+    double r = (double)OSTICKS_PER_SEC * TICK_RESYNC_ms / 1000;
+    double corr = err;
+    if( corr > r * TICK_SLEW_ppm / 1e6 )  corr =  r * TICK_SLEW_ppm / 1e6;
+    if( corr < -r * TICK_SLEW_ppm / 1e6 ) corr = -r * TICK_SLEW_ppm / 1e6;
+    u1_t next = cur ^ 1;
+    setScale(&scale[next], c, t, OSTICKS_PER_SEC / freq * (1 + corr / r), freq);
+    __atomic_store_n(&cur, next, __ATOMIC_RELEASE);
+
+    stat.freq = (u8_t)(freq + 0.5);
+    stat.resyncs++;
+    stat.lastErr = err;
+    if( err > stat.maxErr || -err > stat.maxErr )
+        stat.maxErr = err < 0 ? -err : err;
+    __atomic_clear(&busy, __ATOMIC_RELEASE);
+    return t;
+}
+
+int tick_init (void) {
+    nstart = clockNs();
+    counting = 0;
+    if( !counterUsable() )
+        return -1;
+
+    // initial calibration
+    ncal = clockNs();
+    ccal = readCounter();
+    struct timespec ts = { 0, TICK_CALIB_ms * 1000000L };
+    nanosleep(&ts, NULL);
+    s8_t ns = clockNs();
+    u8_t c = readCounter();
+    double freq = (double)(c - ccal) * 1e9 / (double)(ns - ncal);
+    if( freq < 1e6 ) { // must be much finer than one tick
+        stat.source = "clock";
+        return -1;
+    }
+    // largest shift keeping mult below 2^32 (counter deltas up to 2^32 are safe)
+    for( shift = 0; shift < 47 && ((u8_t)OSTICKS_PER_SEC << (shift+1)) / freq < 4294967296.0; shift++ )
+        ;
+    cur = 0;
+    setScale(&scale[0], c, nsToTicks(ns - nstart), OSTICKS_PER_SEC / freq, freq);
+    stat.freq = (u8_t)(freq + 0.5);
+    counting = 1;
+    return 0;
+}
+
+osticks_t tick_now (void) {
+    if( !counting )
+        return clockTicks();
+    const struct tickscale_t* s = &scale[__atomic_load_n(&cur, __ATOMIC_ACQUIRE)];
+    u8_t d = readCounter() - s->cbase;
+    if( d >= s->resync && !__atomic_test_and_set(&busy, __ATOMIC_ACQUIRE) )
+        return resync(s, s->cbase + d);
+    if( d > s->dmax ) // overdue and another thread is re-syncing
+        return clockTicks();
+    return s->tbase + (osticks_t)((d * s->mult) >> shift);
+}
+
+void tick_stats (struct tickstat_t* st) {
+    *st = stat;
+}
+
+#endif // CFG_fastticks
@@ -0,0 +1,41 @@
+/*******************************************************************************
+ * Low-overhead tick source (enabled with CFG_fastticks in config.h).
+ *
+ * hal_ticks() reads the CPU's free-running counter (ARM generic timer
+ * CNTVCT, x86 invariant TSC) instead of calling clock_gettime(). The counter
+ * is scaled with a multiply-shift factor calibrated against CLOCK_MONOTONIC at
+ * startup and re-synced every TICK_RESYNC_ms: the factor is slewed so the tick
+ * count follows the clock without ever going backwards. Without a usable
+ * counter every call falls back to clock_gettime(CLOCK_MONOTONIC).
+ *******************************************************************************/
+
+#ifndef _tick_h_
+#define _tick_h_
+
+enum { TICK_CALIB_ms = 20 };     // initial calibration interval
+enum { TICK_RESYNC_ms = 500 };   // re-sync interval against CLOCK_MONOTONIC
+enum { TICK_SLEW_ppm = 500 };    // max. rate correction per re-sync
+
+struct tickstat_t {
+    const char* source;  // "cntvct", "tsc" or "clock"
+    u8_t        freq;    // counter frequency in Hz (0 for clock)
+    u4_t        resyncs;
+    s4_t        lastErr; // clock - ticks at last re-sync (in ticks)
+    s4_t        maxErr;  // largest |lastErr| seen
+};
+
+/*
+ * select and calibrate the counter (0=counter in use, -1=clock fallback).
+ *   - ticks count from 0 at this call
+ */
+int tick_init (void);
+
+/*
+ * current time in ticks.
+ *   - safe to call from several threads (IRQ threads and run loop)
+ */
+osticks_t tick_now (void);
+
+void tick_stats (struct tickstat_t* st);
+
+#endif // _tick_h_